@@ -1,30 +1,79 @@
+#include <errno.h>
+#include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
 
 #include <algorithm>
-#include <fstream>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
 #include <iostream>
 #include <map>
 #include <memory>
+#include <mutex>
+#include <numeric>
+#include <set>
 #include <sstream>
 #include <string>
+#include <thread>
 #include <vector>
 
 #include <FLAC/all.h>
 #include <mpg123.h>
 #include <opus/opusfile.h>
+#include <vorbis/vorbisenc.h>
 #include <vorbis/vorbisfile.h>
 
 #ifdef _WIN32
 #include <windows.h>
 // Empty line to prevent clang-format moving it up
+#include <conio.h>
+#include <fcntl.h>
+#include <io.h>
+#include <mmreg.h>
+#include <psapi.h>
 #include <shellapi.h>
+#include <sys/stat.h>
 static void CALLBACK waveOutProc(HWAVEOUT, UINT, DWORD, DWORD, DWORD);
 #elif __linux__
 #include <alsa/asoundlib.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <termios.h>
+#include <unistd.h>
+#ifdef LOOPER_IO_URING
+#include <liburing.h>
+#endif
 #define PCM_DEVICE "default"
 #endif
 
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || \
+    defined(_M_IX86)
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#if defined(__SSE2__) || defined(_M_X64) || \
+    (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define LOOPER_SSE2 1
+// AVX2 code is compiled per function and only runs after a CPUID check, so
+// the binary still starts on machines without it.
+#define LOOPER_AVX2 1
+#ifdef __GNUC__
+#define LOOPER_TARGET_AVX2 __attribute__((target("avx2")))
+#else
+#define LOOPER_TARGET_AVX2
+#endif
+#endif
+#endif
+
 #include <experimental/filesystem>
 namespace fs = std::experimental::filesystem;
 
@@ -146,11 +195,20 @@ std::vector<std::basic_string<CharType>> split(
 
 class TraceMessage {
  public:
+  // Set on threads that report their problems some other way, such as the
+  // library scanner's workers.
+  static bool& Muted() {
+    static thread_local bool muted = false;
+    return muted;
+  }
+
   static void log(const char* function_name,
                   const char* log_,
                   const char* filename,
                   const int linenumber,
                   LogLevel level) {
+    if (Muted())
+      return;
     switch (level) {
       case LogLevel::ERR: {
         std::string log_info =
@@ -198,7 +256,11 @@ enum class AudioStatus : int {
   kUknownError = 3
 };
 
+// Puts the terminal back the way interactive control found it.
+void RestoreTerminal();
+
 void AudioExitProcess(AudioStatus status) {
+  RestoreTerminal();
 #ifdef __linux__
   ::_Exit(static_cast<int>(status));
 #elif _WIN32
@@ -206,17 +268,176 @@ void AudioExitProcess(AudioStatus status) {
 #endif
 }
 
+// Settings collected from the command line before playback starts.
+typedef struct _LooperOptions {
+  // Size of the PCM ring between the decoder and the output thread, in
+  // milliseconds of audio. Zero writes straight to the device.
+  int ring_ms = 500;
+  // The output thread waits until the ring is this full (percent) before it
+  // starts writing, and the decoder stops producing once it gets there.
+  int high_watermark = 75;
+  // A decoder that hit the high watermark resumes below this level.
+  int low_watermark = 50;
+  // How much of the next track is decoded ahead while the current one plays.
+  int preroll_ms = 300;
+  // Seconds of each file read ahead of its decoder by an I/O thread; zero
+  // has decoders read their files directly.
+  double read_ahead_seconds = 0.0;
+  // Bytes the PCM ring, read-ahead and decode buffers may use together;
+  // zero is unlimited.
+  size_t memory_budget = 0;
+  // Every track plays from --start to --end, in seconds; an end of zero
+  // plays on to the end of the track.
+  double start_seconds = 0.0;
+  double end_seconds = 0.0;
+  // Where decoded audio goes: device, null, wav:<path> or raw:<path>.
+  std::string output = "device";
+  // Write to ALSA through MMAP_INTERLEAVED access when the device has it.
+  bool mmap = false;
+  // Requested ALSA period and buffer length in microseconds; zero keeps
+  // whatever the device picks. Writes are batched into whole periods.
+  int period_us = 0;
+  int buffer_us = 0;
+  // --float decodes to float32 and converts to integer PCM once, after the
+  // gain below has been applied.
+  bool float_pipeline = false;
+  // Playback gain in dB, on top of any ReplayGain.
+  double volume_db = 0.0;
+  // Which ReplayGain tags to apply: off, track or album.
+  std::string replaygain = "off";
+  // Metadata index file; empty picks the per-user cache, "off" disables it.
+  std::string index;
+  // Filter length of the built-in resampler, used when the device runs at a
+  // different rate than the stream: low, medium or high.
+  std::string resample_quality = "medium";
+  // --probe prints tags and format of every file as JSON lines and exits.
+  bool probe = false;
+  // Threads for scanning, probing, verifying, exporting and analysing; zero
+  // uses every core.
+  int jobs = 0;
+  // --bench decodes every file flat out into a null sink and reports speed.
+  bool bench = false;
+  // Length of the signals synthesised when --bench is given no files.
+  int bench_seconds = 60;
+  // --verify decodes every file on all cores, checking FLAC MD5 signatures,
+  // Ogg page CRCs and MP3 frame sync, and reports damage instead of playing.
+  bool verify = false;
+  // --check runs the same checks on each track that plays to its end.
+  bool check = false;
+  // --export=DIR decodes every file into DIR instead of playing it, as
+  // WAV (RF64 past 4 GiB) or raw PCM.
+  std::string export_dir;
+  std::string export_format = "wav";
+  // --analyze-loudness measures EBU R128 loudness and true peak of every
+  // file and album on all cores and keeps them in the index, where playback
+  // finds them for files without ReplayGain tags.
+  bool analyze_loudness = false;
+} LooperOptions;
+
+LooperOptions& GetOptions() {
+  static LooperOptions options;
+  return options;
+}
+
 bool IsLittleEndian() {
   int num = 1;
   return (*(char*)&num == 1);
 }
 
+// Speaker positions, numbered like the bits of a WAVE channel mask.
+enum class Speaker : uint8_t { FL, FR, FC, LFE, BL, BR, FLC, FRC, BC, SL, SR };
+
+// The speaker each interleaved channel feeds, in stream order.
+typedef struct _ChannelLayout {
+  int count = 0;
+  Speaker speakers[8];
+} ChannelLayout;
+
+ChannelLayout MakeLayout(const Speaker* speakers, int count) {
+  ChannelLayout layout;
+  layout.count = count;
+  std::copy(speakers, speakers + count, layout.speakers);
+  return layout;
+}
+
+// WAVE and FLAC order: channel mask bit order.
+ChannelLayout WaveChannelLayout(int channels) {
+  using S = Speaker;
+  static const Speaker orders[8][8] = {
+      {S::FC},
+      {S::FL, S::FR},
+      {S::FL, S::FR, S::FC},
+      {S::FL, S::FR, S::BL, S::BR},
+      {S::FL, S::FR, S::FC, S::BL, S::BR},
+      {S::FL, S::FR, S::FC, S::LFE, S::BL, S::BR},
+      {S::FL, S::FR, S::FC, S::LFE, S::BC, S::SL, S::SR},
+      {S::FL, S::FR, S::FC, S::LFE, S::BL, S::BR, S::SL, S::SR}};
+  if (channels < 1 || channels > 8)
+    return ChannelLayout();
+  return MakeLayout(orders[channels - 1], channels);
+}
+
+// Vorbis order, which Opus mapping family 1 shares.
+ChannelLayout VorbisChannelLayout(int channels) {
+  using S = Speaker;
+  static const Speaker orders[8][8] = {
+      {S::FC},
+      {S::FL, S::FR},
+      {S::FL, S::FC, S::FR},
+      {S::FL, S::FR, S::BL, S::BR},
+      {S::FL, S::FC, S::FR, S::BL, S::BR},
+      {S::FL, S::FC, S::FR, S::BL, S::BR, S::LFE},
+      {S::FL, S::FC, S::FR, S::SL, S::SR, S::BC, S::LFE},
+      {S::FL, S::FC, S::FR, S::SL, S::SR, S::BL, S::BR, S::LFE}};
+  if (channels < 1 || channels > 8)
+    return ChannelLayout();
+  return MakeLayout(orders[channels - 1], channels);
+}
+
+// A WAVE_FORMAT_EXTENSIBLE channel mask; falls back to the default order
+// when the mask does not name exactly |channels| known speakers.
+ChannelLayout LayoutFromWaveMask(uint32_t mask, int channels) {
+  ChannelLayout layout;
+  for (int bit = 0; bit <= static_cast<int>(Speaker::SR); bit++) {
+    if ((mask & (1u << bit)) && layout.count < 8)
+      layout.speakers[layout.count++] = static_cast<Speaker>(bit);
+  }
+  if (layout.count != channels || (mask >> (static_cast<int>(Speaker::SR) + 1)))
+    return WaveChannelLayout(channels);
+  return layout;
+}
+
+bool SameLayout(const ChannelLayout& a, const ChannelLayout& b) {
+  return a.count == b.count &&
+         std::equal(a.speakers, a.speakers + a.count, b.speakers);
+}
+
 typedef struct _AudioFormat {
   int channels, encoding, sample_rate, bits_per_sample;
-  bool big_endian;
-  _AudioFormat() { big_endian = !IsLittleEndian(); }
+  bool big_endian, is_float;
+  // Left empty by decoders whose output is already in WAVE order.
+  ChannelLayout layout;
+  _AudioFormat() {
+    channels = encoding = sample_rate = bits_per_sample = 0;
+    big_endian = !IsLittleEndian();
+    is_float = false;
+  }
 
 } AudioFormat;
+
+ChannelLayout LayoutOf(const AudioFormat& format) {
+  if (format.layout.count == format.channels)
+    return format.layout;
+  return WaveChannelLayout(format.channels);
+}
+
+// True when two streams can share an open device without renegotiating.
+bool SameFormat(const AudioFormat& a, const AudioFormat& b) {
+  return a.channels == b.channels && a.sample_rate == b.sample_rate &&
+         a.bits_per_sample == b.bits_per_sample &&
+         a.big_endian == b.big_endian && a.is_float == b.is_float &&
+         SameLayout(LayoutOf(a), LayoutOf(b));
+}
 typedef struct _WaveHeader {
   uint32_t ChunkID;
   uint32_t ChunkSize;
@@ -233,936 +454,7583 @@ typedef struct _WaveHeader {
   uint32_t Subchunk2Size;
 } WaveHeader;
 
-typedef int AudioResult;
-
-AudioFormat Format_From_WaveHeader(const WaveHeader& header) {
-  AudioFormat fmt;
-  fmt.bits_per_sample = header.BitsPerSample;
-  fmt.channels = header.NumChannels;
-  fmt.sample_rate = header.SampleRate;
-  return fmt;
-}
-
-#ifdef _WIN32
+// Sizes of an RF64 file, which outgrew the 32-bit fields of WaveHeader (EBU
+// Tech 3306). Written as a JUNK chunk of the same size until it is needed.
+typedef struct _Ds64Chunk {
+  uint32_t ChunkID;
+  uint32_t ChunkSize;
+  uint32_t RiffSizeLow;
+  uint32_t RiffSizeHigh;
+  uint32_t DataSizeLow;
+  uint32_t DataSizeHigh;
+  uint32_t SampleCountLow;
+  uint32_t SampleCountHigh;
+  uint32_t TableLength;
+} Ds64Chunk;
 
-// based on
-// https://www.planet-source-code.com/vb/scripts/ShowCode.asp?txtCodeId=4422&lngWId=3
-// based on
-// https://chromium.googlesource.com/chromium/src.git/+/master/media/audio/win/waveout_output_win.cc
+typedef int AudioResult;
 
-class SimplePlayer {
+// Keeps the large buffers, decode buffers, PCM ring and read-ahead, within
+// --memory-budget. A request shrinks to what is left but never below what
+// its owner needs to make progress, so a tight budget costs headroom rather
+// than playback.
+class MemoryBudget {
  public:
-  explicit SimplePlayer(int block_count = default_block_count,
-                        int block_size = default_block_size)
-      : block_size(block_size), block_count(block_count) {
-    free_blocks_count = block_count;
+  // Zero leaves memory unlimited and only counts it.
+  void SetLimit(size_t bytes) { limit = bytes; }
+
+  // Charges up to |wanted| bytes, at least |needed|, and returns the amount
+  // charged, which goes back through Refund.
+  size_t Grant(size_t wanted, size_t needed) {
+    std::lock_guard<std::mutex> lock(mutex);
+    size_t granted = wanted;
+    if (limit > 0) {
+      size_t left = (limit > used) ? limit - used : 0;
+      granted = (std::max)((std::min)(wanted, left), needed);
+      if (granted > left && !warned) {
+        warned = true;
+        std::string message = string_format(
+            "Memory budget of %zu KiB exceeded", limit / 1024);
+        TRACE_WARNING(message.c_str());
+      }
+    }
+    used += granted;
+    peak = (std::max)(peak, used);
+    return granted;
+  }
 
-    InitializeCriticalSection(&waveCriticalSection);
+  void Refund(size_t bytes) {
+    std::lock_guard<std::mutex> lock(mutex);
+    used -= (std::min)(bytes, used);
   }
 
-  void SetupBlocks() {
-    current_block = 0;
-    blocks = std::make_unique<unsigned char[]>(block_count * GetBlockSize());
-    for (int ix = 0; ix < block_count; ++ix) {
-      WAVEHDR* block = GetBlock(ix);
-      block->lpData = reinterpret_cast<char*>(block) + sizeof(WAVEHDR);
-      block->dwBufferLength = block_size;
-      block->dwBytesRecorded = 0;
-      block->dwFlags = WHDR_DONE;
-      block->dwLoops = 0;
-    }
+  size_t Limit() const { return limit; }
+  size_t Peak() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return peak;
   }
 
-  void SetFormat(const AudioFormat& fmt) {
-    wfx.nSamplesPerSec = fmt.sample_rate;
-    wfx.wBitsPerSample = static_cast<WORD>(fmt.bits_per_sample);
-    wfx.nChannels = static_cast<WORD>(fmt.channels);
-    wfx.cbSize = 0;
-    wfx.wFormatTag = WAVE_FORMAT_PCM;
-    wfx.nBlockAlign = (wfx.wBitsPerSample * wfx.nChannels) >> 3;
-    wfx.nAvgBytesPerSec = wfx.nBlockAlign * wfx.nSamplesPerSec;
+ private:
+  std::mutex mutex;
+  size_t limit = 0, used = 0, peak = 0;
+  bool warned = false;
+};
+
+// Never destroyed: a reader thread may free its ring while the process
+// exits.
+MemoryBudget& GetMemoryBudget() {
+  static MemoryBudget* budget = new MemoryBudget;
+  return *budget;
+}
+
+size_t RoundUpPowerOfTwo(size_t size) {
+  size_t power = 1;
+  while (power < size)
+    power <<= 1;
+  return power;
+}
+
+// Decode and preroll buffers, kept by power-of-two size and handed from one
+// track to the next instead of being allocated for each. Fresh buffers are
+// left uninitialised, so only the pages a decoder writes become resident.
+class BufferPool {
+ public:
+  // Returns a buffer of at least |size| bytes; *capacity receives how many.
+  std::unique_ptr<char[]> Acquire(size_t size, size_t* capacity) {
+    *capacity = RoundUpPowerOfTwo((std::max)(size, size_t(min_size)));
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      auto it = free.find(*capacity);
+      if (it != free.end() && !it->second.empty()) {
+        std::unique_ptr<char[]> buffer = std::move(it->second.back());
+        it->second.pop_back();
+        return buffer;
+      }
+    }
+    GetMemoryBudget().Grant(*capacity, *capacity);
+    return std::unique_ptr<char[]>(new char[*capacity]);
   }
 
-  void Open() {
-    if (::waveOutOpen(&hWaveOut, WAVE_MAPPER,
-                      reinterpret_cast<LPCWAVEFORMATEX>(&wfx),
-                      reinterpret_cast<DWORD_PTR>(waveOutProc),
-                      reinterpret_cast<DWORD_PTR>(this),
-                      CALLBACK_FUNCTION) != MMSYSERR_NOERROR) {
-      TRACE_INFO("unable to open wave mapper device");
-      AudioExitProcess(AudioStatus::kAudioDeviceError);
+  void Release(std::unique_ptr<char[]> buffer, size_t capacity) {
+    std::lock_guard<std::mutex> lock(mutex);
+    std::vector<std::unique_ptr<char[]>>& bucket = free[capacity];
+    if (bucket.size() < kept_per_size) {
+      bucket.push_back(std::move(buffer));
     } else {
-      TRACE_INFO("Opening Device");
+      GetMemoryBudget().Refund(capacity);
     }
-    // if (::waveOutSetVolume(hWaveOut, 0xFFFFFFFF) != MMSYSERR_NOERROR)
-    // {
-    //         TRACE_INFO("Failed to Set Device");
-    // }
   }
 
-  int BitsPerSample() { return wfx.wBitsPerSample; }
+ private:
+  // Playback holds at most the current and the next track's buffers.
+  enum { min_size = 0x1000, kept_per_size = 2 };
 
-  int Channels() { return wfx.nChannels; }
+  std::mutex mutex;
+  std::map<size_t, std::vector<std::unique_ptr<char[]>>> free;
+};
 
-  void IncrementBlock() {
-    EnterCriticalSection(&waveCriticalSection);
-    free_blocks_count++;
-    LeaveCriticalSection(&waveCriticalSection);
-  }
+BufferPool& GetBufferPool() {
+  static BufferPool pool;
+  return pool;
+}
 
-  void DecrementBlock() {
-    EnterCriticalSection(&waveCriticalSection);
-    free_blocks_count--;
-    LeaveCriticalSection(&waveCriticalSection);
+// A buffer borrowed from the pool for as long as it lives. Size() is what
+// has been asked for or filled; Capacity() can be larger.
+class PooledBuffer {
+ public:
+  PooledBuffer() = default;
+  explicit PooledBuffer(size_t size) : size(size) {
+    data = GetBufferPool().Acquire(size, &capacity);
   }
-  void FreeBlocks() {
-    while (free_blocks_count < block_count)
-      Sleep(10);
-    for (int ix = 0; ix < block_count; ++ix) {
-      ::waveOutUnprepareHeader(hWaveOut, GetBlock(ix), sizeof(WAVEHDR));
-    }
-    blocks.reset();
+  PooledBuffer(PooledBuffer&& other) noexcept { *this = std::move(other); }
+  ~PooledBuffer() { Release(); }
+
+  PooledBuffer& operator=(PooledBuffer&& other) noexcept {
+    Release();
+    data = std::move(other.data);
+    size = other.size;
+    capacity = other.capacity;
+    other.size = other.capacity = 0;
+    return *this;
   }
 
-  void WriteAudio(LPSTR data, int size) {
-    WAVEHDR* current;
-    int remain;
-
-    current = GetBlock(current_block);
+  char* Data() { return data.get(); }
+  size_t Size() const { return size; }
+  size_t Capacity() const { return capacity; }
+  // Within Capacity() only.
+  void Resize(size_t size_) { size = (std::min)(size_, capacity); }
 
-    while (size > 0) {
-      if (current->dwFlags & WHDR_PREPARED)
-        waveOutUnprepareHeader(hWaveOut, current, sizeof(WAVEHDR));
+ private:
+  void Release() {
+    if (data)
+      GetBufferPool().Release(std::move(data), capacity);
+  }
 
-      if (size < (int)(block_size - current->dwUser)) {
-        memcpy(current->lpData + current->dwUser, data, size);
-        current->dwUser += size;
-        break;
-      }
+  std::unique_ptr<char[]> data;
+  size_t size = 0, capacity = 0;
+};
 
-      remain = block_size - current->dwUser;
-      memcpy(current->lpData + current->dwUser, data, remain);
-      size -= remain;
-      data += remain;
-      current->dwBufferLength = block_size;
+// Lock-free single producer / single consumer byte ring. The decoder thread
+// is the only writer and the output thread the only reader; head and tail
+// are free running counters so a full ring is distinguishable from an empty
+// one without wasting a slot.
+class PcmRingBuffer {
+ public:
+  ~PcmRingBuffer() { GetMemoryBudget().Refund(Capacity()); }
+
+  // Empties the ring and sizes it to |capacity| rounded up to a power of
+  // two, or smaller when the memory budget runs short, down to |minimum|.
+  // A ring that keeps its size keeps its memory.
+  void Reset(size_t capacity, size_t minimum = 0) {
+    size_t size = RoundUpPowerOfTwo(capacity);
+    if (!data || size != Capacity()) {
+      MemoryBudget& budget = GetMemoryBudget();
+      budget.Refund(Capacity());
+      data.reset();
+      mask = 0;
+      size_t granted = budget.Grant(size, RoundUpPowerOfTwo(minimum));
+      while (size > granted)
+        size >>= 1;
+      budget.Refund(granted - size);
+      data = std::make_unique<char[]>(size);
+      mask = size - 1;
+    }
+    head.store(0, std::memory_order_relaxed);
+    tail.store(0, std::memory_order_relaxed);
+  }
 
-      waveOutPrepareHeader(hWaveOut, current, sizeof(WAVEHDR));
-      waveOutWrite(hWaveOut, current, sizeof(WAVEHDR));
+  size_t Capacity() const { return data ? mask + 1 : 0; }
 
-      DecrementBlock();
+  size_t Fill() const {
+    return head.load(std::memory_order_acquire) -
+           tail.load(std::memory_order_acquire);
+  }
 
-      while (!free_blocks_count)
-        Sleep(10);
+  size_t Space() const { return Capacity() - Fill(); }
+
+  // Producer side. Copies as much of |data_| as fits and returns the number
+  // of bytes accepted.
+  size_t Write(const void* data_, size_t size) {
+    size_t h = head.load(std::memory_order_relaxed);
+    size_t t = tail.load(std::memory_order_acquire);
+    size_t count = (std::min)(size, Capacity() - (h - t));
+    size_t offset = h & mask;
+    size_t first = (std::min)(count, Capacity() - offset);
+    const char* src = reinterpret_cast<const char*>(data_);
+    memcpy(&data[offset], src, first);
+    memcpy(&data[0], src + first, count - first);
+    head.store(h + count, std::memory_order_release);
+    return count;
+  }
 
-      current_block++;
-      current_block %= block_count;
+  // Consumer side. Exposes the largest contiguous readable region so the
+  // output thread can hand it to the device without an intermediate copy.
+  size_t Peek(const char** region) const {
+    size_t t = tail.load(std::memory_order_relaxed);
+    size_t h = head.load(std::memory_order_acquire);
+    size_t offset = t & mask;
+    *region = &data[offset];
+    return (std::min)(h - t, Capacity() - offset);
+  }
 
-      current = GetBlock(current_block);
-      current->dwUser = 0;
-    }
+  void Consume(size_t size) {
+    tail.store(tail.load(std::memory_order_relaxed) + size,
+               std::memory_order_release);
   }
 
-  ~SimplePlayer() { DeleteCriticalSection(&waveCriticalSection); }
-  void Close() {
-    ::waveOutClose(hWaveOut);
-    TRACE_INFO("closing device");
+  // Producer side counterpart of Peek: the largest contiguous writable
+  // region, so a decoder can produce samples in place.
+  size_t Reserve(char** region) {
+    size_t h = head.load(std::memory_order_relaxed);
+    size_t t = tail.load(std::memory_order_acquire);
+    size_t offset = h & mask;
+    *region = &data[offset];
+    return (std::min)(Capacity() - (h - t), Capacity() - offset);
   }
 
-  enum {
-    default_buffer_size = 0x400,
-    default_block_count = 0x20,
-    default_block_size = 0x2000
-  };
+  void Publish(size_t size) {
+    head.store(head.load(std::memory_order_relaxed) + size,
+               std::memory_order_release);
+  }
 
  private:
-  int GetBlockSize() { return (sizeof(WAVEHDR) + block_size + 15u) & (~15u); }
+  std::unique_ptr<char[]> data;
+  size_t mask = 0;
+  alignas(64) std::atomic<size_t> head{0};
+  alignas(64) std::atomic<size_t> tail{0};
+};
 
-  WAVEHDR* GetBlock(int position) {
-    return reinterpret_cast<WAVEHDR*>(&blocks[GetBlockSize() * position]);
-  }
-  std::unique_ptr<unsigned char[]> blocks;
-  WAVEFORMATEX wfx;
-  HWAVEOUT hWaveOut;
-  CRITICAL_SECTION waveCriticalSection;
-  volatile int free_blocks_count;
-  int block_size, block_count, current_block;
+// What a key press asks the playback thread to do.
+enum class Command : uint8_t {
+  kPause,
+  kNext,
+  kSeekBack,
+  kSeekForward,
+  kVolumeDown,
+  kVolumeUp,
+  kQuit
 };
 
-#elif __linux__
-class SimplePlayer {
+// Lock-free single producer / single consumer queue from the terminal
+// thread to the playback thread. A full queue drops the key press. The
+// playback thread either polls it between buffers or sleeps in WaitPop.
+class CommandQueue {
  public:
-  snd_pcm_format_t get_pcm_format() {
-    switch (bits_per_sample) {
-      case 64:
-        return ((IsLittleEndian()) ? SND_PCM_FORMAT_FLOAT64_LE
-                                   : SND_PCM_FORMAT_FLOAT64_BE);
-      case 32:
-        return ((IsLittleEndian()) ? SND_PCM_FORMAT_S32_LE
-                                   : SND_PCM_FORMAT_S32_BE);
-      case 24:
-        return ((IsLittleEndian()) ? SND_PCM_FORMAT_S24_LE
-                                   : SND_PCM_FORMAT_S24_BE);
-      case 16:
-        return ((IsLittleEndian()) ? SND_PCM_FORMAT_S16_LE
-                                   : SND_PCM_FORMAT_S16_BE);
-      case 8:
-        return SND_PCM_FORMAT_S8;
-      default:
-        return SND_PCM_FORMAT_UNKNOWN;
-    }
+  bool Push(Command command) {
+    size_t h = head.load(std::memory_order_relaxed);
+    if (h - tail.load(std::memory_order_acquire) == capacity)
+      return false;
+    commands[h % capacity] = command;
+    head.store(h + 1, std::memory_order_release);
+    { std::lock_guard<std::mutex> lock(mutex); }
+    pushed.notify_all();
+    return true;
   }
-  void SetFormat(const AudioFormat& format) {
-    channels = format.channels;
-    bits_per_sample = format.bits_per_sample;
-    encoding = format.encoding;
-    sample_rate = format.sample_rate;
+
+  bool Pop(Command* command) {
+    size_t t = tail.load(std::memory_order_relaxed);
+    if (t == head.load(std::memory_order_acquire))
+      return false;
+    *command = commands[t % capacity];
+    tail.store(t + 1, std::memory_order_release);
+    return true;
   }
 
-  int BitsPerSample() { return bits_per_sample; }
-  int Channels() { return channels; }
-  void Open() {
-    AudioResult result;
-    if ((result = snd_pcm_open(&pcm_handle, PCM_DEVICE, SND_PCM_STREAM_PLAYBACK,
-                               0)) < 0) {
-      std::string message = string_format("Can't open \"%s\" PCM device. %s",
-                                          PCM_DEVICE, snd_strerror(result));
-      TRACE_ERROR(message.c_str());
-      AudioExitProcess(AudioStatus::kAudioDeviceError);
+  // Like Pop, but sleeps until there is a command to take.
+  void WaitPop(Command* command) {
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      pushed.wait(lock, [this]() { return !Empty(); });
     }
+    Pop(command);
+  }
 
-    snd_pcm_hw_params_alloca(&params);
+  bool Empty() const {
+    return head.load(std::memory_order_acquire) ==
+           tail.load(std::memory_order_acquire);
+  }
 
-    snd_pcm_hw_params_any(pcm_handle, params);
+ private:
+  enum { capacity = 64 };
 
-    if ((result = snd_pcm_hw_params_set_access(
-             pcm_handle, params, SND_PCM_ACCESS_RW_INTERLEAVED)) < 0) {
-      std::string message =
-          string_format("Can't set interleaved mode. %s", snd_strerror(result));
-      TRACE_ERROR(message.c_str());
-      AudioExitProcess(AudioStatus::kAudioDeviceError);
-    }
+  Command commands[capacity];
+  alignas(64) std::atomic<size_t> head{0};
+  alignas(64) std::atomic<size_t> tail{0};
+  std::mutex mutex;
+  std::condition_variable pushed;
+};
 
-    if ((result = snd_pcm_hw_params_set_format(pcm_handle, params,
-                                               get_pcm_format())) < 0) {
-      std::string message =
-          string_format("Can't set format. %s", snd_strerror(result));
-      TRACE_ERROR(message.c_str());
-      AudioExitProcess(AudioStatus::kAudioDeviceError);
-    }
-    if ((result = snd_pcm_hw_params_set_channels(pcm_handle, params,
-                                                 channels)) < 0) {
-      std::string message =
-          string_format("Can't set channels number. %s", snd_strerror(result));
-      TRACE_ERROR(message.c_str());
-      AudioExitProcess(AudioStatus::kAudioDeviceError);
-    }
+CommandQueue& GetCommandQueue() {
+  static CommandQueue queue;
+  return queue;
+}
 
-    if (((result = snd_pcm_hw_params_set_rate_near(
-              pcm_handle, params, reinterpret_cast<unsigned int*>(&sample_rate),
-              0))) < 0) {
-      std::string message =
-          string_format("Can't set sample_rate. %s", snd_strerror(result));
-      TRACE_ERROR(message.c_str());
-      AudioExitProcess(AudioStatus::kAudioDeviceError);
-    }
+WaveHeader WaveHeader_From_Format(const AudioFormat& fmt, uint32_t data_size) {
+  WaveHeader header;
+  header.ChunkID = 0x46464952;      // "RIFF"
+  header.Format = 0x45564157;       // "WAVE"
+  header.Subchunk1ID = 0x20746d66;  // "fmt "
+  header.Subchunk1Size = 16;
+  header.AudioFormat = fmt.is_float ? 3 : 1;
+  header.NumChannels = static_cast<uint16_t>(fmt.channels);
+  header.SampleRate = fmt.sample_rate;
+  header.BitsPerSample = static_cast<uint16_t>(fmt.bits_per_sample);
+  header.BlockAlign =
+      static_cast<uint16_t>(fmt.channels * fmt.bits_per_sample / 8);
+  header.ByteRate = header.BlockAlign * fmt.sample_rate;
+  header.Subchunk2ID = 0x61746164;  // "data"
+  header.Subchunk2Size = data_size;
+  header.ChunkSize = 36 + data_size;
+  return header;
+}
 
-    if ((result = snd_pcm_hw_params(pcm_handle, params)) < 0) {
-      std::string message = string_format("Can't set harware parameters. %s",
-                                          snd_strerror(result));
-      TRACE_ERROR(message.c_str());
-      AudioExitProcess(AudioStatus::kAudioDeviceError);
-    }
-  }
-  void Close() {
-    if (pcm_handle) {
-      snd_pcm_drain(pcm_handle);
-      snd_pcm_close(pcm_handle);
-    }
-  }
-  snd_pcm_uframes_t bytes_to_frames(ssize_t _bytes) {
-    return snd_pcm_bytes_to_frames(pcm_handle, _bytes);
-  }
-  void WriteAudio(const void* buffer, snd_pcm_uframes_t _frames) {
-    AudioResult result;
-    if ((result = snd_pcm_writei(pcm_handle, buffer, _frames)) == -EPIPE) {
-      snd_pcm_prepare(pcm_handle);
-    } else if (result < 0) {
-      std::string message =
-          string_format("Can't write to PCM device. %s", snd_strerror(result));
-      TRACE_ERROR(message.c_str());
-    }
+// Writes the header of a WAVE file holding |data_size| bytes of samples,
+// with a ds64 chunk after the RIFF header. Up to 4 GiB it is a JUNK chunk
+// and the file plain RIFF; beyond, the file becomes RF64 in place.
+bool WriteWaveHeader(FILE* file, const AudioFormat& fmt, uint64_t data_size) {
+  const uint64_t header_size = sizeof(WaveHeader) + sizeof(Ds64Chunk);
+  bool rf64 = data_size + header_size - 8 > UINT32_MAX;
+  WaveHeader header =
+      WaveHeader_From_Format(fmt, rf64 ? 0 : static_cast<uint32_t>(data_size));
+  header.ChunkSize += sizeof(Ds64Chunk);
+  Ds64Chunk ds64 = {};
+  ds64.ChunkID = 0x4b4e554a;  // "JUNK"
+  ds64.ChunkSize = sizeof(Ds64Chunk) - 8;
+  if (rf64) {
+    uint64_t riff_size = data_size + header_size - 8;
+    uint64_t samples = data_size / (std::max)(header.BlockAlign, uint16_t(1));
+    header.ChunkID = 0x34364652;  // "RF64"
+    header.ChunkSize = header.Subchunk2Size = UINT32_MAX;
+    ds64.ChunkID = 0x34367364;  // "ds64"
+    ds64.RiffSizeLow = static_cast<uint32_t>(riff_size);
+    ds64.RiffSizeHigh = static_cast<uint32_t>(riff_size >> 32);
+    ds64.DataSizeLow = static_cast<uint32_t>(data_size);
+    ds64.DataSizeHigh = static_cast<uint32_t>(data_size >> 32);
+    ds64.SampleCountLow = static_cast<uint32_t>(samples);
+    ds64.SampleCountHigh = static_cast<uint32_t>(samples >> 32);
   }
+  // ds64 has to be the first chunk, between "WAVE" and "fmt ".
+  const char* bytes = reinterpret_cast<const char*>(&header);
+  return fwrite(bytes, 12, 1, file) == 1 &&
+         fwrite(&ds64, sizeof(ds64), 1, file) == 1 &&
+         fwrite(bytes + 12, sizeof(WaveHeader) - 12, 1, file) == 1;
+}
 
-  snd_pcm_t* pcm_handle;
-  snd_pcm_hw_params_t* params;
-  snd_pcm_uframes_t frames;
-  int channels, encoding, sample_rate, bits_per_sample;
-  enum { default_buffer_size = 0x400 };
-};
+// Sample conversion kernels. Each has a scalar template version, specialised
+// on channel count and sample width so the inner loop has no branches, and
+// SSE2/AVX2 versions for the common mono and stereo cases, picked once at
+// runtime from what the CPU supports.
+
+typedef struct _CpuFeatures {
+  bool sse2 = false;
+  bool avx2 = false;
+} CpuFeatures;
+
+CpuFeatures DetectCpuFeatures() {
+  CpuFeatures features;
+#ifdef LOOPER_SSE2
+  features.sse2 = true;
+#if defined(_MSC_VER)
+  int info[4];
+  __cpuid(info, 0);
+  if (info[0] >= 7) {
+    __cpuid(info, 1);
+    // The OS has to save the YMM registers too.
+    bool os_avx = (info[2] & (1 << 27)) && (_xgetbv(0) & 6) == 6;
+    __cpuidex(info, 7, 0);
+    features.avx2 = os_avx && (info[1] & (1 << 5));
+  }
+#elif defined(__GNUC__)
+  __builtin_cpu_init();
+  features.avx2 = __builtin_cpu_supports("avx2");
 #endif
+#endif
+  return features;
+}
 
-#ifdef _WIN32
-static void CALLBACK waveOutProc(HWAVEOUT hWaveOut,
-                                 UINT uMsg,
-                                 DWORD dwInstance,
-                                 DWORD dwParam1,
-                                 DWORD dwParam2) {
-  (void)hWaveOut;
-  (void)dwParam1;
-  (void)dwParam2;
+const CpuFeatures& GetCpuFeatures() {
+  static const CpuFeatures features = DetectCpuFeatures();
+  return features;
+}
 
-  SimplePlayer* player = reinterpret_cast<SimplePlayer*>(dwInstance);
-  if (uMsg != WOM_DONE)
-    return;
-  player->IncrementBlock();
+// Writes |count| frames from per-channel int32 samples as interleaved PCM.
+// |shift| moves samples up to the top of a 32-bit container; it is ignored
+// for narrower outputs.
+typedef void (*InterleaveFn)(const int32_t* const* planar,
+                             size_t count,
+                             int shift,
+                             char* out);
+
+template <int Bytes>
+inline void StoreSample(char* out, int32_t value, int shift);
+
+// 8-bit PCM is unsigned, as in WAV files.
+template <>
+inline void StoreSample<1>(char* out, int32_t value, int) {
+  *out = static_cast<char>(value + 128);
+}
+
+template <>
+inline void StoreSample<2>(char* out, int32_t value, int) {
+  int16_t sample = static_cast<int16_t>(value);
+  memcpy(out, &sample, 2);
+}
+
+// S24_3LE: three bytes, least significant first.
+template <>
+inline void StoreSample<3>(char* out, int32_t value, int) {
+  out[0] = static_cast<char>(value);
+  out[1] = static_cast<char>(value >> 8);
+  out[2] = static_cast<char>(value >> 16);
+}
+
+// S32, or S24_LE when |shift| is 0 and the samples are 24-bit.
+template <>
+inline void StoreSample<4>(char* out, int32_t value, int shift) {
+  uint32_t sample = static_cast<uint32_t>(value) << shift;
+  memcpy(out, &sample, 4);
+}
+
+template <int Channels, int Bytes>
+void InterleaveScalar(const int32_t* const* planar,
+                      size_t count,
+                      int shift,
+                      char* out) {
+  for (size_t i = 0; i < count; i++) {
+    for (int channel = 0; channel < Channels; channel++, out += Bytes)
+      StoreSample<Bytes>(out, planar[channel][i], shift);
+  }
+}
+
+// Finishes the frames a vector loop left over.
+template <int Channels, int Bytes>
+inline void InterleaveTail(const int32_t* const* planar,
+                           size_t done,
+                           size_t count,
+                           int shift,
+                           char* out) {
+  const int32_t* rest[Channels];
+  for (int channel = 0; channel < Channels; channel++)
+    rest[channel] = planar[channel] + done;
+  InterleaveScalar<Channels, Bytes>(rest, count - done, shift,
+                                    out + done * Channels * Bytes);
+}
+
+#ifdef LOOPER_SSE2
+template <int Channels, int Bytes>
+void InterleaveSse2(const int32_t* const*, size_t, int, char*);
+
+template <>
+void InterleaveSse2<1, 2>(const int32_t* const* planar,
+                          size_t count,
+                          int shift,
+                          char* out) {
+  const __m128i* in = reinterpret_cast<const __m128i*>(planar[0]);
+  size_t i = 0;
+  for (; i + 8 <= count; i += 8, in += 2) {
+    __m128i packed =
+        _mm_packs_epi32(_mm_loadu_si128(in), _mm_loadu_si128(in + 1));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i * 2), packed);
+  }
+  InterleaveTail<1, 2>(planar, i, count, shift, out);
+}
+
+template <>
+void InterleaveSse2<2, 2>(const int32_t* const* planar,
+                          size_t count,
+                          int shift,
+                          char* out) {
+  const __m128i* left = reinterpret_cast<const __m128i*>(planar[0]);
+  const __m128i* right = reinterpret_cast<const __m128i*>(planar[1]);
+  size_t i = 0;
+  for (; i + 8 <= count; i += 8, left += 2, right += 2) {
+    __m128i l =
+        _mm_packs_epi32(_mm_loadu_si128(left), _mm_loadu_si128(left + 1));
+    __m128i r =
+        _mm_packs_epi32(_mm_loadu_si128(right), _mm_loadu_si128(right + 1));
+    __m128i* dst = reinterpret_cast<__m128i*>(out + i * 4);
+    _mm_storeu_si128(dst, _mm_unpacklo_epi16(l, r));
+    _mm_storeu_si128(dst + 1, _mm_unpackhi_epi16(l, r));
+  }
+  InterleaveTail<2, 2>(planar, i, count, shift, out);
+}
+
+template <>
+void InterleaveSse2<1, 4>(const int32_t* const* planar,
+                          size_t count,
+                          int shift,
+                          char* out) {
+  const __m128i* in = reinterpret_cast<const __m128i*>(planar[0]);
+  __m128i amount = _mm_cvtsi32_si128(shift);
+  size_t i = 0;
+  for (; i + 4 <= count; i += 4, in++) {
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i * 4),
+                     _mm_sll_epi32(_mm_loadu_si128(in), amount));
+  }
+  InterleaveTail<1, 4>(planar, i, count, shift, out);
+}
+
+template <>
+void InterleaveSse2<2, 4>(const int32_t* const* planar,
+                          size_t count,
+                          int shift,
+                          char* out) {
+  const __m128i* left = reinterpret_cast<const __m128i*>(planar[0]);
+  const __m128i* right = reinterpret_cast<const __m128i*>(planar[1]);
+  __m128i amount = _mm_cvtsi32_si128(shift);
+  size_t i = 0;
+  for (; i + 4 <= count; i += 4, left++, right++) {
+    __m128i l = _mm_sll_epi32(_mm_loadu_si128(left), amount);
+    __m128i r = _mm_sll_epi32(_mm_loadu_si128(right), amount);
+    __m128i* dst = reinterpret_cast<__m128i*>(out + i * 8);
+    _mm_storeu_si128(dst, _mm_unpacklo_epi32(l, r));
+    _mm_storeu_si128(dst + 1, _mm_unpackhi_epi32(l, r));
+  }
+  InterleaveTail<2, 4>(planar, i, count, shift, out);
 }
 #endif
 
-typedef struct _Metadata {
-  std::string artist;
-  std::string title;
-  std::string year;
-  std::string genre;
-  std::string comment;
-  std::string album;
-} Metadata;
+#ifdef LOOPER_AVX2
+template <int Channels, int Bytes>
+void InterleaveAvx2(const int32_t* const*, size_t, int, char*);
+
+// The 256-bit pack and unpack instructions work on each 128-bit lane on its
+// own, hence the permutes to put the lanes back in order.
+template <>
+LOOPER_TARGET_AVX2 void InterleaveAvx2<1, 2>(const int32_t* const* planar,
+                                             size_t count,
+                                             int shift,
+                                             char* out) {
+  const __m256i* in = reinterpret_cast<const __m256i*>(planar[0]);
+  size_t i = 0;
+  for (; i + 16 <= count; i += 16, in += 2) {
+    __m256i packed = _mm256_packs_epi32(_mm256_loadu_si256(in),
+                                        _mm256_loadu_si256(in + 1));
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + i * 2),
+                        _mm256_permute4x64_epi64(packed, 0xD8));
+  }
+  InterleaveTail<1, 2>(planar, i, count, shift, out);
+}
 
-std::string to_string(const Metadata& meta) {
-  return "Title: " + meta.title + "\nArtist: " + meta.artist +
-         "\nAlbum: " + meta.album + "\nYear: " + meta.year +
-         "\nComment: " + meta.comment + "\nGenre: " + meta.genre + "\n";
+template <>
+LOOPER_TARGET_AVX2 void InterleaveAvx2<2, 2>(const int32_t* const* planar,
+                                             size_t count,
+                                             int shift,
+                                             char* out) {
+  const __m256i* left = reinterpret_cast<const __m256i*>(planar[0]);
+  const __m256i* right = reinterpret_cast<const __m256i*>(planar[1]);
+  size_t i = 0;
+  for (; i + 8 <= count; i += 8, left++, right++) {
+    __m256i l = _mm256_loadu_si256(left);
+    __m256i r = _mm256_loadu_si256(right);
+    __m256i lo = _mm256_unpacklo_epi32(l, r);
+    __m256i hi = _mm256_unpackhi_epi32(l, r);
+    __m256i first = _mm256_permute2x128_si256(lo, hi, 0x20);
+    __m256i second = _mm256_permute2x128_si256(lo, hi, 0x31);
+    __m256i packed = _mm256_packs_epi32(first, second);
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + i * 4),
+                        _mm256_permute4x64_epi64(packed, 0xD8));
+  }
+  InterleaveTail<2, 2>(planar, i, count, shift, out);
 }
 
-void PrintPlayingInfo(const Metadata& meta) {
-  print_color("Playing Info\n", Color::light_yellow);
-  print_color(to_string(meta));
-  print_color("Starting to play\n", Color::light_yellow);
+template <>
+LOOPER_TARGET_AVX2 void InterleaveAvx2<1, 4>(const int32_t* const* planar,
+                                             size_t count,
+                                             int shift,
+                                             char* out) {
+  const __m256i* in = reinterpret_cast<const __m256i*>(planar[0]);
+  __m128i amount = _mm_cvtsi32_si128(shift);
+  size_t i = 0;
+  for (; i + 8 <= count; i += 8, in++) {
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + i * 4),
+                        _mm256_sll_epi32(_mm256_loadu_si256(in), amount));
+  }
+  InterleaveTail<1, 4>(planar, i, count, shift, out);
 }
 
-class WavPlayer : public SimplePlayer {
- public:
-  void play(const std::string& path) {
-#ifdef _WIN32
-    std::ifstream wave_file(to_wstring(path.c_str()), std::ifstream::binary);
+template <>
+LOOPER_TARGET_AVX2 void InterleaveAvx2<2, 4>(const int32_t* const* planar,
+                                             size_t count,
+                                             int shift,
+                                             char* out) {
+  const __m256i* left = reinterpret_cast<const __m256i*>(planar[0]);
+  const __m256i* right = reinterpret_cast<const __m256i*>(planar[1]);
+  __m128i amount = _mm_cvtsi32_si128(shift);
+  size_t i = 0;
+  for (; i + 8 <= count; i += 8, left++, right++) {
+    __m256i l = _mm256_sll_epi32(_mm256_loadu_si256(left), amount);
+    __m256i r = _mm256_sll_epi32(_mm256_loadu_si256(right), amount);
+    __m256i lo = _mm256_unpacklo_epi32(l, r);
+    __m256i hi = _mm256_unpackhi_epi32(l, r);
+    __m256i* dst = reinterpret_cast<__m256i*>(out + i * 8);
+    _mm256_storeu_si256(dst, _mm256_permute2x128_si256(lo, hi, 0x20));
+    _mm256_storeu_si256(dst + 1, _mm256_permute2x128_si256(lo, hi, 0x31));
+  }
+  InterleaveTail<2, 4>(planar, i, count, shift, out);
+}
+#endif
+
+// Vector versions exist for mono and stereo 16- and 32-bit output only.
+template <int Channels, int Bytes>
+InterleaveFn SelectInterleaveFor() {
+  if constexpr (Channels <= 2 && (Bytes == 2 || Bytes == 4)) {
+#ifdef LOOPER_AVX2
+    if (GetCpuFeatures().avx2)
+      return &InterleaveAvx2<Channels, Bytes>;
+#endif
+#ifdef LOOPER_SSE2
+    if (GetCpuFeatures().sse2)
+      return &InterleaveSse2<Channels, Bytes>;
+#endif
+  }
+  return &InterleaveScalar<Channels, Bytes>;
+}
+
+template <int Channels>
+InterleaveFn SelectInterleaveFor(int sample_bytes) {
+  switch (sample_bytes) {
+    case 1:
+      return SelectInterleaveFor<Channels, 1>();
+    case 2:
+      return SelectInterleaveFor<Channels, 2>();
+    case 3:
+      return SelectInterleaveFor<Channels, 3>();
+    case 4:
+      return SelectInterleaveFor<Channels, 4>();
+    default:
+      return nullptr;
+  }
+}
+
+// Returns nullptr for layouts there is no kernel for.
+InterleaveFn SelectInterleave(int channels, int sample_bytes) {
+  switch (channels) {
+    case 1:
+      return SelectInterleaveFor<1>(sample_bytes);
+    case 2:
+      return SelectInterleaveFor<2>(sample_bytes);
+    case 3:
+      return SelectInterleaveFor<3>(sample_bytes);
+    case 4:
+      return SelectInterleaveFor<4>(sample_bytes);
+    case 5:
+      return SelectInterleaveFor<5>(sample_bytes);
+    case 6:
+      return SelectInterleaveFor<6>(sample_bytes);
+    case 7:
+      return SelectInterleaveFor<7>(sample_bytes);
+    case 8:
+      return SelectInterleaveFor<8>(sample_bytes);
+    default:
+      return nullptr;
+  }
+}
+
+// Float to integer PCM, clipping to [-1, 1). Rounds to nearest like the
+// vector conversions do.
+inline int16_t FloatToS16(float sample) {
+  float scaled = sample * 32767.0f;
+  scaled = (std::max)(-32768.0f, (std::min)(32767.0f, scaled));
+  return static_cast<int16_t>(lrintf(scaled));
+}
+
+// 2147483520 is the largest float below 2^31; anything above it would
+// convert to INT32_MIN.
+inline int32_t FloatToS32(float sample) {
+  float scaled = sample * 2147483648.0f;
+  scaled = (std::max)(-2147483648.0f, (std::min)(2147483520.0f, scaled));
+  return static_cast<int32_t>(lrintf(scaled));
+}
+
+#ifdef LOOPER_AVX2
+LOOPER_TARGET_AVX2 size_t ConvertFloatToS16Avx2(const float* in,
+                                                int16_t* out,
+                                                size_t count) {
+  const __m256 scale = _mm256_set1_ps(32767.0f);
+  const __m256 low = _mm256_set1_ps(-32768.0f);
+  const __m256 high = _mm256_set1_ps(32767.0f);
+  size_t i = 0;
+  for (; i + 16 <= count; i += 16) {
+    __m256 a = _mm256_mul_ps(_mm256_loadu_ps(in + i), scale);
+    __m256 b = _mm256_mul_ps(_mm256_loadu_ps(in + i + 8), scale);
+    a = _mm256_max_ps(low, _mm256_min_ps(high, a));
+    b = _mm256_max_ps(low, _mm256_min_ps(high, b));
+    __m256i packed =
+        _mm256_packs_epi32(_mm256_cvtps_epi32(a), _mm256_cvtps_epi32(b));
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + i),
+                        _mm256_permute4x64_epi64(packed, 0xD8));
+  }
+  return i;
+}
+
+LOOPER_TARGET_AVX2 size_t ConvertFloatToS32Avx2(const float* in,
+                                                int32_t* out,
+                                                size_t count) {
+  const __m256 scale = _mm256_set1_ps(2147483648.0f);
+  const __m256 low = _mm256_set1_ps(-2147483648.0f);
+  const __m256 high = _mm256_set1_ps(2147483520.0f);
+  size_t i = 0;
+  for (; i + 8 <= count; i += 8) {
+    __m256 a = _mm256_mul_ps(_mm256_loadu_ps(in + i), scale);
+    a = _mm256_max_ps(low, _mm256_min_ps(high, a));
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + i),
+                        _mm256_cvtps_epi32(a));
+  }
+  return i;
+}
+#endif
+
+#ifdef LOOPER_SSE2
+size_t ConvertFloatToS16Sse2(const float* in, int16_t* out, size_t count) {
+  const __m128 scale = _mm_set1_ps(32767.0f);
+  const __m128 low = _mm_set1_ps(-32768.0f);
+  const __m128 high = _mm_set1_ps(32767.0f);
+  size_t i = 0;
+  for (; i + 8 <= count; i += 8) {
+    __m128 a = _mm_mul_ps(_mm_loadu_ps(in + i), scale);
+    __m128 b = _mm_mul_ps(_mm_loadu_ps(in + i + 4), scale);
+    a = _mm_max_ps(low, _mm_min_ps(high, a));
+    b = _mm_max_ps(low, _mm_min_ps(high, b));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i),
+                     _mm_packs_epi32(_mm_cvtps_epi32(a), _mm_cvtps_epi32(b)));
+  }
+  return i;
+}
+
+size_t ConvertFloatToS32Sse2(const float* in, int32_t* out, size_t count) {
+  const __m128 scale = _mm_set1_ps(2147483648.0f);
+  const __m128 low = _mm_set1_ps(-2147483648.0f);
+  const __m128 high = _mm_set1_ps(2147483520.0f);
+  size_t i = 0;
+  for (; i + 4 <= count; i += 4) {
+    __m128 a = _mm_mul_ps(_mm_loadu_ps(in + i), scale);
+    a = _mm_max_ps(low, _mm_min_ps(high, a));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), _mm_cvtps_epi32(a));
+  }
+  return i;
+}
+#endif
+
+void ConvertFloatToS16(const float* in, int16_t* out, size_t count) {
+  size_t i = 0;
+#ifdef LOOPER_AVX2
+  if (GetCpuFeatures().avx2)
+    i = ConvertFloatToS16Avx2(in, out, count);
+#endif
+#ifdef LOOPER_SSE2
+  i += ConvertFloatToS16Sse2(in + i, out + i, count - i);
+#endif
+  for (; i < count; i++)
+    out[i] = FloatToS16(in[i]);
+}
+
+void ConvertFloatToS32(const float* in, int32_t* out, size_t count) {
+  size_t i = 0;
+#ifdef LOOPER_AVX2
+  if (GetCpuFeatures().avx2)
+    i = ConvertFloatToS32Avx2(in, out, count);
+#endif
+#ifdef LOOPER_SSE2
+  i += ConvertFloatToS32Sse2(in + i, out + i, count - i);
+#endif
+  for (; i < count; i++)
+    out[i] = FloatToS32(in[i]);
+}
+
+// Reverses the byte order of |count| samples of |sample_bytes| each, in
+// place.
+void SwapSampleBytes(char* data, size_t count, int sample_bytes) {
+  size_t i = 0;
+#ifdef LOOPER_SSE2
+  if (sample_bytes == 2) {
+    for (; i + 8 <= count; i += 8) {
+      __m128i* p = reinterpret_cast<__m128i*>(data + i * 2);
+      __m128i v = _mm_loadu_si128(p);
+      _mm_storeu_si128(p,
+                       _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8)));
+    }
+  } else if (sample_bytes == 4) {
+    for (; i + 4 <= count; i += 4) {
+      __m128i* p = reinterpret_cast<__m128i*>(data + i * 4);
+      __m128i v = _mm_loadu_si128(p);
+      // Swap the 16-bit halves, then the bytes within each half.
+      v = _mm_shufflehi_epi16(_mm_shufflelo_epi16(v, 0xB1), 0xB1);
+      _mm_storeu_si128(p,
+                       _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8)));
+    }
+  }
+#endif
+  for (; i < count; i++) {
+    char* sample = data + i * sample_bytes;
+    std::reverse(sample, sample + sample_bytes);
+  }
+}
+
+#ifdef LOOPER_AVX2
+LOOPER_TARGET_AVX2 size_t MixAccumulateAvx2(float* out,
+                                            const float* in,
+                                            float weight,
+                                            size_t count) {
+  const __m256 w = _mm256_set1_ps(weight);
+  size_t i = 0;
+  for (; i + 8 <= count; i += 8) {
+    __m256 sum = _mm256_add_ps(_mm256_loadu_ps(out + i),
+                               _mm256_mul_ps(_mm256_loadu_ps(in + i), w));
+    _mm256_storeu_ps(out + i, sum);
+  }
+  return i;
+}
+#endif
+
+#ifdef LOOPER_SSE2
+size_t MixAccumulateSse2(float* out,
+                         const float* in,
+                         float weight,
+                         size_t count) {
+  const __m128 w = _mm_set1_ps(weight);
+  size_t i = 0;
+  for (; i + 4 <= count; i += 4) {
+    __m128 sum =
+        _mm_add_ps(_mm_loadu_ps(out + i), _mm_mul_ps(_mm_loadu_ps(in + i), w));
+    _mm_storeu_ps(out + i, sum);
+  }
+  return i;
+}
+#endif
+
+// out[i] += weight * in[i], one row of a mixing matrix at a time.
+void MixAccumulate(float* out, const float* in, float weight, size_t count) {
+  size_t i = 0;
+#ifdef LOOPER_AVX2
+  if (GetCpuFeatures().avx2)
+    i = MixAccumulateAvx2(out, in, weight, count);
+#endif
+#ifdef LOOPER_SSE2
+  i += MixAccumulateSse2(out + i, in + i, weight, count - i);
+#endif
+  for (; i < count; i++)
+    out[i] += weight * in[i];
+}
+
+#ifdef LOOPER_AVX2
+LOOPER_TARGET_AVX2 float DotProductAvx2(const float* a,
+                                        const float* b,
+                                        size_t count) {
+  __m256 sum = _mm256_setzero_ps();
+  for (size_t i = 0; i < count; i += 8)
+    sum = _mm256_add_ps(sum,
+                        _mm256_mul_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i)));
+  __m128 half =
+      _mm_add_ps(_mm256_castps256_ps128(sum), _mm256_extractf128_ps(sum, 1));
+  half = _mm_add_ps(half, _mm_movehl_ps(half, half));
+  half = _mm_add_ss(half, _mm_shuffle_ps(half, half, 1));
+  return _mm_cvtss_f32(half);
+}
+#endif
+
+#ifdef LOOPER_SSE2
+float DotProductSse2(const float* a, const float* b, size_t count) {
+  __m128 sum0 = _mm_setzero_ps(), sum1 = _mm_setzero_ps();
+  for (size_t i = 0; i < count; i += 8) {
+    sum0 = _mm_add_ps(sum0, _mm_mul_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i)));
+    sum1 = _mm_add_ps(sum1,
+                      _mm_mul_ps(_mm_loadu_ps(a + i + 4), _mm_loadu_ps(b + i + 4)));
+  }
+  __m128 sum = _mm_add_ps(sum0, sum1);
+  sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+  sum = _mm_add_ss(sum, _mm_shuffle_ps(sum, sum, 1));
+  return _mm_cvtss_f32(sum);
+}
+#endif
+
+// Sum of a[i] * b[i], one resampler output sample. |count| is a multiple of 8.
+float DotProduct(const float* a, const float* b, size_t count) {
+#ifdef LOOPER_AVX2
+  if (GetCpuFeatures().avx2)
+    return DotProductAvx2(a, b, count);
+#endif
+#ifdef LOOPER_SSE2
+  return DotProductSse2(a, b, count);
 #else
-    std::ifstream wave_file(path, std::ifstream::binary);
+  float sum = 0.0f;
+  for (size_t i = 0; i < count; i++)
+    sum += a[i] * b[i];
+  return sum;
 #endif
-    if (wave_file) {
-      std::string message = string_format("Opened %s", path.c_str());
-      TRACE_INFO(message.c_str());
-      WaveHeader header;
-      int read_bytes = 0;
-      std::istream& header_is_ok =
-          wave_file.read(reinterpret_cast<char*>(&header), sizeof(WaveHeader));
-      read_bytes = static_cast<int>(header_is_ok.gcount());
+}
 
-      if (read_bytes < sizeof(WaveHeader)) {
-        TRACE_ERROR("Small header size");
-        AudioExitProcess(AudioStatus::kIoError);
-      }
+#ifdef LOOPER_AVX2
+LOOPER_TARGET_AVX2 size_t ConvertS16ToFloatAvx2(const int16_t* in,
+                                                float* out,
+                                                size_t count,
+                                                float scale) {
+  const __m256 s = _mm256_set1_ps(scale);
+  size_t i = 0;
+  for (; i + 8 <= count; i += 8) {
+    __m256i wide = _mm256_cvtepi16_epi32(
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i)));
+    _mm256_storeu_ps(out + i, _mm256_mul_ps(_mm256_cvtepi32_ps(wide), s));
+  }
+  return i;
+}
 
-      SetFormat(Format_From_WaveHeader(header));
+LOOPER_TARGET_AVX2 size_t ConvertS32ToFloatAvx2(const int32_t* in,
+                                                float* out,
+                                                size_t count,
+                                                float scale) {
+  const __m256 s = _mm256_set1_ps(scale);
+  size_t i = 0;
+  for (; i + 8 <= count; i += 8) {
+    __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(in + i));
+    _mm256_storeu_ps(out + i, _mm256_mul_ps(_mm256_cvtepi32_ps(v), s));
+  }
+  return i;
+}
 
-      Metadata mt;
-      fs::path current_path(path);
-      mt.title = current_path.stem().string();
-      PrintPlayingInfo(mt);
+LOOPER_TARGET_AVX2 size_t ScaleFloatAvx2(const float* in,
+                                         float* out,
+                                         size_t count,
+                                         float scale) {
+  const __m256 s = _mm256_set1_ps(scale);
+  size_t i = 0;
+  for (; i + 8 <= count; i += 8)
+    _mm256_storeu_ps(out + i, _mm256_mul_ps(_mm256_loadu_ps(in + i), s));
+  return i;
+}
+#endif
 
-#ifdef _WIN32
-      SetupBlocks();
+#ifdef LOOPER_SSE2
+size_t ConvertS16ToFloatSse2(const int16_t* in,
+                             float* out,
+                             size_t count,
+                             float scale) {
+  const __m128 s = _mm_set1_ps(scale);
+  size_t i = 0;
+  for (; i + 8 <= count; i += 8) {
+    __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i));
+    // Sign-extend by putting each sample in the top half and shifting down.
+    __m128i low = _mm_srai_epi32(_mm_unpacklo_epi16(v, v), 16);
+    __m128i high = _mm_srai_epi32(_mm_unpackhi_epi16(v, v), 16);
+    _mm_storeu_ps(out + i, _mm_mul_ps(_mm_cvtepi32_ps(low), s));
+    _mm_storeu_ps(out + i + 4, _mm_mul_ps(_mm_cvtepi32_ps(high), s));
+  }
+  return i;
+}
+
+size_t ConvertS32ToFloatSse2(const int32_t* in,
+                             float* out,
+                             size_t count,
+                             float scale) {
+  const __m128 s = _mm_set1_ps(scale);
+  size_t i = 0;
+  for (; i + 4 <= count; i += 4) {
+    __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i));
+    _mm_storeu_ps(out + i, _mm_mul_ps(_mm_cvtepi32_ps(v), s));
+  }
+  return i;
+}
+
+size_t ScaleFloatSse2(const float* in, float* out, size_t count, float scale) {
+  const __m128 s = _mm_set1_ps(scale);
+  size_t i = 0;
+  for (; i + 4 <= count; i += 4)
+    _mm_storeu_ps(out + i, _mm_mul_ps(_mm_loadu_ps(in + i), s));
+  return i;
+}
 #endif
 
-      Open();
+// Integer or float samples to float, multiplied by |scale| on the way, so a
+// gain costs nothing beyond the conversion.
+void ConvertS16ToFloat(const int16_t* in, float* out, size_t count, float scale) {
+  size_t i = 0;
+#ifdef LOOPER_AVX2
+  if (GetCpuFeatures().avx2)
+    i = ConvertS16ToFloatAvx2(in, out, count, scale);
+#endif
+#ifdef LOOPER_SSE2
+  i += ConvertS16ToFloatSse2(in + i, out + i, count - i, scale);
+#endif
+  for (; i < count; i++)
+    out[i] = in[i] * scale;
+}
 
-      std::string buffer(default_buffer_size, '\0');
-      for (;;) {
-        std::istream& is_ok = wave_file.read(&buffer[0], default_buffer_size);
-        read_bytes = static_cast<int>(is_ok.gcount());
+void ConvertS32ToFloat(const int32_t* in, float* out, size_t count, float scale) {
+  size_t i = 0;
+#ifdef LOOPER_AVX2
+  if (GetCpuFeatures().avx2)
+    i = ConvertS32ToFloatAvx2(in, out, count, scale);
+#endif
+#ifdef LOOPER_SSE2
+  i += ConvertS32ToFloatSse2(in + i, out + i, count - i, scale);
+#endif
+  for (; i < count; i++)
+    out[i] = static_cast<float>(in[i]) * scale;
+}
 
-        if (read_bytes <= 0)
-          break;
-#ifdef _WIN32
-        WriteAudio(&buffer[0], static_cast<int>(is_ok.gcount()));
-#elif __linux__
-        frames = bytes_to_frames(default_buffer_size);
-        WriteAudio(&buffer[0], frames);
+void ScaleFloat(const float* in, float* out, size_t count, float scale) {
+  size_t i = 0;
+#ifdef LOOPER_AVX2
+  if (GetCpuFeatures().avx2)
+    i = ScaleFloatAvx2(in, out, count, scale);
 #endif
-      }
-#ifdef _WIN32
-      FreeBlocks();
+#ifdef LOOPER_SSE2
+  i += ScaleFloatSse2(in + i, out + i, count - i, scale);
 #endif
-      Close();
-      print_color("Done Playing Song\n\n", Color::light_yellow);
+  for (; i < count; i++)
+    out[i] = in[i] * scale;
+}
+
+// Planar decoder output (libvorbis float, or FLAC ints times |scale|) to
+// interleaved float.
+void InterleaveFloat(const float* const* planar,
+                     int channels,
+                     size_t count,
+                     float* out) {
+  for (int channel = 0; channel < channels; channel++) {
+    const float* in = planar[channel];
+    for (size_t i = 0; i < count; i++)
+      out[i * channels + channel] = in[i];
+  }
+}
+
+void InterleaveScaled(const int32_t* const* planar,
+                      int channels,
+                      size_t count,
+                      float scale,
+                      float* out) {
+  for (int channel = 0; channel < channels; channel++) {
+    const int32_t* in = planar[channel];
+    for (size_t i = 0; i < count; i++)
+      out[i * channels + channel] = static_cast<float>(in[i]) * scale;
+  }
+}
+
+// Any of the PCM layouts the decoders produce, to and from float. Samples
+// are in host order, except packed 24-bit which follows the host too, like
+// the device format. Loading multiplies by |gain|.
+void LoadFloatSamples(const char* in,
+                      const AudioFormat& format,
+                      size_t count,
+                      float gain,
+                      float* out) {
+  int sample_bytes = format.bits_per_sample / 8;
+  const unsigned char* bytes = reinterpret_cast<const unsigned char*>(in);
+  if (format.is_float && sample_bytes == 4) {
+    ScaleFloat(reinterpret_cast<const float*>(in), out, count, gain);
+  } else if (format.is_float) {
+    for (size_t i = 0; i < count; i++) {
+      double sample;
+      memcpy(&sample, in + i * 8, 8);
+      out[i] = static_cast<float>(sample * gain);
+    }
+  } else if (sample_bytes == 1) {
+    for (size_t i = 0; i < count; i++)
+      out[i] = (bytes[i] - 128) * (gain / 128.0f);
+  } else if (sample_bytes == 2) {
+    ConvertS16ToFloat(reinterpret_cast<const int16_t*>(in), out, count,
+                      gain / 32768.0f);
+  } else if (sample_bytes == 3) {
+    int low = IsLittleEndian() ? 0 : 2, high = 2 - low;
+    for (size_t i = 0; i < count; i++, bytes += 3) {
+      int32_t sample = static_cast<int32_t>(
+          (static_cast<uint32_t>(bytes[high]) << 24) | (bytes[1] << 16) |
+          (bytes[low] << 8));
+      out[i] = sample * (gain / 2147483648.0f);
+    }
+  } else {
+    ConvertS32ToFloat(reinterpret_cast<const int32_t*>(in), out, count,
+                      gain / 2147483648.0f);
+  }
+}
+
+void StoreFloatSamples(const float* in,
+                       const AudioFormat& format,
+                       size_t count,
+                       char* out) {
+  int sample_bytes = format.bits_per_sample / 8;
+  if (format.is_float && sample_bytes == 4) {
+    memcpy(out, in, count * 4);
+  } else if (format.is_float) {
+    for (size_t i = 0; i < count; i++) {
+      double sample = in[i];
+      memcpy(out + i * 8, &sample, 8);
+    }
+  } else if (sample_bytes == 1) {
+    for (size_t i = 0; i < count; i++)
+      out[i] = static_cast<char>((FloatToS16(in[i]) >> 8) + 128);
+  } else if (sample_bytes == 2) {
+    ConvertFloatToS16(in, reinterpret_cast<int16_t*>(out), count);
+  } else if (sample_bytes == 3) {
+    int low = IsLittleEndian() ? 0 : 2, high = 2 - low;
+    for (size_t i = 0; i < count; i++, out += 3) {
+      int32_t sample = FloatToS32(in[i]);
+      out[low] = static_cast<char>(sample >> 8);
+      out[1] = static_cast<char>(sample >> 16);
+      out[high] = static_cast<char>(sample >> 24);
+    }
+  } else {
+    ConvertFloatToS32(in, reinterpret_cast<int32_t*>(out), count);
+  }
+}
+
+// Maps a stream's channels onto an output layout. When the output has the
+// same speakers the samples are only reordered, bit for bit; otherwise they
+// go through float and a downmix matrix.
+class ChannelMixer {
+ public:
+  // Returns true when |format| needs converting to reach |output|.
+  bool Configure(const AudioFormat& format, const ChannelLayout& output) {
+    this->format = format;
+    source = LayoutOf(format);
+    target = output;
+    sample_bytes = format.bits_per_sample / 8;
+    active = source.count > 0 && target.count > 0 &&
+             !SameLayout(source, target);
+    if (!active)
+      return false;
+
+    reorder = source.count == target.count;
+    for (int out = 0; out < target.count && reorder; out++) {
+      Speaker* found = std::find(source.speakers,
+                                 source.speakers + source.count,
+                                 target.speakers[out]);
+      reorder = found != source.speakers + source.count;
+      source_index[out] = static_cast<int>(found - source.speakers);
+    }
+    if (!reorder)
+      BuildMatrix();
+    return true;
+  }
+
+  bool Active() const { return active; }
+  bool Downmixing() const { return active && !reorder; }
+
+  // Converts |*size| bytes of whole frames; the result stays valid until the
+  // next call and |*size| is updated to its length.
+  const char* Process(const char* data, size_t* size) {
+    size_t frames = *size / (source.count * sample_bytes);
+    output.resize(frames * target.count * sample_bytes);
+    if (reorder) {
+      Reorder(data, frames);
     } else {
-      TRACE_ERROR("Failed to open file");
-      AudioExitProcess(AudioStatus::kIoError);
+      for (size_t done = 0; done < frames; done += block_frames) {
+        size_t count = (std::min)(frames - done,
+                                  static_cast<size_t>(block_frames));
+        MixBlock(data + done * source.count * sample_bytes,
+                 &output[done * target.count * sample_bytes], count);
+      }
+    }
+    *size = output.size();
+    return output.data();
+  }
+
+ private:
+  enum { block_frames = 256 };
+
+  // Standard fold-down targets, most preferred first. A speaker the output
+  // has goes straight through; LFE is dropped when there is nowhere for it.
+  void BuildMatrix() {
+    using S = Speaker;
+    static const struct {
+      Speaker from, a, b;
+      float weight;
+    } folds[] = {{S::FC, S::FL, S::FR, 0.7071f}, {S::FL, S::FC, S::FC, 0.7071f},
+                 {S::FR, S::FC, S::FC, 0.7071f}, {S::BL, S::SL, S::SL, 1.0f},
+                 {S::BL, S::FL, S::FL, 0.7071f}, {S::BL, S::FC, S::FC, 0.5f},
+                 {S::BR, S::SR, S::SR, 1.0f},    {S::BR, S::FR, S::FR, 0.7071f},
+                 {S::BR, S::FC, S::FC, 0.5f},    {S::SL, S::BL, S::BL, 1.0f},
+                 {S::SL, S::FL, S::FL, 0.7071f}, {S::SL, S::FC, S::FC, 0.5f},
+                 {S::SR, S::BR, S::BR, 1.0f},    {S::SR, S::FR, S::FR, 0.7071f},
+                 {S::SR, S::FC, S::FC, 0.5f},    {S::BC, S::BL, S::BR, 0.7071f},
+                 {S::BC, S::SL, S::SR, 0.7071f}, {S::BC, S::FL, S::FR, 0.5f},
+                 {S::BC, S::FC, S::FC, 0.5f},    {S::FLC, S::FL, S::FL, 1.0f},
+                 {S::FLC, S::FC, S::FC, 0.7071f}, {S::FRC, S::FR, S::FR, 1.0f},
+                 {S::FRC, S::FC, S::FC, 0.7071f}};
+    for (auto& row : matrix)
+      std::fill(row, row + 8, 0.0f);
+    for (int in = 0; in < source.count; in++) {
+      Speaker speaker = source.speakers[in];
+      int direct = TargetIndex(speaker);
+      if (direct >= 0) {
+        matrix[direct][in] = 1.0f;
+        continue;
+      }
+      for (auto& fold : folds) {
+        int a = TargetIndex(fold.a), b = TargetIndex(fold.b);
+        if (fold.from != speaker || a < 0 || b < 0)
+          continue;
+        matrix[a][in] += fold.weight;
+        if (b != a)
+          matrix[b][in] += fold.weight;
+        break;
+      }
+    }
+    // Scale so a full-scale signal on every input cannot clip any output.
+    float loudest = 1.0f;
+    for (int out = 0; out < target.count; out++) {
+      float sum = std::accumulate(matrix[out], matrix[out] + source.count, 0.0f);
+      loudest = (std::max)(loudest, sum);
+    }
+    for (int out = 0; out < target.count; out++) {
+      for (int in = 0; in < source.count; in++)
+        matrix[out][in] /= loudest;
+    }
+  }
+
+  int TargetIndex(Speaker speaker) const {
+    const Speaker* end = target.speakers + target.count;
+    const Speaker* found = std::find(target.speakers, end, speaker);
+    return (found == end) ? -1 : static_cast<int>(found - target.speakers);
+  }
+
+  void Reorder(const char* data, size_t frames) {
+    char* out = output.data();
+    for (size_t frame = 0; frame < frames; frame++) {
+      for (int channel = 0; channel < target.count; channel++) {
+        memcpy(out, data + source_index[channel] * sample_bytes, sample_bytes);
+        out += sample_bytes;
+      }
+      data += source.count * sample_bytes;
+    }
+  }
+
+  void MixBlock(const char* data, char* out, size_t frames) {
+    size_t samples = frames * source.count;
+    interleaved.resize(block_frames * 8);
+    planar_in.resize(block_frames * 8);
+    planar_out.resize(block_frames * 8);
+    LoadFloatSamples(data, format, samples, 1.0f, interleaved.data());
+    for (int in = 0; in < source.count; in++) {
+      for (size_t i = 0; i < frames; i++)
+        planar_in[in * block_frames + i] = interleaved[i * source.count + in];
+    }
+    for (int o = 0; o < target.count; o++) {
+      float* row = &planar_out[o * block_frames];
+      std::fill(row, row + frames, 0.0f);
+      for (int in = 0; in < source.count; in++) {
+        if (matrix[o][in] != 0.0f) {
+          MixAccumulate(row, &planar_in[in * block_frames], matrix[o][in],
+                        frames);
+        }
+      }
     }
+    for (int o = 0; o < target.count; o++) {
+      for (size_t i = 0; i < frames; i++)
+        interleaved[i * target.count + o] = planar_out[o * block_frames + i];
+    }
+    StoreFloatSamples(interleaved.data(), format, frames * target.count, out);
   }
+
+  AudioFormat format;
+  ChannelLayout source, target;
+  int sample_bytes = 2;
+  bool active = false, reorder = false;
+  int source_index[8];
+  float matrix[8][8];
+  std::vector<char> output;
+  std::vector<float> interleaved, planar_in, planar_out;
 };
 
-typedef mpg123_handle MPG123Handle;
+// Polyphase windowed-sinc sample rate converter. The ratio is kept as an
+// exact fraction, so one filter phase per output position is precomputed and
+// every output sample is a single dot product per channel. Odd ratios with
+// more than max_phases positions have theirs rounded down to that grid.
+class Resampler {
+ public:
+  // Returns true when |format| (the stream rate) has to be converted to
+  // |output_rate|. |quality| is low, medium or high.
+  bool Configure(const AudioFormat& format,
+                 int output_rate,
+                 const std::string& quality) {
+    this->format = format;
+    active = format.sample_rate > 0 && output_rate > 0 &&
+             format.sample_rate != output_rate;
+    if (!active)
+      return false;
+
+    int divisor = std::gcd(format.sample_rate, output_rate);
+    up = output_rate / divisor;
+    down = format.sample_rate / divisor;
+    BuildFilter(quality);
+    Reset();
+    return true;
+  }
 
-AudioFormat Format_From_MPG123Handle(MPG123Handle* mh) {
-  AudioFormat fmt;
+  bool Active() const { return active; }
+  size_t Taps() const { return taps; }
 
-  mpg123_getformat(mh, reinterpret_cast<long int*>(&fmt.sample_rate),
-                   &fmt.channels, &fmt.encoding);
+  // Forgets the previous stream, as if the filter had only seen silence.
+  void Reset() {
+    history.assign(format.channels, std::vector<float>(taps / 2 - 1, 0.0f));
+    position = 0;
+    phase = 0;
+  }
 
-  if (fmt.encoding & MPG123_ENC_FLOAT_64)
-    fmt.bits_per_sample = 64;
-  else if (fmt.encoding & MPG123_ENC_FLOAT_32)
-    fmt.bits_per_sample = 32;
-  else if (fmt.encoding & MPG123_ENC_16)
-    fmt.bits_per_sample = 16;
-  else
-    fmt.bits_per_sample = 8;
-  return fmt;
+  // Converts |*size| bytes of whole frames; the result stays valid until the
+  // next call and |*size| is updated to its length.
+  const char* Process(const char* data, size_t* size) {
+    int channels = format.channels;
+    size_t samples = *size / (format.bits_per_sample / 8);
+    size_t frames = samples / channels;
+    interleaved.resize(samples);
+    LoadFloatSamples(data, format, samples, 1.0f, interleaved.data());
+    for (int channel = 0; channel < channels; channel++) {
+      std::vector<float>& line = history[channel];
+      size_t start = line.size();
+      line.resize(start + frames);
+      for (size_t i = 0; i < frames; i++)
+        line[start + i] = interleaved[i * channels + channel];
+    }
+    return Run(size);
+  }
+
+  // Returns what the filter delay still holds back once the stream ends,
+  // and starts over.
+  const char* Flush(size_t* size) {
+    for (auto& line : history)
+      line.resize(line.size() + taps / 2, 0.0f);
+    const char* data = Run(size);
+    Reset();
+    return data;
+  }
+
+ private:
+  enum { max_phases = 1024, max_taps = 1024 };
+
+  // Taps per phase, relative passband edge and Kaiser beta for each level;
+  // roughly 55, 80 and 100 dB of stopband attenuation.
+  void BuildFilter(const std::string& quality) {
+    size_t base_taps = 32;
+    double cutoff = 0.86, beta = 8.0;
+    if (quality == "low") {
+      base_taps = 16;
+      cutoff = 0.80;
+      beta = 5.0;
+    } else if (quality == "high") {
+      base_taps = 64;
+      cutoff = 0.92;
+      beta = 10.0;
+    }
+    // Downsampling moves the cutoff below the output's Nyquist frequency, and
+    // the filter gets longer to keep the same transition band.
+    double ratio = (std::min)(1.0, static_cast<double>(up) / down);
+    cutoff *= ratio;
+    taps = static_cast<size_t>(ceil(base_taps / ratio));
+    taps = (std::min)((taps + 7) & ~static_cast<size_t>(7),
+                      static_cast<size_t>(max_taps));
+    phases = (std::min)(up, static_cast<size_t>(max_phases));
+
+    const double pi = 3.14159265358979323846;
+    double half = taps / 2.0;
+    double norm = BesselI0(beta);
+    filter.assign(phases * taps, 0.0f);
+    for (size_t p = 0; p < phases; p++) {
+      float* row = &filter[p * taps];
+      double fraction = static_cast<double>(p) / phases, sum = 0.0;
+      for (size_t k = 0; k < taps; k++) {
+        double t = k - (half - 1.0) - fraction;
+        double x = cutoff * t;
+        double sinc = (fabs(x) < 1e-9) ? 1.0 : sin(pi * x) / (pi * x);
+        double w = t / half;
+        double window =
+            (fabs(w) >= 1.0) ? 0.0 : BesselI0(beta * sqrt(1.0 - w * w)) / norm;
+        row[k] = static_cast<float>(sinc * window);
+        sum += row[k];
+      }
+      // Unity gain at DC for every phase, so no ripple at the phase rate.
+      for (size_t k = 0; k < taps; k++)
+        row[k] = static_cast<float>(row[k] / sum);
+    }
+  }
+
+  static double BesselI0(double x) {
+    double sum = 1.0, term = 1.0;
+    for (int k = 1; k < 50 && term > sum * 1e-12; k++) {
+      term *= (x / (2.0 * k)) * (x / (2.0 * k));
+      sum += term;
+    }
+    return sum;
+  }
+
+  // Produces every output sample whose taps are all in the history, then
+  // drops the input no later output needs.
+  const char* Run(size_t* size) {
+    int channels = format.channels;
+    size_t available = history[0].size();
+    // An upper bound on the outputs, so the loop below never reallocates.
+    size_t bound = (available >= position + taps)
+                       ? ((available - position - taps) * up + up - 1) / down + 1
+                       : 0;
+    interleaved.resize(bound * channels);
+    float* out = interleaved.data();
+    while (position + taps <= available) {
+      size_t index = (phases == up) ? phase : phase * phases / up;
+      const float* coefficients = &filter[index * taps];
+      for (int channel = 0; channel < channels; channel++)
+        *out++ = DotProduct(&history[channel][position], coefficients, taps);
+      phase += down;
+      position += phase / up;
+      phase %= up;
+    }
+    interleaved.resize(out - interleaved.data());
+    size_t consumed = (std::min)(position, available);
+    for (auto& line : history)
+      line.erase(line.begin(), line.begin() + consumed);
+    position -= consumed;
+
+    output.resize(interleaved.size() * (format.bits_per_sample / 8));
+    StoreFloatSamples(interleaved.data(), format, interleaved.size(),
+                      output.data());
+    *size = output.size();
+    return output.data();
+  }
+
+  AudioFormat format;
+  bool active = false;
+  // Output samples advance the input by down/up; |phase| is the remainder
+  // in units of 1/up.
+  size_t up = 1, down = 1, phases = 1, taps = 8;
+  size_t position = 0, phase = 0;
+  std::vector<float> filter;
+  std::vector<std::vector<float>> history;
+  std::vector<float> interleaved;
+  std::vector<char> output;
+};
+
+// ITU-R BS.1770-4 K-weighting: a high shelf for the head, then a high pass,
+// as direct form II transposed biquads. The coefficients are redesigned for
+// each rate from the analogue prototype, which gives the standard's
+// published 48 kHz values exactly.
+typedef struct _KWeighting {
+  double b[2][3];
+  double a[2][2];
+} KWeighting;
+
+KWeighting KWeighting_For_Rate(int sample_rate) {
+  const double pi = 3.14159265358979323846;
+  KWeighting k;
+  double f0 = 1681.974450955533, gain_db = 3.999843853973347,
+         q = 0.7071752369554196;
+  double t = tan(pi * f0 / sample_rate);
+  double vh = pow(10.0, gain_db / 20.0), vb = pow(vh, 0.4996667741545416);
+  double a0 = 1.0 + t / q + t * t;
+  k.b[0][0] = (vh + vb * t / q + t * t) / a0;
+  k.b[0][1] = 2.0 * (t * t - vh) / a0;
+  k.b[0][2] = (vh - vb * t / q + t * t) / a0;
+  k.a[0][0] = 2.0 * (t * t - 1.0) / a0;
+  k.a[0][1] = (1.0 - t / q + t * t) / a0;
+  f0 = 38.13547087602444;
+  q = 0.5003270373238773;
+  t = tan(pi * f0 / sample_rate);
+  a0 = 1.0 + t / q + t * t;
+  k.b[1][0] = 1.0;
+  k.b[1][1] = -2.0;
+  k.b[1][2] = 1.0;
+  k.a[1][0] = 2.0 * (t * t - 1.0) / a0;
+  k.a[1][1] = (1.0 - t / q + t * t) / a0;
+  return k;
 }
 
-Metadata Metadata_From_Handle(MPG123Handle* mh) {
-  Metadata mt;
+// Filters one channel of |frames| interleaved frames, |stride| samples
+// apart, and returns the sum of squares times |weight|. |state| holds the
+// four filter delays.
+double KWeightScalar(const float* in,
+                     size_t frames,
+                     int stride,
+                     const KWeighting& k,
+                     double* state,
+                     double weight) {
+  double s1 = state[0], s2 = state[1], s3 = state[2], s4 = state[3];
+  double sum = 0.0;
+  for (size_t i = 0; i < frames; i++, in += stride) {
+    double x = *in;
+    double y = k.b[0][0] * x + s1;
+    s1 = k.b[0][1] * x - k.a[0][0] * y + s2;
+    s2 = k.b[0][2] * x - k.a[0][1] * y;
+    double z = k.b[1][0] * y + s3;
+    s3 = k.b[1][1] * y - k.a[1][0] * z + s4;
+    s4 = k.b[1][2] * y - k.a[1][1] * z;
+    sum += z * z;
+  }
+  state[0] = s1;
+  state[1] = s2;
+  state[2] = s3;
+  state[3] = s4;
+  return sum * weight;
+}
 
-  auto copy_field = [](std::string& str, mpg123_string* input) {
-    if (input != nullptr) {
-      str = input->p;
+#ifdef LOOPER_SSE2
+// Two neighbouring channels at once, one per double lane; |state| holds
+// their delays pairwise and |weights| their two weights.
+double KWeightPairSse2(const float* in,
+                       size_t frames,
+                       int stride,
+                       const KWeighting& k,
+                       double* state,
+                       const double* weights) {
+  __m128d s1 = _mm_loadu_pd(state), s2 = _mm_loadu_pd(state + 2);
+  __m128d s3 = _mm_loadu_pd(state + 4), s4 = _mm_loadu_pd(state + 6);
+  const __m128d b00 = _mm_set1_pd(k.b[0][0]), b01 = _mm_set1_pd(k.b[0][1]),
+                b02 = _mm_set1_pd(k.b[0][2]), a00 = _mm_set1_pd(k.a[0][0]),
+                a01 = _mm_set1_pd(k.a[0][1]), b10 = _mm_set1_pd(k.b[1][0]),
+                b11 = _mm_set1_pd(k.b[1][1]), b12 = _mm_set1_pd(k.b[1][2]),
+                a10 = _mm_set1_pd(k.a[1][0]), a11 = _mm_set1_pd(k.a[1][1]);
+  __m128d sum = _mm_setzero_pd();
+  for (size_t i = 0; i < frames; i++, in += stride) {
+    __m128d x = _mm_cvtps_pd(_mm_castsi128_ps(
+        _mm_loadl_epi64(reinterpret_cast<const __m128i*>(in))));
+    __m128d y = _mm_add_pd(_mm_mul_pd(b00, x), s1);
+    s1 = _mm_add_pd(_mm_sub_pd(_mm_mul_pd(b01, x), _mm_mul_pd(a00, y)), s2);
+    s2 = _mm_sub_pd(_mm_mul_pd(b02, x), _mm_mul_pd(a01, y));
+    __m128d z = _mm_add_pd(_mm_mul_pd(b10, y), s3);
+    s3 = _mm_add_pd(_mm_sub_pd(_mm_mul_pd(b11, y), _mm_mul_pd(a10, z)), s4);
+    s4 = _mm_sub_pd(_mm_mul_pd(b12, y), _mm_mul_pd(a11, z));
+    sum = _mm_add_pd(sum, _mm_mul_pd(z, z));
+  }
+  _mm_storeu_pd(state, s1);
+  _mm_storeu_pd(state + 2, s2);
+  _mm_storeu_pd(state + 4, s3);
+  _mm_storeu_pd(state + 6, s4);
+  double lanes[2];
+  _mm_storeu_pd(lanes, sum);
+  return lanes[0] * weights[0] + lanes[1] * weights[1];
+}
+#endif
+
+// The 4x interpolation filter of ITU-R BS.1770-4 Annex 2, one row of 12
+// taps per output phase.
+enum { true_peak_phases = 4, true_peak_taps = 12 };
+static const float kTruePeakFilter[true_peak_phases][true_peak_taps] = {
+    {0.0017089843750f, 0.0109863281250f, -0.0196533203125f, 0.0332031250000f,
+     -0.0594482421875f, 0.1373291015625f, 0.9721679687500f, -0.1022949218750f,
+     0.0476074218750f, -0.0266113281250f, 0.0148925781250f, -0.0083007812500f},
+    {-0.0291748046875f, 0.0292968750000f, -0.0517578125000f, 0.0891113281250f,
+     -0.1665039062500f, 0.4650878906250f, 0.7797851562500f, -0.2003173828125f,
+     0.1015625000000f, -0.0582275390625f, 0.0330810546875f, -0.0189208984375f},
+    {-0.0189208984375f, 0.0330810546875f, -0.0582275390625f, 0.1015625000000f,
+     -0.2003173828125f, 0.7797851562500f, 0.4650878906250f, -0.1665039062500f,
+     0.0891113281250f, -0.0517578125000f, 0.0292968750000f, -0.0291748046875f},
+    {-0.0083007812500f, 0.0148925781250f, -0.0266113281250f, 0.0476074218750f,
+     -0.1022949218750f, 0.9721679687500f, 0.1373291015625f, -0.0594482421875f,
+     0.0332031250000f, -0.0196533203125f, 0.0109863281250f, 0.0017089843750f}};
+
+// Largest magnitude of the oversampled signal for |frames| samples of one
+// channel. |line| holds true_peak_taps - 1 samples of history ahead of them.
+float TruePeakScalar(const float* line, size_t frames) {
+  float peak = 0.0f;
+  for (size_t n = 0; n < frames; n++) {
+    const float* newest = line + n + true_peak_taps - 1;
+    for (int p = 0; p < true_peak_phases; p++) {
+      float sum = 0.0f;
+      for (int k = 0; k < true_peak_taps; k++)
+        sum += kTruePeakFilter[p][k] * newest[-k];
+      peak = (std::max)(peak, fabsf(sum));
+    }
+  }
+  return peak;
+}
+
+#ifdef LOOPER_SSE2
+// The four phases of an output sample side by side in one register.
+float TruePeakSse2(const float* line, size_t frames) {
+  __m128 taps[true_peak_taps];
+  for (int k = 0; k < true_peak_taps; k++) {
+    taps[k] = _mm_setr_ps(kTruePeakFilter[0][k], kTruePeakFilter[1][k],
+                          kTruePeakFilter[2][k], kTruePeakFilter[3][k]);
+  }
+  const __m128 magnitude = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+  __m128 peak = _mm_setzero_ps();
+  for (size_t n = 0; n < frames; n++) {
+    const float* newest = line + n + true_peak_taps - 1;
+    __m128 sum = _mm_mul_ps(taps[0], _mm_set1_ps(newest[0]));
+    for (int k = 1; k < true_peak_taps; k++)
+      sum = _mm_add_ps(sum, _mm_mul_ps(taps[k], _mm_set1_ps(newest[-k])));
+    peak = _mm_max_ps(peak, _mm_and_ps(sum, magnitude));
+  }
+  peak = _mm_max_ps(peak, _mm_movehl_ps(peak, peak));
+  peak = _mm_max_ss(peak, _mm_shuffle_ps(peak, peak, 1));
+  return _mm_cvtss_f32(peak);
+}
+#endif
+
+// EBU R128 measurement of one track, after ITU-R BS.1770-4 and EBU Tech
+// 3342: K-weighted mean square over 400 ms blocks every 100 ms for the
+// gated integrated loudness, 3 s windows for the loudness range, and the
+// true peak of the signal oversampled four times.
+class LoudnessMeter {
+ public:
+  // Takes float samples in |format|'s channel layout. A later call for a
+  // new format, such as the next link of a chained Ogg stream, restarts the
+  // filters but keeps what was measured so far.
+  void Configure(const AudioFormat& format) {
+    channels = format.channels;
+    k = KWeighting_For_Rate(format.sample_rate);
+    sub_block_frames = (std::max)((format.sample_rate + 5) / 10, 1);
+    // The interpolation filter is only needed below 96 kHz.
+    oversample = format.sample_rate < 96000;
+    ChannelLayout layout = LayoutOf(format);
+    weights.assign(channels, 1.0);
+    for (int c = 0; c < channels && c < layout.count; c++) {
+      Speaker speaker = layout.speakers[c];
+      if (speaker == Speaker::LFE)
+        weights[c] = 0.0;
+      else if (speaker == Speaker::BL || speaker == Speaker::BR ||
+               speaker == Speaker::SL || speaker == Speaker::SR)
+        weights[c] = 1.41;
+    }
+    state.assign(channels * 4, 0.0);
+    history.assign(channels, std::vector<float>(true_peak_taps - 1, 0.0f));
+    recent.clear();
+    energy = 0.0;
+    filled = 0;
+  }
+
+  // Adds |frames| interleaved frames.
+  void Process(const float* samples, size_t frames) {
+#ifdef LOOPER_SSE2
+    // Filter state decaying through silence would otherwise go denormal.
+    unsigned int csr = _mm_getcsr();
+    _mm_setcsr(csr | 0x8040);
+#endif
+    for (int c = 0; c < channels; c++)
+      MeasurePeak(samples + c, frames, c);
+    const float* in = samples;
+    size_t left = frames;
+    while (left > 0) {
+      size_t count = (std::min)(left, static_cast<size_t>(sub_block_frames -
+                                                          filled));
+      energy += Filter(in, count);
+      filled += static_cast<int>(count);
+      in += count * channels;
+      left -= count;
+      if (filled == sub_block_frames)
+        EndSubBlock();
+    }
+#ifdef LOOPER_SSE2
+    _mm_setcsr(csr);
+#endif
+  }
+
+  // Mean squares of the 400 ms blocks, which an album pools for its own
+  // gating.
+  const std::vector<double>& Blocks() const { return blocks; }
+
+  double Integrated() const { return GatedLoudness(blocks); }
+
+  // Spread between the 10th and 95th percentile of the gated short-term
+  // loudness, in LU; NAN for tracks too short or too quiet to tell.
+  double Range() const {
+    const double absolute = Energy(-70.0);
+    double sum = 0.0;
+    size_t count = 0;
+    for (double power : short_terms) {
+      if (power > absolute) {
+        sum += power;
+        count++;
+      }
+    }
+    if (count == 0)
+      return NAN;
+    double relative = sum / count * pow(10.0, -20.0 / 10.0);
+    std::vector<double> levels;
+    for (double power : short_terms) {
+      if (power > absolute && power > relative)
+        levels.push_back(Loudness(power));
+    }
+    std::sort(levels.begin(), levels.end());
+    auto percentile = [&levels](double p) {
+      return levels[static_cast<size_t>(llround(p * (levels.size() - 1)))];
+    };
+    return percentile(0.95) - percentile(0.10);
+  }
+
+  // Linear, so 1.0 is full scale.
+  double TruePeak() const { return peak; }
+
+  // Gated integrated loudness of |blocks| in LUFS: blocks under -70 LUFS
+  // go, then those 10 LU under the mean of the rest. NAN for silence.
+  static double GatedLoudness(const std::vector<double>& blocks) {
+    const double absolute = Energy(-70.0);
+    double sum = 0.0;
+    size_t count = 0;
+    for (double power : blocks) {
+      if (power > absolute) {
+        sum += power;
+        count++;
+      }
+    }
+    if (count == 0)
+      return NAN;
+    double relative = sum / count * pow(10.0, -10.0 / 10.0);
+    sum = 0.0;
+    count = 0;
+    for (double power : blocks) {
+      if (power > absolute && power > relative) {
+        sum += power;
+        count++;
+      }
+    }
+    return Loudness(sum / count);
+  }
+
+ private:
+  // 100 ms steps: a block is the last 4, a short-term window the last 30.
+  enum { block_steps = 4, short_term_steps = 30 };
+
+  static double Loudness(double power) { return -0.691 + 10.0 * log10(power); }
+  static double Energy(double lufs) { return pow(10.0, (lufs + 0.691) / 10.0); }
+
+  double Filter(const float* in, size_t frames) {
+    double sum = 0.0;
+    int c = 0;
+#ifdef LOOPER_SSE2
+    for (; c + 2 <= channels; c += 2)
+      sum += KWeightPairSse2(in + c, frames, channels, k, &state[c * 4],
+                             &weights[c]);
+#endif
+    for (; c < channels; c++)
+      sum += KWeightScalar(in + c, frames, channels, k, &state[c * 4],
+                           weights[c]);
+    return sum;
+  }
+
+  void MeasurePeak(const float* in, size_t frames, int channel) {
+    std::vector<float>& line = history[channel];
+    size_t start = line.size();
+    line.resize(start + frames);
+    float sample_peak = 0.0f;
+    for (size_t i = 0; i < frames; i++) {
+      line[start + i] = in[i * channels];
+      sample_peak = (std::max)(sample_peak, fabsf(line[start + i]));
+    }
+    peak = (std::max)(peak, static_cast<double>(sample_peak));
+    if (oversample) {
+#ifdef LOOPER_SSE2
+      float found = TruePeakSse2(line.data(), frames);
+#else
+      float found = TruePeakScalar(line.data(), frames);
+#endif
+      peak = (std::max)(peak, static_cast<double>(found));
+    }
+    line.erase(line.begin(), line.end() - (true_peak_taps - 1));
+  }
+
+  void EndSubBlock() {
+    recent.push_back(energy);
+    if (recent.size() > short_term_steps)
+      recent.erase(recent.begin());
+    energy = 0.0;
+    filled = 0;
+    size_t steps = recent.size();
+    if (steps >= block_steps) {
+      double sum = std::accumulate(recent.end() - block_steps, recent.end(),
+                                   0.0);
+      blocks.push_back(sum / (block_steps * sub_block_frames));
+    }
+    if (steps == short_term_steps) {
+      double sum = std::accumulate(recent.begin(), recent.end(), 0.0);
+      short_terms.push_back(sum / (short_term_steps * sub_block_frames));
+    }
+  }
+
+  int channels = 0, sub_block_frames = 1, filled = 0;
+  bool oversample = true;
+  KWeighting k;
+  std::vector<double> weights, state;
+  std::vector<std::vector<float>> history;
+  // Weighted sums of squares of the last 30 steps, the newest last, and of
+  // the step being filled.
+  std::vector<double> recent;
+  double energy = 0.0;
+  std::vector<double> blocks, short_terms;
+  double peak = 0.0;
+};
+
+// Destination for decoded PCM. The playlist loop only talks to this
+// interface, so the same decoders can feed a sound card, a file or nothing.
+class AudioSink {
+ public:
+  virtual ~AudioSink() {}
+
+  virtual void SetFormat(const AudioFormat& format) = 0;
+  virtual void Open() = 0;
+  // |size| is in bytes and always covers whole frames.
+  virtual void WriteAudio(const char* data, size_t size) = 0;
+  virtual void Close() = 0;
+
+  // Sinks with a buffer of their own can let the producer decode straight
+  // into it. Returns the writable size in bytes, always whole frames, or 0
+  // when the caller should fall back to WriteAudio.
+  virtual size_t BeginWrite(char** region, size_t size) {
+    (void)region;
+    (void)size;
+    return 0;
+  }
+
+  // Publishes |size| bytes written into the region from BeginWrite.
+  virtual void CommitWrite(size_t size) { (void)size; }
+
+  // Prints whatever the sink counted while playing (xruns and the like).
+  virtual void PrintStats() {}
+
+  // The part of opening that does not depend on the format, started while
+  // the first track is still being opened.
+  virtual void Warmup() {}
+
+  // Holds playback where it is, keeping everything queued, or carries on.
+  virtual void Pause(bool paused) { (void)paused; }
+
+  // Throws away whatever is queued but not yet heard, so the next write is
+  // heard within a period. A pause stays in effect.
+  virtual void Flush() {}
+
+  // When the first sample was handed to the output, or the epoch before
+  // that. Safe to call from any thread.
+  std::chrono::steady_clock::time_point FirstSample() const {
+    return std::chrono::steady_clock::time_point(
+        std::chrono::steady_clock::duration(first_sample.load()));
+  }
+
+  // Opens the sink on first use and keeps it open across tracks; it is only
+  // reopened when channels, rate or sample width change.
+  virtual void Configure(const AudioFormat& format) {
+    if (is_open && SameFormat(format, configured))
+      return;
+    Close();
+    SetFormat(format);
+    Open();
+    configured = format;
+  }
+
+ protected:
+  void MarkFirstSample() {
+    if (first_sample.load() == 0)
+      first_sample = std::chrono::steady_clock::now().time_since_epoch().count();
+  }
+
+  AudioFormat configured;
+  bool is_open = false;
+  std::atomic<std::chrono::steady_clock::rep> first_sample{0};
+};
+
+#ifdef _WIN32
+
+// based on
+// https://www.planet-source-code.com/vb/scripts/ShowCode.asp?txtCodeId=4422&lngWId=3
+// based on
+// https://chromium.googlesource.com/chromium/src.git/+/master/media/audio/win/waveout_output_win.cc
+
+class SimplePlayer : public AudioSink {
+ public:
+  explicit SimplePlayer(int block_count = default_block_count,
+                        int block_size = default_block_size)
+      : block_size(block_size), block_count(block_count) {
+    free_blocks_count = block_count;
+
+    InitializeCriticalSection(&waveCriticalSection);
+  }
+
+  void SetupBlocks() {
+    current_block = 0;
+    blocks = std::make_unique<unsigned char[]>(block_count * GetBlockSize());
+    for (int ix = 0; ix < block_count; ++ix) {
+      WAVEHDR* block = GetBlock(ix);
+      block->lpData = reinterpret_cast<char*>(block) + sizeof(WAVEHDR);
+      block->dwBufferLength = block_size;
+      block->dwBytesRecorded = 0;
+      block->dwFlags = WHDR_DONE;
+      block->dwLoops = 0;
+    }
+  }
+
+  // More than two channels need WAVE_FORMAT_EXTENSIBLE and its channel
+  // mask; the stream is reordered to WAVE order and Windows maps that onto
+  // the speakers, downmixing itself where it has to.
+  void SetFormat(const AudioFormat& fmt) override {
+    WORD tag = fmt.is_float ? WAVE_FORMAT_IEEE_FLOAT : WAVE_FORMAT_PCM;
+    WAVEFORMATEX& format = wfx.Format;
+    format.nSamplesPerSec = fmt.sample_rate;
+    format.wBitsPerSample = static_cast<WORD>(fmt.bits_per_sample);
+    format.nChannels = static_cast<WORD>(fmt.channels);
+    format.cbSize = 0;
+    format.wFormatTag = tag;
+    format.nBlockAlign = (format.wBitsPerSample * format.nChannels) >> 3;
+    format.nAvgBytesPerSec = format.nBlockAlign * format.nSamplesPerSec;
+
+    ChannelLayout layout = WaveChannelLayout(fmt.channels);
+    mixer.Configure(fmt, layout);
+    if (fmt.channels > 2) {
+      format.wFormatTag = WAVE_FORMAT_EXTENSIBLE;
+      format.cbSize = sizeof(WAVEFORMATEXTENSIBLE) - sizeof(WAVEFORMATEX);
+      wfx.Samples.wValidBitsPerSample = format.wBitsPerSample;
+      wfx.dwChannelMask = 0;
+      for (int i = 0; i < layout.count; i++)
+        wfx.dwChannelMask |= 1u << static_cast<int>(layout.speakers[i]);
+      // KSDATAFORMAT_SUBTYPE_PCM and _IEEE_FLOAT differ only in the first
+      // field, which is the plain format tag.
+      wfx.SubFormat = {tag, 0x0000, 0x0010,
+                       {0x80, 0x00, 0x00, 0xaa, 0x00, 0x38, 0x9b, 0x71}};
+    }
+  }
+
+  void Open() override {
+    SetupBlocks();
+    if (::waveOutOpen(&hWaveOut, WAVE_MAPPER,
+                      reinterpret_cast<LPCWAVEFORMATEX>(&wfx),
+                      reinterpret_cast<DWORD_PTR>(waveOutProc),
+                      reinterpret_cast<DWORD_PTR>(this),
+                      CALLBACK_FUNCTION) != MMSYSERR_NOERROR) {
+      TRACE_INFO("unable to open wave mapper device");
+      AudioExitProcess(AudioStatus::kAudioDeviceError);
+    } else {
+      TRACE_INFO("Opening Device");
+    }
+    is_open = true;
+    // if (::waveOutSetVolume(hWaveOut, 0xFFFFFFFF) != MMSYSERR_NOERROR)
+    // {
+    //         TRACE_INFO("Failed to Set Device");
+    // }
+  }
+
+  int BitsPerSample() { return wfx.Format.wBitsPerSample; }
+
+  int Channels() { return wfx.Format.nChannels; }
+
+  void IncrementBlock() {
+    EnterCriticalSection(&waveCriticalSection);
+    free_blocks_count++;
+    LeaveCriticalSection(&waveCriticalSection);
+  }
+
+  void DecrementBlock() {
+    EnterCriticalSection(&waveCriticalSection);
+    free_blocks_count--;
+    LeaveCriticalSection(&waveCriticalSection);
+  }
+  void FreeBlocks() {
+    while (free_blocks_count < block_count)
+      Sleep(10);
+    for (int ix = 0; ix < block_count; ++ix) {
+      ::waveOutUnprepareHeader(hWaveOut, GetBlock(ix), sizeof(WAVEHDR));
+    }
+    blocks.reset();
+  }
+
+  void WriteAudio(const char* data, size_t data_size) override {
+    WAVEHDR* current;
+    int remain;
+    if (mixer.Active())
+      data = mixer.Process(data, &data_size);
+    int size = static_cast<int>(data_size);
+
+    current = GetBlock(current_block);
+
+    while (size > 0) {
+      if (current->dwFlags & WHDR_PREPARED)
+        waveOutUnprepareHeader(hWaveOut, current, sizeof(WAVEHDR));
+
+      if (size < (int)(block_size - current->dwUser)) {
+        memcpy(current->lpData + current->dwUser, data, size);
+        current->dwUser += size;
+        break;
+      }
+
+      remain = block_size - current->dwUser;
+      memcpy(current->lpData + current->dwUser, data, remain);
+      size -= remain;
+      data += remain;
+      current->dwBufferLength = block_size;
+
+      waveOutPrepareHeader(hWaveOut, current, sizeof(WAVEHDR));
+      waveOutWrite(hWaveOut, current, sizeof(WAVEHDR));
+      MarkFirstSample();
+
+      DecrementBlock();
+
+      while (!free_blocks_count)
+        Sleep(10);
+
+      current_block++;
+      current_block %= block_count;
+
+      current = GetBlock(current_block);
+      current->dwUser = 0;
+    }
+  }
+
+  void Pause(bool paused) override {
+    if (!is_open)
+      return;
+    if (paused)
+      ::waveOutPause(hWaveOut);
+    else
+      ::waveOutRestart(hWaveOut);
+  }
+
+  // waveOutReset hands every queued block back through WOM_DONE.
+  void Flush() override {
+    if (!is_open)
+      return;
+    ::waveOutReset(hWaveOut);
+    GetBlock(current_block)->dwUser = 0;
+  }
+
+  ~SimplePlayer() { DeleteCriticalSection(&waveCriticalSection); }
+  void Close() override {
+    if (!is_open)
+      return;
+    FreeBlocks();
+    ::waveOutClose(hWaveOut);
+    is_open = false;
+    TRACE_INFO("closing device");
+  }
+
+  enum {
+    default_buffer_size = 0x400,
+    default_block_count = 0x20,
+    default_block_size = 0x2000
+  };
+
+ private:
+  int GetBlockSize() { return (sizeof(WAVEHDR) + block_size + 15u) & (~15u); }
+
+  WAVEHDR* GetBlock(int position) {
+    return reinterpret_cast<WAVEHDR*>(&blocks[GetBlockSize() * position]);
+  }
+  std::unique_ptr<unsigned char[]> blocks;
+  WAVEFORMATEXTENSIBLE wfx;
+  ChannelMixer mixer;
+  HWAVEOUT hWaveOut;
+  CRITICAL_SECTION waveCriticalSection;
+  volatile int free_blocks_count;
+  int block_size, block_count, current_block;
+};
+
+#elif __linux__
+// Set by SIGUSR1; whichever thread writes to the device prints the xrun
+// report the next time it gets there.
+static volatile sig_atomic_t xrun_report_requested = 0;
+
+static void RequestXrunReport(int) {
+  xrun_report_requested = 1;
+}
+
+typedef struct _XrunEvent {
+  // Seconds since the device was opened.
+  double seconds;
+  // -EPIPE for an underrun, -ESTRPIPE for a suspend.
+  int error;
+  // Audio still queued in the ring when it happened, in milliseconds.
+  unsigned int ring_ms;
+} XrunEvent;
+
+class SimplePlayer : public AudioSink {
+ public:
+  snd_pcm_format_t get_pcm_format() {
+    switch (bits_per_sample) {
+      case 64:
+        return ((IsLittleEndian()) ? SND_PCM_FORMAT_FLOAT64_LE
+                                   : SND_PCM_FORMAT_FLOAT64_BE);
+      case 32:
+        if (is_float) {
+          return ((IsLittleEndian()) ? SND_PCM_FORMAT_FLOAT_LE
+                                     : SND_PCM_FORMAT_FLOAT_BE);
+        }
+        return ((IsLittleEndian()) ? SND_PCM_FORMAT_S32_LE
+                                   : SND_PCM_FORMAT_S32_BE);
+      case 24:
+        return ((IsLittleEndian()) ? SND_PCM_FORMAT_S24_3LE
+                                   : SND_PCM_FORMAT_S24_3BE);
+      case 16:
+        return ((IsLittleEndian()) ? SND_PCM_FORMAT_S16_LE
+                                   : SND_PCM_FORMAT_S16_BE);
+      case 8:
+        return SND_PCM_FORMAT_U8;
+      default:
+        return SND_PCM_FORMAT_UNKNOWN;
+    }
+  }
+  void SetFormat(const AudioFormat& format) override {
+    channels = format.channels;
+    bits_per_sample = format.bits_per_sample;
+    encoding = format.encoding;
+    sample_rate = format.sample_rate;
+    is_float = format.is_float;
+    stream_format = format;
+  }
+
+  int BitsPerSample() { return bits_per_sample; }
+  int Channels() { return channels; }
+
+  // Unlike the default, an open ALSA handle is renegotiated in place rather
+  // than closed and reopened.
+  void Configure(const AudioFormat& format) override {
+    if (is_open && SameFormat(format, configured))
+      return;
+    SetFormat(format);
+    if (!is_open) {
+      Open();
+    } else {
+      std::string message =
+          string_format("Renegotiating device: %d Hz, %d channels, %d bits",
+                        sample_rate, channels, bits_per_sample);
+      TRACE_INFO(message.c_str());
+      DrainResampler();
+      StopOutputThread();
+      FlushBatch();
+      snd_pcm_drain(pcm_handle);
+      snd_pcm_hw_free(pcm_handle);
+      SetHardwareParams();
+      StartOutputThread();
+    }
+    configured = format;
+  }
+
+  // Connecting to the device (a sound server, for "default") can take as
+  // long as opening a file, so it overlaps with the first track's Open.
+  void Warmup() override {
+    AudioResult result;
+    if (pcm_handle != nullptr)
+      return;
+    if ((result = snd_pcm_open(&pcm_handle, PCM_DEVICE, SND_PCM_STREAM_PLAYBACK,
+                               0)) < 0) {
+      std::string message = string_format("Can't open \"%s\" PCM device. %s",
+                                          PCM_DEVICE, snd_strerror(result));
+      TRACE_ERROR(message.c_str());
+      AudioExitProcess(AudioStatus::kAudioDeviceError);
+    }
+  }
+
+  void Open() override {
+    Warmup();
+    SetHardwareParams();
+    StartOutputThread();
+    if (opened_at == std::chrono::steady_clock::time_point())
+      opened_at = std::chrono::steady_clock::now();
+    is_open = true;
+  }
+
+  void SetHardwareParams() {
+    AudioResult result;
+    snd_pcm_hw_params_alloca(&params);
+
+    snd_pcm_hw_params_any(pcm_handle, params);
+
+    mmap_access = false;
+    if (GetOptions().mmap) {
+      if (snd_pcm_hw_params_set_access(pcm_handle, params,
+                                       SND_PCM_ACCESS_MMAP_INTERLEAVED) >= 0) {
+        mmap_access = true;
+      } else {
+        TRACE_WARNING("device has no mmap access, using read/write");
+      }
+    }
+
+    if (!mmap_access &&
+        (result = snd_pcm_hw_params_set_access(
+             pcm_handle, params, SND_PCM_ACCESS_RW_INTERLEAVED)) < 0) {
+      std::string message =
+          string_format("Can't set interleaved mode. %s", snd_strerror(result));
+      TRACE_ERROR(message.c_str());
+      AudioExitProcess(AudioStatus::kAudioDeviceError);
+    }
+
+    if ((result = snd_pcm_hw_params_set_format(pcm_handle, params,
+                                               get_pcm_format())) < 0) {
+      std::string message =
+          string_format("Can't set format. %s", snd_strerror(result));
+      TRACE_ERROR(message.c_str());
+      AudioExitProcess(AudioStatus::kAudioDeviceError);
+    }
+    // A device with fewer (or only more) channels gets the nearest count and
+    // the mixer maps the stream onto it.
+    device_channels = channels;
+    if ((result = snd_pcm_hw_params_set_channels_near(pcm_handle, params,
+                                                      &device_channels)) < 0) {
+      std::string message =
+          string_format("Can't set channels number. %s", snd_strerror(result));
+      TRACE_ERROR(message.c_str());
+      AudioExitProcess(AudioStatus::kAudioDeviceError);
+    }
+
+    // Rate conversion is done by the Resampler below, not by the plug layer,
+    // so the rate reported back is the one the hardware really runs at.
+    snd_pcm_hw_params_set_rate_resample(pcm_handle, params, 0);
+    if (((result = snd_pcm_hw_params_set_rate_near(
+              pcm_handle, params, reinterpret_cast<unsigned int*>(&sample_rate),
+              0))) < 0) {
+      std::string message =
+          string_format("Can't set sample_rate. %s", snd_strerror(result));
+      TRACE_ERROR(message.c_str());
+      AudioExitProcess(AudioStatus::kAudioDeviceError);
+    }
+
+    // The buffer is set before the period so the period request is fitted
+    // inside it rather than the other way round.
+    const LooperOptions& options = GetOptions();
+    if (options.buffer_us > 0) {
+      unsigned int buffer_time = options.buffer_us;
+      if ((result = snd_pcm_hw_params_set_buffer_time_near(
+               pcm_handle, params, &buffer_time, 0)) < 0) {
+        std::string message =
+            string_format("Can't set buffer time. %s", snd_strerror(result));
+        TRACE_WARNING(message.c_str());
+      }
+    }
+    if (options.period_us > 0) {
+      unsigned int period_time = options.period_us;
+      if ((result = snd_pcm_hw_params_set_period_time_near(
+               pcm_handle, params, &period_time, 0)) < 0) {
+        std::string message =
+            string_format("Can't set period time. %s", snd_strerror(result));
+        TRACE_WARNING(message.c_str());
+      }
+    }
+
+    if ((result = snd_pcm_hw_params(pcm_handle, params)) < 0) {
+      std::string message = string_format("Can't set harware parameters. %s",
+                                          snd_strerror(result));
+      TRACE_ERROR(message.c_str());
+      AudioExitProcess(AudioStatus::kAudioDeviceError);
+    }
+    snd_pcm_hw_params_get_period_size(params, &period_frames, 0);
+    snd_pcm_hw_params_get_buffer_size(params, &buffer_frames);
+    can_pause = snd_pcm_hw_params_can_pause(params) == 1;
+    frame_bytes = snd_pcm_frames_to_bytes(pcm_handle, 1);
+
+    unsigned int period_time = 0, buffer_time = 0;
+    snd_pcm_hw_params_get_period_time(params, &period_time, 0);
+    snd_pcm_hw_params_get_buffer_time(params, &buffer_time, 0);
+    std::string message = string_format(
+        "Device period %u us (%lu frames), buffer %u us (%lu frames)",
+        period_time, static_cast<unsigned long>(period_frames), buffer_time,
+        static_cast<unsigned long>(buffer_frames));
+    TRACE_INFO(message.c_str());
+    batch.assign((std::max<snd_pcm_uframes_t>)(period_frames, 1) * frame_bytes,
+                 0);
+    batch_fill = 0;
+
+    if (mixer.Configure(stream_format, DeviceLayout())) {
+      message = string_format(
+          mixer.Downmixing() ? "Mixing %d channels down to %u"
+                             : "Reordering %d channels to %u for the device",
+          channels, device_channels);
+      TRACE_INFO(message.c_str());
+    }
+    AudioFormat mixed = stream_format;
+    mixed.channels = device_channels;
+    if (resampler.Configure(mixed, sample_rate, options.resample_quality)) {
+      message = string_format("Resampling %d Hz to %d Hz (%s, %zu taps)",
+                              stream_format.sample_rate, sample_rate,
+                              options.resample_quality.c_str(),
+                              resampler.Taps());
+      TRACE_INFO(message.c_str());
+    }
+  }
+
+  // The device's own channel map when the driver reports one, otherwise
+  // ALSA's conventional order (surround51 is FL FR RL RR FC LFE).
+  ChannelLayout DeviceLayout() {
+    using S = Speaker;
+    static const Speaker defaults[8][8] = {
+        {S::FC},
+        {S::FL, S::FR},
+        {S::FL, S::FR, S::FC},
+        {S::FL, S::FR, S::BL, S::BR},
+        {S::FL, S::FR, S::BL, S::BR, S::FC},
+        {S::FL, S::FR, S::BL, S::BR, S::FC, S::LFE},
+        {S::FL, S::FR, S::BL, S::BR, S::FC, S::LFE, S::BC},
+        {S::FL, S::FR, S::BL, S::BR, S::FC, S::LFE, S::SL, S::SR}};
+    int count = (std::min)(static_cast<int>(device_channels), 8);
+    ChannelLayout layout = MakeLayout(defaults[count - 1], count);
+
+    snd_pcm_chmap_t* map = snd_pcm_get_chmap(pcm_handle);
+    if (map == nullptr)
+      return layout;
+    ChannelLayout reported;
+    for (unsigned int i = 0; i < map->channels && i < 8; i++) {
+      Speaker speaker;
+      switch (map->pos[i]) {
+        case SND_CHMAP_MONO:
+        case SND_CHMAP_FC:
+          speaker = S::FC;
+          break;
+        case SND_CHMAP_FL:
+          speaker = S::FL;
+          break;
+        case SND_CHMAP_FR:
+          speaker = S::FR;
+          break;
+        case SND_CHMAP_RL:
+          speaker = S::BL;
+          break;
+        case SND_CHMAP_RR:
+          speaker = S::BR;
+          break;
+        case SND_CHMAP_LFE:
+          speaker = S::LFE;
+          break;
+        case SND_CHMAP_SL:
+          speaker = S::SL;
+          break;
+        case SND_CHMAP_SR:
+          speaker = S::SR;
+          break;
+        case SND_CHMAP_RC:
+          speaker = S::BC;
+          break;
+        case SND_CHMAP_FLC:
+          speaker = S::FLC;
+          break;
+        case SND_CHMAP_FRC:
+          speaker = S::FRC;
+          break;
+        default:
+          free(map);
+          return layout;
+      }
+      reported.speakers[reported.count++] = speaker;
+    }
+    free(map);
+    return (reported.count == count) ? reported : layout;
+  }
+  void Close() override {
+    if (pcm_handle)
+      DrainResampler();
+    StopOutputThread();
+    if (pcm_handle) {
+      FlushBatch();
+      snd_pcm_drain(pcm_handle);
+      snd_pcm_close(pcm_handle);
+      pcm_handle = nullptr;
+    }
+    is_open = false;
+  }
+  void PrintStats() override {
+    std::cout << string_format(
+        "Xruns: %lu underruns, %lu suspends, %lu short writes\n",
+        underruns, suspends, short_writes);
+    for (auto& event : xruns) {
+      std::cout << string_format(
+          "  %10.3f s  %-8s ring %u ms\n", event.seconds,
+          (event.error == -ESTRPIPE) ? "suspend" : "underrun", event.ring_ms);
+    }
+    if (underruns + suspends > xruns.size())
+      std::cout << string_format("  (only the first %zu are listed)\n",
+                                 xruns.size());
+  }
+
+  snd_pcm_uframes_t bytes_to_frames(ssize_t _bytes) {
+    return snd_pcm_bytes_to_frames(pcm_handle, _bytes);
+  }
+
+  // Called from the decoding loop.
+  void WriteAudio(const char* data, size_t size) override {
+    if (mixer.Active())
+      data = mixer.Process(data, &size);
+    if (resampler.Active())
+      data = resampler.Process(data, &size);
+    Queue(data, size);
+  }
+
+  // With the pipeline the decoder writes into the ring in place; without it
+  // and with mmap access it writes into the device area itself.
+  size_t BeginWrite(char** region, size_t size) override {
+    // Mixed or resampled output differs in size from what the decoder would
+    // write.
+    if (mixer.Active() || resampler.Active())
+      return 0;
+    if (output_thread.joinable()) {
+      Throttle();
+      size_t available = (std::min)(ring.Reserve(region), size);
+      return available - available % frame_bytes;
+    }
+    if (mmap_access) {
+      // Anything still batched from WriteAudio must reach the device first.
+      FlushBatch();
+      return MmapBegin(region, size / frame_bytes) * frame_bytes;
+    }
+    return 0;
+  }
+
+  void CommitWrite(size_t size) override {
+    if (output_thread.joinable()) {
+      ring.Publish(size);
+      WakeOutput();
+      if (ring.Fill() >= high_watermark)
+        throttled = true;
+      return;
+    }
+    MmapCommit(size / frame_bytes);
+  }
+
+  // The output thread, when there is one, owns the device and carries the
+  // pause out between two periods; the ring keeps what was queued.
+  void Pause(bool paused) override {
+    if (pcm_handle == nullptr)
+      return;
+    if (output_thread.joinable()) {
+      pause_requested = paused;
+      Signal();
+      return;
+    }
+    PauseDevice(paused);
+  }
+
+  void Flush() override {
+    if (pcm_handle == nullptr)
+      return;
+    resampler.Reset();
+    if (output_thread.joinable()) {
+      // Waits at most for the period being written to finish.
+      flush_requested = true;
+      Signal();
+      std::unique_lock<std::mutex> lock(ring_mutex);
+      ring_changed.wait(lock, [this]() { return !flush_requested; });
+      return;
+    }
+    batch_fill = 0;
+    DropDevice();
+  }
+
+  snd_pcm_t* pcm_handle = nullptr;
+  snd_pcm_hw_params_t* params;
+  snd_pcm_uframes_t frames;
+  int channels, encoding, sample_rate, bits_per_sample;
+  bool is_float = false;
+  enum { default_buffer_size = 0x400 };
+
+ private:
+  // With the pipeline enabled this only queues the samples; the output
+  // thread owns the device.
+  void Queue(const char* data, size_t size) {
+    if (!output_thread.joinable()) {
+      BatchWrite(data, size);
+      return;
+    }
+    while (size > 0) {
+      Throttle();
+      size_t written = ring.Write(data, size);
+      WakeOutput();
+      data += written;
+      size -= written;
+      if (ring.Fill() >= high_watermark)
+        throttled = true;
+    }
+  }
+
+  // Pushes out the last samples the resampler holds back for its filter
+  // delay, before the stream ends or changes format.
+  void DrainResampler() {
+    if (!resampler.Active())
+      return;
+    size_t size;
+    const char* data = resampler.Flush(&size);
+    Queue(data, size);
+  }
+
+  // Once the ring reached the high watermark the decoder sleeps until it
+  // drains to the low one. Keys pressed meanwhile are handled after the
+  // buffer being queued, as they would be anyway.
+  void Throttle() {
+    if (!throttled)
+      return;
+    decoder_waiting = true;
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    {
+      std::unique_lock<std::mutex> lock(ring_mutex);
+      ring_changed.wait(lock, [this]() {
+        return ring.Fill() <= low_watermark;
+      });
+    }
+    decoder_waiting = false;
+    throttled = false;
+  }
+
+  // Either side of the ring sleeps on |ring_changed| and is only signalled
+  // once the level it waits for has been crossed, or a request came in.
+  void Signal() {
+    { std::lock_guard<std::mutex> lock(ring_mutex); }
+    ring_changed.notify_all();
+  }
+
+  // After the decoder queued samples.
+  void WakeOutput() {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (ring.Fill() >= output_wants)
+      Signal();
+  }
+
+  // After the output thread took samples.
+  void WakeDecoder() {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (decoder_waiting && ring.Fill() <= low_watermark)
+      Signal();
+  }
+
+  // Sleeps the output thread until |bytes| are queued, the stream ends or a
+  // pause or flush request comes in.
+  void WaitForRing(size_t bytes, bool device_paused) {
+    output_wants = bytes;
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    {
+      std::unique_lock<std::mutex> lock(ring_mutex);
+      ring_changed.wait(lock, [this, bytes, device_paused]() {
+        return ring.Fill() >= bytes || end_of_stream || flush_requested ||
+               pause_requested != device_paused;
+      });
+    }
+    output_wants = SIZE_MAX;
+  }
+
+  // Brings the stream back after an error; the caller then retries the
+  // same frames, so nothing queued is ever dropped.
+  void Recover(int error) {
+    if (error == -EPIPE || error == -ESTRPIPE)
+      RecordXrun(error);
+    if (error == -EPIPE) {
+      snd_pcm_prepare(pcm_handle);
+    } else if (error == -ESTRPIPE) {
+      AudioResult result;
+      while ((result = snd_pcm_resume(pcm_handle)) == -EAGAIN)
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+      // Not every driver can resume; a fresh start loses nothing queued.
+      if (result < 0)
+        snd_pcm_prepare(pcm_handle);
+    } else if (snd_pcm_recover(pcm_handle, error, 1) < 0) {
+      std::string message =
+          string_format("Can't recover PCM device. %s", snd_strerror(error));
+      TRACE_ERROR(message.c_str());
+      AudioExitProcess(AudioStatus::kAudioDeviceError);
+    }
+  }
+
+  void RecordXrun(int error) {
+    if (error == -EPIPE)
+      underruns++;
+    else
+      suspends++;
+    if (xruns.size() >= max_xrun_events)
+      return;
+    XrunEvent event;
+    event.seconds = std::chrono::duration<double>(
+                        std::chrono::steady_clock::now() - opened_at)
+                        .count();
+    event.error = error;
+    event.ring_ms = 0;
+    if (output_thread.joinable()) {
+      event.ring_ms = static_cast<unsigned int>(
+          ring.Fill() / frame_bytes * 1000 / sample_rate);
+    }
+    xruns.push_back(event);
+    std::string message = string_format(
+        "%s at %.3f s, ring %u ms",
+        (error == -EPIPE) ? "Underrun" : "Suspend", event.seconds,
+        event.ring_ms);
+    TRACE_WARNING(message.c_str());
+  }
+
+  // Devices that cannot pause are stopped instead, which loses what their
+  // buffer held; the ring still keeps everything behind it.
+  void PauseDevice(bool paused) {
+    snd_pcm_state_t state = snd_pcm_state(pcm_handle);
+    if (paused && state == SND_PCM_STATE_RUNNING) {
+      if (can_pause)
+        snd_pcm_pause(pcm_handle, 1);
+      else
+        DropDevice();
+    } else if (!paused && state == SND_PCM_STATE_PAUSED) {
+      snd_pcm_pause(pcm_handle, 0);
+    }
+  }
+
+  // Discards the device buffer and leaves the stream ready for new frames.
+  void DropDevice() {
+    snd_pcm_drop(pcm_handle);
+    snd_pcm_prepare(pcm_handle);
+  }
+
+  // Maps up to |wanted| contiguous frames of the device buffer, waiting for
+  // at least a period (or |wanted|, if smaller) to become free.
+  snd_pcm_uframes_t MmapBegin(char** region, snd_pcm_uframes_t wanted) {
+    snd_pcm_uframes_t minimum = (std::min)(wanted, period_frames);
+    for (;;) {
+      snd_pcm_sframes_t avail = snd_pcm_avail_update(pcm_handle);
+      if (avail < 0) {
+        Recover(static_cast<int>(avail));
+        continue;
+      }
+      if (static_cast<snd_pcm_uframes_t>(avail) < minimum) {
+        // A full buffer that never started would wait forever.
+        if (snd_pcm_state(pcm_handle) == SND_PCM_STATE_PREPARED) {
+          snd_pcm_start(pcm_handle);
+        } else {
+          AudioResult result = snd_pcm_wait(pcm_handle, 1000);
+          if (result < 0)
+            Recover(result);
+        }
+        continue;
+      }
+      const snd_pcm_channel_area_t* areas;
+      snd_pcm_uframes_t count = (std::min)(
+          wanted, static_cast<snd_pcm_uframes_t>(avail));
+      AudioResult result =
+          snd_pcm_mmap_begin(pcm_handle, &areas, &mmap_offset, &count);
+      if (result < 0) {
+        Recover(result);
+        continue;
+      }
+      *region = reinterpret_cast<char*>(areas[0].addr) +
+                (areas[0].first + mmap_offset * areas[0].step) / 8;
+      return count;
+    }
+  }
+
+  void MmapCommit(snd_pcm_uframes_t count) {
+    snd_pcm_sframes_t result =
+        snd_pcm_mmap_commit(pcm_handle, mmap_offset, count);
+    if (result < 0) {
+      Recover(static_cast<int>(result));
+      return;
+    }
+    MarkFirstSample();
+    // mmap writes never trigger the start threshold; start once half the
+    // buffer is queued so playback begins with some headroom.
+    if (snd_pcm_state(pcm_handle) == SND_PCM_STATE_PREPARED &&
+        snd_pcm_avail_update(pcm_handle) <=
+            static_cast<snd_pcm_sframes_t>(buffer_frames / 2)) {
+      snd_pcm_start(pcm_handle);
+    }
+  }
+
+  // Without the output thread, decoder chunks of whatever size are gathered
+  // into whole periods so each device write wakes the hardware once.
+  void BatchWrite(const char* data, size_t size) {
+    while (size > 0) {
+      if (batch_fill == 0 && size >= batch.size()) {
+        size_t whole = size - size % batch.size();
+        DeviceWrite(data, whole / frame_bytes);
+        data += whole;
+        size -= whole;
+        continue;
+      }
+      size_t count = (std::min)(size, batch.size() - batch_fill);
+      memcpy(&batch[batch_fill], data, count);
+      batch_fill += count;
+      data += count;
+      size -= count;
+      if (batch_fill == batch.size()) {
+        DeviceWrite(batch.data(), period_frames);
+        batch_fill = 0;
+      }
+    }
+  }
+
+  void FlushBatch() {
+    if (batch_fill >= frame_bytes)
+      DeviceWrite(batch.data(), batch_fill / frame_bytes);
+    batch_fill = 0;
+  }
+
+  void DeviceWrite(const void* buffer, snd_pcm_uframes_t _frames) {
+    if (xrun_report_requested) {
+      xrun_report_requested = 0;
+      PrintStats();
+    }
+    if (mmap_access) {
+      const char* data = reinterpret_cast<const char*>(buffer);
+      while (_frames > 0) {
+        char* region;
+        snd_pcm_uframes_t count = MmapBegin(&region, _frames);
+        memcpy(region, data, count * frame_bytes);
+        MmapCommit(count);
+        data += count * frame_bytes;
+        _frames -= count;
+      }
+      return;
+    }
+    const char* data = reinterpret_cast<const char*>(buffer);
+    while (_frames > 0) {
+      snd_pcm_sframes_t result = snd_pcm_writei(pcm_handle, data, _frames);
+      if (result == -EAGAIN) {
+        snd_pcm_wait(pcm_handle, 1000);
+        continue;
+      }
+      if (result < 0) {
+        Recover(static_cast<int>(result));
+        continue;
+      }
+      MarkFirstSample();
+      // A signal or a stop can cut a write short; carry on from there.
+      if (static_cast<snd_pcm_uframes_t>(result) < _frames)
+        short_writes++;
+      data += result * frame_bytes;
+      _frames -= result;
+    }
+  }
+
+  void StartOutputThread() {
+    const LooperOptions& options = GetOptions();
+    if (options.ring_ms <= 0)
+      return;
+    size_t capacity = frame_bytes * sample_rate / 1000 * options.ring_ms;
+    // Under a tight --memory-budget the ring may shrink to two periods.
+    ring.Reset(capacity,
+               (std::max<snd_pcm_uframes_t>)(period_frames, 1) * frame_bytes *
+                   2);
+    // Watermarks are kept on frame boundaries so the output thread never
+    // hands the device a partial frame.
+    high_watermark = ring.Capacity() / 100 * options.high_watermark;
+    high_watermark -= high_watermark % frame_bytes;
+    low_watermark = ring.Capacity() / 100 * options.low_watermark;
+    low_watermark -= low_watermark % frame_bytes;
+    throttled = false;
+    end_of_stream = false;
+    flush_requested = false;
+    output_thread = std::thread(&SimplePlayer::OutputLoop, this);
+  }
+
+  // Whole periods the device takes right now, but at least one, so a write
+  // never holds the output thread for much longer than a period and pause
+  // and flush requests are picked up between writes.
+  size_t DeviceRoom() {
+    snd_pcm_uframes_t period = (std::max<snd_pcm_uframes_t>)(period_frames, 1);
+    snd_pcm_sframes_t avail = snd_pcm_avail_update(pcm_handle);
+    snd_pcm_uframes_t room =
+        (avail > 0) ? static_cast<snd_pcm_uframes_t>(avail) : 0;
+    return (std::max)(room - room % period, period) * frame_bytes;
+  }
+
+  void StopOutputThread() {
+    if (!output_thread.joinable())
+      return;
+    end_of_stream = true;
+    Signal();
+    output_thread.join();
+  }
+
+  // Hands the device whole periods only. A period can never exceed the high
+  // watermark, otherwise a throttled decoder and this loop would wait on
+  // each other.
+  void OutputLoop() {
+    size_t period_bytes = (std::min)(batch.size(), high_watermark);
+    period_bytes = (std::max)(period_bytes - period_bytes % frame_bytes,
+                              frame_bytes);
+    // The very first start only waits for one period, so playback begins as
+    // soon as there is something to play; later starts refill the ring.
+    size_t prefill = started ? high_watermark : period_bytes;
+    bool prefilled = false, device_paused = false;
+    for (;;) {
+      bool finishing = end_of_stream;
+      if (flush_requested) {
+        ring.Consume(ring.Fill());
+        WakeDecoder();
+        DropDevice();
+        device_paused = false;
+        // Whatever comes next should be heard within a period.
+        prefilled = false;
+        prefill = period_bytes;
+        flush_requested = false;
+        Signal();
+      }
+      if (pause_requested != device_paused) {
+        device_paused = pause_requested;
+        PauseDevice(device_paused);
+      }
+      if (device_paused && !finishing) {
+        WaitForRing(SIZE_MAX, device_paused);
+        continue;
+      }
+      size_t fill = ring.Fill();
+      if (!prefilled && fill < prefill && !finishing) {
+        WaitForRing(prefill, device_paused);
+        continue;
+      }
+      prefilled = started = true;
+      if (fill < period_bytes && !finishing) {
+        WaitForRing(period_bytes, device_paused);
+        continue;
+      }
+      size_t wanted = (std::min)(fill, period_bytes);
+      wanted -= wanted % frame_bytes;
+      if (wanted == 0)
+        break;
+      const char* region;
+      size_t size = ring.Peek(&region);
+      if (size >= wanted) {
+        size = (fill < period_bytes)
+                   ? wanted
+                   : (std::min)(size - size % period_bytes, DeviceRoom());
+        DeviceWrite(region, size / frame_bytes);
+        ring.Consume(size);
+        WakeDecoder();
+        continue;
+      }
+      // The period straddles the end of the ring; gather it in one piece so
+      // the device still sees a single write.
+      memcpy(batch.data(), region, size);
+      ring.Consume(size);
+      ring.Peek(&region);
+      memcpy(batch.data() + size, region, wanted - size);
+      ring.Consume(wanted - size);
+      WakeDecoder();
+      DeviceWrite(batch.data(), wanted / frame_bytes);
+    }
+  }
+
+  PcmRingBuffer ring;
+  std::thread output_thread;
+  std::atomic<bool> end_of_stream{false};
+  // Requests from the playback thread, carried out by the output thread.
+  std::atomic<bool> pause_requested{false}, flush_requested{false};
+  size_t high_watermark = 0, low_watermark = 0;
+  bool throttled = false;
+  std::mutex ring_mutex;
+  std::condition_variable ring_changed;
+  // What each side is asleep for: the bytes the output thread needs,
+  // SIZE_MAX while it is busy, and whether the decoder is throttled.
+  std::atomic<size_t> output_wants{SIZE_MAX};
+  std::atomic<bool> decoder_waiting{false};
+  // Set once output first got going; only that start skips the prefill.
+  bool started = false;
+  bool mmap_access = false, can_pause = false;
+  snd_pcm_uframes_t mmap_offset = 0, period_frames = 0, buffer_frames = 0;
+  size_t frame_bytes = 1;
+  // One period of staging, shared by BatchWrite and the output thread
+  // (never both at once).
+  std::vector<char> batch;
+  size_t batch_fill = 0;
+  AudioFormat stream_format;
+  unsigned int device_channels = 0;
+  ChannelMixer mixer;
+  Resampler resampler;
+  // Xrun telemetry, only touched by whichever thread writes to the device.
+  enum { max_xrun_events = 256 };
+  std::chrono::steady_clock::time_point opened_at;
+  std::vector<XrunEvent> xruns;
+  unsigned long underruns = 0, suspends = 0, short_writes = 0;
+};
+#endif
+
+#ifdef _WIN32
+static void CALLBACK waveOutProc(HWAVEOUT hWaveOut,
+                                 UINT uMsg,
+                                 DWORD dwInstance,
+                                 DWORD dwParam1,
+                                 DWORD dwParam2) {
+  (void)hWaveOut;
+  (void)dwParam1;
+  (void)dwParam2;
+
+  SimplePlayer* player = reinterpret_cast<SimplePlayer*>(dwInstance);
+  if (uMsg != WOM_DONE)
+    return;
+  player->IncrementBlock();
+}
+#endif
+
+// Discards everything as fast as it arrives, so decoders run unpaced.
+class NullSink : public AudioSink {
+ public:
+  void SetFormat(const AudioFormat& format) override { (void)format; }
+  void Open() override { is_open = true; }
+  void WriteAudio(const char* data, size_t size) override {
+    (void)data;
+    MarkFirstSample();
+    bytes_written += size;
+  }
+  void Close() override { is_open = false; }
+
+  uint64_t bytes_written = 0;
+};
+
+// Writes the PCM stream to a file, either raw or behind a WaveHeader. The
+// file is created on the first Open and finished on the last Close. Errors
+// end the process, unless the sink is not |fatal|; then it stops writing
+// and Failed() tells.
+class FileSink : public AudioSink {
+ public:
+  FileSink(const std::string& path, bool wave, bool fatal = true)
+      : path(path), wave(wave), fatal(fatal) {}
+  ~FileSink() { Finish(); }
+
+  // Files are written in WAVE channel order whatever the decoder produced.
+  void SetFormat(const AudioFormat& format) override {
+    this->format = format;
+    mixer.Configure(format, WaveChannelLayout(format.channels));
+  }
+
+  void Open() override {
+    if (file == nullptr && !failed) {
+#ifdef _WIN32
+      file = _wfopen(to_wstring(path.c_str()).c_str(), L"wb");
+#else
+      file = fopen(path.c_str(), "wb");
+#endif
+      if (file == nullptr) {
+        Fail(string_format("Can't create output file %s", path.c_str()));
+        return;
+      }
+      // Few, large writes; several exports write side by side.
+      setvbuf(file, nullptr, _IOFBF, write_buffer_size);
+      if (wave && !WriteWaveHeader(file, format, 0)) {
+        Fail("Can't write to output file");
+        return;
+      }
+      header_format = format;
+    } else if (!SameFormat(format, header_format)) {
+      TRACE_WARNING("format changed mid-output; samples keep the new format");
+    }
+    is_open = true;
+  }
+
+  void WriteAudio(const char* data, size_t size) override {
+    if (file == nullptr)
+      return;
+    if (mixer.Active())
+      data = mixer.Process(data, &size);
+    if (fwrite(data, 1, size, file) != size) {
+      Fail("Can't write to output file");
+      return;
+    }
+    MarkFirstSample();
+    data_size += size;
+  }
+
+  // A format change only rewrites our notion of the format; the file itself
+  // stays open so one run produces one output.
+  void Close() override { is_open = false; }
+
+  void Finish() {
+    if (file == nullptr)
+      return;
+    if (wave &&
+        (fseek(file, 0, SEEK_SET) != 0 ||
+         !WriteWaveHeader(file, header_format, data_size))) {
+      Fail("Can't write to output file");
+      return;
+    }
+    if (fclose(file) != 0) {
+      file = nullptr;
+      Fail("Can't write to output file");
+      return;
+    }
+    file = nullptr;
+  }
+
+  bool Failed() const { return failed; }
+  uint64_t BytesWritten() const { return data_size; }
+
+ private:
+  enum { write_buffer_size = 0x100000 };
+
+  void Fail(const std::string& message) {
+    TRACE_ERROR(message.c_str());
+    if (fatal)
+      AudioExitProcess(AudioStatus::kIoError);
+    failed = true;
+    if (file != nullptr)
+      fclose(file);
+    file = nullptr;
+  }
+
+  std::string path;
+  bool wave, fatal, failed = false;
+  FILE* file = nullptr;
+  AudioFormat format, header_format;
+  ChannelMixer mixer;
+  uint64_t data_size = 0;
+};
+
+typedef struct _Metadata {
+  std::string artist;
+  std::string title;
+  std::string year;
+  std::string genre;
+  std::string comment;
+  std::string album;
+  // ReplayGain in dB and as linear peaks; NAN when the file has no tags.
+  float track_gain = NAN, album_gain = NAN;
+  float track_peak = NAN, album_peak = NAN;
+} Metadata;
+
+std::string to_string(const Metadata& meta) {
+  return "Title: " + meta.title + "\nArtist: " + meta.artist +
+         "\nAlbum: " + meta.album + "\nYear: " + meta.year +
+         "\nComment: " + meta.comment + "\nGenre: " + meta.genre + "\n";
+}
+
+// |duration| is in seconds, or NAN when the headers did not give it.
+void PrintPlayingInfo(const Metadata& meta, double duration) {
+  print_color("Playing Info\n", Color::light_yellow);
+  print_color(to_string(meta));
+  if (duration >= 0.0) {
+    int seconds = static_cast<int>(duration + 0.5);
+    print_color(string_format("Length: %d:%02d\n", seconds / 60, seconds % 60));
+  }
+  print_color("Starting to play\n", Color::light_yellow);
+}
+
+// Standard input ("-"), a FIFO or a named pipe: anything that can only be
+// read front to back, so it is decoded as it arrives instead of opened by
+// path.
+bool IsStreamInput(const std::string& path) {
+  if (path == "-")
+    return true;
+#ifdef _WIN32
+  return path.compare(0, 9, "\\\\.\\pipe\\") == 0;
+#elif __linux__
+  struct stat st;
+  return stat(path.c_str(), &st) == 0 &&
+         (S_ISFIFO(st.st_mode) || S_ISCHR(st.st_mode) || S_ISSOCK(st.st_mode));
+#endif
+}
+
+// A pipe or file read ahead by a thread of its own into a bounded buffer,
+// so a producer that writes in bursts, or storage that stalls now and then,
+// does not starve the decoder, and a decoder busy with a large frame does
+// not stall the producer. Pipes are read as they arrive. Regular files are
+// read in large sequential chunks at explicit offsets, which also lets them
+// seek; the kernel is told to fetch the next chunk while the current one is
+// decoded.
+class InputStream {
+ public:
+  ~InputStream() { Close(); }
+
+  // "-" is standard input. |capacity| bounds the read-ahead in bytes.
+  bool Open(const std::string& path, size_t capacity = read_ahead_size) {
+    this->path = path;
+    int fd;
+    if (path == "-") {
+#ifdef _WIN32
+      fd = _fileno(stdin);
+      _setmode(fd, _O_BINARY);
+#elif __linux__
+      fd = STDIN_FILENO;
+#endif
+    } else {
+#ifdef _WIN32
+      fd = _wopen(to_wstring(path.c_str()).c_str(),
+                  _O_RDONLY | _O_BINARY | _O_SEQUENTIAL);
+#elif __linux__
+      fd = open(path.c_str(), O_RDONLY);
+#endif
+      if (fd < 0)
+        return false;
+    }
+    shared = std::make_shared<Shared>();
+    shared->fd = fd;
+    shared->owns_fd = path != "-";
+#ifdef _WIN32
+    struct _stat64 st;
+    if (_fstat64(fd, &st) == 0 && (st.st_mode & _S_IFREG)) {
+#elif __linux__
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+      posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+      shared->seekable = true;
+      shared->size = static_cast<uint64_t>(st.st_size);
+    }
+    shared->ring.Reset(capacity, min_read_ahead_size);
+    // The thread owns a reference of its own: a read blocked on a silent
+    // producer cannot be interrupted, so Close leaves it to finish alone.
+    std::thread(shared->seekable ? FillFile : Fill, shared).detach();
+    return true;
+  }
+
+  // Waits for |size| bytes; returns fewer only at the end of the stream.
+  size_t Read(void* buffer, size_t size) {
+    char* out = reinterpret_cast<char*>(buffer);
+    size_t count = 0;
+    while (count < size && shared) {
+      const char* region;
+      size_t available = shared->ring.Peek(&region);
+      if (available > 0) {
+        available = (std::min)(available, size - count);
+        memcpy(out + count, region, available);
+        shared->ring.Consume(available);
+        Notify(*shared);
+        count += available;
+      } else if (shared->eof.load(std::memory_order_acquire)) {
+        if (shared->ring.Fill() == 0)
+          break;
+      } else {
+        Shared* state = shared.get();
+        WaitUntil(*state, [state]() {
+          return state->ring.Fill() > 0 ||
+                 state->eof.load(std::memory_order_acquire);
+        });
+      }
+    }
+    position += count;
+    return count;
+  }
+
+  // Copies the first |size| bytes without consuming them, for telling the
+  // format from its magic. Only meaningful before the first Read.
+  size_t Peek(char* buffer, size_t size) {
+    if (!shared)
+      return 0;
+    Shared* state = shared.get();
+    WaitUntil(*state, [state, size]() {
+      return state->ring.Fill() >= size ||
+             state->eof.load(std::memory_order_acquire);
+    });
+    const char* region;
+    size_t count = (std::min)(shared->ring.Peek(&region), size);
+    memcpy(buffer, region, count);
+    return count;
+  }
+
+  // Moves the read position like fseek, for files only. A short hop forward
+  // skips over what is already buffered; anything else drops the buffer and
+  // the I/O thread starts over from the new position.
+  bool Seek(int64_t offset, int whence) {
+    if (!Seekable())
+      return false;
+    int64_t base = (whence == SEEK_CUR)   ? static_cast<int64_t>(position)
+                   : (whence == SEEK_END) ? static_cast<int64_t>(shared->size)
+                                          : 0;
+    if (base + offset < 0)
+      return false;
+    uint64_t target = static_cast<uint64_t>(base + offset);
+    if (target >= position && target - position <= shared->ring.Fill()) {
+      shared->ring.Consume(static_cast<size_t>(target - position));
+      Notify(*shared);
+    } else {
+      Refill(target, shared->ring.Capacity());
+    }
+    position = target;
+    return true;
+  }
+
+  // Resizes the read-ahead of a file once its decoder knows the bitrate.
+  void SetReadAhead(size_t capacity) {
+    if (Seekable() && capacity != shared->ring.Capacity())
+      Refill(position, capacity);
+  }
+
+  bool Seekable() const { return shared && shared->seekable; }
+  // Length in bytes of a file; 0 for pipes.
+  uint64_t Size() const { return shared ? shared->size : 0; }
+  uint64_t Tell() const { return position; }
+  const std::string& Path() const { return path; }
+
+  void Close() {
+    if (shared) {
+      shared->stop.store(true, std::memory_order_release);
+      Notify(*shared);
+    }
+    shared.reset();
+  }
+
+ private:
+  typedef struct _Shared {
+    PcmRingBuffer ring;
+    std::atomic<bool> eof{false};
+    std::atomic<bool> stop{false};
+    int fd = -1;
+    bool owns_fd = false;
+    bool seekable = false;
+    uint64_t size = 0;
+    // A seek or resize for the I/O thread, which alone may reset the ring.
+    // The reader waits until it has been carried out.
+    std::atomic<bool> request{false};
+    uint64_t request_offset = 0;
+    size_t request_capacity = 0;
+    // Either side sleeps here until the other has moved the ring or the
+    // flags on.
+    std::mutex mutex;
+    std::condition_variable changed;
+  } Shared;
+
+  // Wakes the other side after a change to the ring or the flags. Passing
+  // through the mutex orders the change before a waiter's next look at it.
+  static void Notify(Shared& shared) {
+    { std::lock_guard<std::mutex> lock(shared.mutex); }
+    shared.changed.notify_all();
+  }
+
+  template <typename Predicate>
+  static void WaitUntil(Shared& shared, Predicate ready) {
+    std::unique_lock<std::mutex> lock(shared.mutex);
+    shared.changed.wait(lock, ready);
+  }
+
+  void Refill(uint64_t offset, size_t capacity) {
+    shared->request_offset = offset;
+    shared->request_capacity = capacity;
+    shared->request.store(true, std::memory_order_release);
+    Notify(*shared);
+    Shared* state = shared.get();
+    WaitUntil(*state, [state]() {
+      return !state->request.load(std::memory_order_acquire);
+    });
+  }
+
+  static void Fill(std::shared_ptr<Shared> shared) {
+    std::vector<char> chunk(chunk_size);
+    while (!shared->stop.load(std::memory_order_acquire)) {
+#ifdef _WIN32
+      int count = _read(shared->fd, chunk.data(),
+                        static_cast<unsigned int>(chunk.size()));
+#elif __linux__
+      // Poll so a stop request is noticed while the producer is idle.
+      struct pollfd descriptor = {shared->fd, POLLIN, 0};
+      if (poll(&descriptor, 1, 100) == 0)
+        continue;
+      ssize_t count = read(shared->fd, chunk.data(), chunk.size());
+      if (count < 0 && errno == EINTR)
+        continue;
+#endif
+      if (count <= 0)
+        break;
+      size_t written = 0;
+      while (written < static_cast<size_t>(count) &&
+             !shared->stop.load(std::memory_order_acquire)) {
+        size_t accepted = shared->ring.Write(chunk.data() + written,
+                                             count - written);
+        written += accepted;
+        if (accepted > 0) {
+          Notify(*shared);
+          continue;
+        }
+        WaitUntil(*shared, [&shared]() {
+          return shared->ring.Space() > 0 ||
+                 shared->stop.load(std::memory_order_acquire);
+        });
+      }
+    }
+    shared->eof.store(true, std::memory_order_release);
+    Notify(*shared);
+    CloseDescriptor(*shared);
+  }
+
+  // Reads straight into the ring, a chunk at a time once a chunk's worth is
+  // free. The thread outlives the end of the file so it can serve seeks,
+  // sleeping until one comes.
+  static void FillFile(std::shared_ptr<Shared> shared) {
+#ifdef LOOPER_IO_URING
+    struct io_uring uring;
+    bool have_uring = io_uring_queue_init(queue_depth, &uring, 0) == 0;
+#endif
+    uint64_t offset = 0;
+    // An empty file ends before the first read.
+    shared->eof.store(offset >= shared->size, std::memory_order_release);
+    Notify(*shared);
+    while (!shared->stop.load(std::memory_order_acquire)) {
+      if (shared->request.load(std::memory_order_acquire)) {
+        shared->ring.Reset(shared->request_capacity, min_read_ahead_size);
+        offset = shared->request_offset;
+        shared->eof.store(offset >= shared->size, std::memory_order_release);
+        shared->request.store(false, std::memory_order_release);
+        Notify(*shared);
+        continue;
+      }
+      uint64_t left = (offset < shared->size) ? shared->size - offset : 0;
+      size_t wanted = static_cast<size_t>(
+          std::min<uint64_t>((std::min)(size_t(chunk_size),
+                                        shared->ring.Capacity() / 2),
+                             left));
+      if (wanted == 0 || shared->ring.Space() < wanted) {
+        WaitUntil(*shared, [&shared, wanted]() {
+          return shared->request.load(std::memory_order_acquire) ||
+                 shared->stop.load(std::memory_order_acquire) ||
+                 (wanted > 0 && shared->ring.Space() >= wanted);
+        });
+        continue;
+      }
+      char* region;
+      size_t length = static_cast<size_t>(std::min<uint64_t>(
+          (std::min)(shared->ring.Reserve(&region),
+                     size_t(chunk_size) * queue_depth),
+          left));
+      size_t count;
+#ifdef LOOPER_IO_URING
+      if (have_uring) {
+        count = ReadUring(&uring, shared->fd, region, length, offset);
+      } else {
+        count = ReadAt(shared->fd, region, length, offset);
+      }
+#else
+      count = ReadAt(shared->fd, region, length, offset);
+#endif
+#ifdef __linux__
+      // Have the kernel fetch the next stretch while this one is decoded.
+      posix_fadvise(shared->fd, static_cast<off_t>(offset + count),
+                    static_cast<off_t>(shared->ring.Capacity()),
+                    POSIX_FADV_WILLNEED);
+#endif
+      shared->ring.Publish(count);
+      offset += count;
+      // A read error ends the stream where it happened, like a short file.
+      if (count < length || offset >= shared->size)
+        shared->eof.store(true, std::memory_order_release);
+      if (count < length)
+        offset = shared->size;
+      Notify(*shared);
+    }
+#ifdef LOOPER_IO_URING
+    if (have_uring)
+      io_uring_queue_exit(&uring);
+#endif
+    CloseDescriptor(*shared);
+  }
+
+  static size_t ReadAt(int fd, char* buffer, size_t length, uint64_t offset) {
+    size_t count = 0;
+    while (count < length) {
+#ifdef _WIN32
+      if (_lseeki64(fd, static_cast<__int64>(offset + count), SEEK_SET) < 0)
+        break;
+      int result = _read(fd, buffer + count,
+                         static_cast<unsigned int>(length - count));
+#elif __linux__
+      ssize_t result = pread(fd, buffer + count, length - count,
+                             static_cast<off_t>(offset + count));
+      if (result < 0 && errno == EINTR)
+        continue;
+#endif
+      if (result <= 0)
+        break;
+      count += static_cast<size_t>(result);
+    }
+    return count;
+  }
+
+#ifdef LOOPER_IO_URING
+  // Splits |length| into chunks that are all in flight at once, so storage
+  // with a long round trip serves them in parallel. Returns how much was
+  // read without a gap from |offset| on.
+  static size_t ReadUring(struct io_uring* uring,
+                          int fd,
+                          char* buffer,
+                          size_t length,
+                          uint64_t offset) {
+    size_t sizes[queue_depth];
+    int results[queue_depth];
+    unsigned count = 0;
+    for (size_t done = 0; done < length && count < queue_depth;
+         done += chunk_size) {
+      struct io_uring_sqe* sqe = io_uring_get_sqe(uring);
+      if (sqe == nullptr)
+        break;
+      sizes[count] = (std::min)(size_t(chunk_size), length - done);
+      io_uring_prep_read(sqe, fd, buffer + done,
+                         static_cast<unsigned>(sizes[count]), offset + done);
+      io_uring_sqe_set_data(sqe, reinterpret_cast<void*>(uintptr_t(count)));
+      count++;
+    }
+    if (count == 0 || io_uring_submit(uring) < 0)
+      return ReadAt(fd, buffer, length, offset);
+    for (unsigned i = 0; i < count;) {
+      struct io_uring_cqe* cqe;
+      int result = io_uring_wait_cqe(uring, &cqe);
+      if (result == -EINTR)
+        continue;
+      if (result < 0)
+        return 0;
+      results[reinterpret_cast<uintptr_t>(io_uring_cqe_get_data(cqe))] =
+          cqe->res;
+      io_uring_cqe_seen(uring, cqe);
+      i++;
+    }
+    size_t total = 0;
+    for (unsigned i = 0; i < count; i++) {
+      if (results[i] <= 0)
+        break;
+      total += static_cast<size_t>(results[i]);
+      if (static_cast<size_t>(results[i]) < sizes[i]) {
+        // A short read leaves a gap; the rest is fetched plainly.
+        return total + ReadAt(fd, buffer + total, length - total,
+                              offset + total);
+      }
+    }
+    return total;
+  }
+#endif
+
+  static void CloseDescriptor(const Shared& shared) {
+    if (!shared.owns_fd)
+      return;
+#ifdef _WIN32
+    _close(shared.fd);
+#elif __linux__
+    close(shared.fd);
+#endif
+  }
+
+  // The default read-ahead, and what a file starts with until SetReadAhead;
+  // the memory budget can shrink it to the minimum. Files are read
+  // chunk_size at a time, up to queue_depth chunks at once.
+  enum {
+    read_ahead_size = 0x100000,
+    min_read_ahead_size = 0x10000,
+    chunk_size = 0x40000,
+    queue_depth = 4
+  };
+
+  std::string path;
+  std::shared_ptr<Shared> shared;
+  uint64_t position = 0;
+};
+
+// Damage a decoder ran into, for --verify and --check.
+typedef struct _StreamError {
+  int64_t offset;
+  std::string what;
+} StreamError;
+
+std::string StreamError_To_String(const StreamError& error) {
+  if (error.offset < 0)
+    return error.what;
+  return string_format("at byte %lld: %s",
+                       static_cast<long long>(error.offset),
+                       error.what.c_str());
+}
+
+// Pull interface implemented by every format. Decoders only produce PCM and
+// the playlist loop owns the device, so the next track can be opened and
+// primed while the current one is still playing.
+class AudioDecoder {
+ public:
+  enum { default_buffer_size = 0x1000 };
+
+  virtual ~AudioDecoder() {}
+
+  // Opens |path| and parses its headers so Format() and Tags() are valid.
+  virtual bool Open(const std::string& path) = 0;
+
+  // Like Open, for input that can only be read once from front to back. The
+  // decoder reads |stream| until Close; it cannot Seek.
+  virtual bool OpenStream(std::shared_ptr<InputStream> stream) {
+    (void)stream;
+    return false;
+  }
+
+  // Fills |buffer| with up to |size| bytes of interleaved PCM, always whole
+  // frames. Returns 0 once the stream is exhausted.
+  virtual size_t Read(char* buffer, size_t size) = 0;
+
+  // Like Read, but decoders that already hold PCM in memory may point |data|
+  // straight at it instead of copying into |buffer|. |data| stays valid until
+  // the next call.
+  virtual size_t ReadSpan(char* buffer, size_t size, const char** data) {
+    *data = buffer;
+    return Read(buffer, size);
+  }
+
+  // Moves to |frame|, counted at Format().sample_rate from the start of the
+  // stream, so the next Read begins exactly there. Returns false when the
+  // stream cannot seek or |frame| lies past its end.
+  virtual bool Seek(uint64_t frame) {
+    (void)frame;
+    return false;
+  }
+
+  virtual void Close() = 0;
+
+  // Once Read has returned 0, checks what only the whole stream can tell,
+  // such as FLAC's MD5 signature, and adds any problem to Errors().
+  virtual void Verify() {}
+
+  // Problems met while decoding, the first max_errors of ErrorCount().
+  const std::vector<StreamError>& Errors() const { return errors; }
+  size_t ErrorCount() const { return error_count; }
+
+  const AudioFormat& Format() const { return format; }
+  // What Read gives without --float. The metadata index records this, so an
+  // entry does not depend on which pipeline happened to fill it.
+  const AudioFormat& NativeFormat() const {
+    return native_format.channels > 0 ? native_format : format;
+  }
+  const Metadata& Tags() const { return metadata; }
+  size_t BufferSize() const { return buffer_size; }
+  // Length in seconds as stated by the headers Open() read anyway, or NAN.
+  // Never worth decoding or scanning the file for.
+  double Duration() const { return duration; }
+  // Byte offset of the first audio frame in the file, where a seek can
+  // start looking; 0 when the format has no such notion.
+  uint64_t AudioOffset() const { return audio_offset; }
+
+ protected:
+  enum { max_errors = 16 };
+
+  // |offset| is where in the file the problem lies, or -1 when the decoder
+  // cannot tell or it concerns the stream as a whole.
+  void ReportError(int64_t offset, const std::string& what) {
+    if (errors.size() < max_errors)
+      errors.push_back({offset, what});
+    error_count++;
+  }
+
+  // Makes |native| Format(), widened to float32 under --float, for decoders
+  // that can hand out floats themselves.
+  void SetFormat(const AudioFormat& native) {
+    format = native_format = native;
+    if (GetOptions().float_pipeline) {
+      format.bits_per_sample = 32;
+      format.is_float = true;
+    }
+  }
+
+  AudioFormat format;
+  // Left empty by decoders whose Format() never follows --float.
+  AudioFormat native_format;
+  Metadata metadata;
+  size_t buffer_size = default_buffer_size;
+  double duration = NAN;
+  uint64_t audio_offset = 0;
+  std::vector<StreamError> errors;
+  size_t error_count = 0;
+};
+
+uint16_t ReadLE16(const char* data) {
+  const unsigned char* p = reinterpret_cast<const unsigned char*>(data);
+  return static_cast<uint16_t>(p[0] | (p[1] << 8));
+}
+
+uint32_t ReadLE32(const char* data) {
+  return ReadLE16(data) | (static_cast<uint32_t>(ReadLE16(data + 2)) << 16);
+}
+
+uint64_t ReadLE64(const char* data) {
+  return ReadLE32(data) | (static_cast<uint64_t>(ReadLE32(data + 4)) << 32);
+}
+
+uint32_t ReadBE32(const char* data) {
+  const unsigned char* p = reinterpret_cast<const unsigned char*>(data);
+  return (static_cast<uint32_t>(p[0]) << 24) | (p[1] << 16) | (p[2] << 8) |
+         p[3];
+}
+
+// Read-only memory mapping of a file. 64-bit builds map the whole file once;
+// 32-bit builds slide a window over it so multi-gigabyte files still fit in
+// the address space.
+class MappedFile {
+ public:
+  ~MappedFile() { Close(); }
+
+  bool Open(const std::string& path) {
+#ifdef _WIN32
+    file = CreateFileW(to_wstring(path.c_str()).c_str(), GENERIC_READ,
+                       FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+                       FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+    if (file == INVALID_HANDLE_VALUE)
+      return false;
+    LARGE_INTEGER length;
+    if (!GetFileSizeEx(file, &length) || length.QuadPart == 0) {
+      Close();
+      return false;
+    }
+    size = static_cast<uint64_t>(length.QuadPart);
+    mapping = CreateFileMappingW(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    if (mapping == nullptr) {
+      Close();
+      return false;
+    }
+#elif __linux__
+    fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+      return false;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+      Close();
+      return false;
+    }
+    size = static_cast<uint64_t>(st.st_size);
+#endif
+    return true;
+  }
+
+  // Returns a pointer to |offset| that stays valid for *length bytes until
+  // the next call. *length is clipped to the end of the file.
+  const char* View(uint64_t offset, size_t* length) {
+    if (offset >= size) {
+      *length = 0;
+      return nullptr;
+    }
+    *length = static_cast<size_t>(std::min<uint64_t>(*length, size - offset));
+    if (view == nullptr || offset < view_offset ||
+        offset + *length > view_offset + view_size) {
+      Unmap();
+      uint64_t start = offset - offset % granularity;
+      uint64_t window = (sizeof(void*) >= 8) ? size : 0x4000000;
+      uint64_t span = (std::max)(window, offset - start + *length);
+      view_size = static_cast<size_t>((std::min)(span, size - start));
+      view_offset = start;
+#ifdef _WIN32
+      view = reinterpret_cast<const char*>(
+          MapViewOfFile(mapping, FILE_MAP_READ, static_cast<DWORD>(start >> 32),
+                        static_cast<DWORD>(start), view_size));
+#elif __linux__
+      void* address = mmap(nullptr, view_size, PROT_READ, MAP_PRIVATE, fd,
+                           static_cast<off_t>(start));
+      if (address == MAP_FAILED) {
+        address = nullptr;
+      } else {
+        madvise(address, view_size, MADV_SEQUENTIAL);
+      }
+      view = reinterpret_cast<const char*>(address);
+#endif
+      if (view == nullptr) {
+        *length = 0;
+        return nullptr;
+      }
+    }
+    return view + (offset - view_offset);
+  }
+
+  uint64_t Size() const { return size; }
+
+  void Close() {
+    Unmap();
+#ifdef _WIN32
+    if (mapping != nullptr)
+      CloseHandle(mapping);
+    if (file != INVALID_HANDLE_VALUE)
+      CloseHandle(file);
+    mapping = nullptr;
+    file = INVALID_HANDLE_VALUE;
+#elif __linux__
+    if (fd >= 0)
+      close(fd);
+    fd = -1;
+#endif
+    size = 0;
+  }
+
+ private:
+  void Unmap() {
+    if (view == nullptr)
+      return;
+#ifdef _WIN32
+    UnmapViewOfFile(view);
+#elif __linux__
+    munmap(const_cast<char*>(view), view_size);
+#endif
+    view = nullptr;
+  }
+
+  // Windows allocation granularity, and a multiple of every Linux page size.
+  enum { granularity = 0x10000 };
+
+#ifdef _WIN32
+  HANDLE file = INVALID_HANDLE_VALUE, mapping = nullptr;
+#elif __linux__
+  int fd = -1;
+#endif
+  uint64_t size = 0, view_offset = 0;
+  const char* view = nullptr;
+  size_t view_size = 0;
+};
+
+// Parses a "fmt " chunk: plain PCM, IEEE float or WAVE_FORMAT_EXTENSIBLE
+// wrapping either of them.
+bool Format_From_WaveFormatChunk(const char* chunk,
+                                 uint32_t size,
+                                 AudioFormat* fmt) {
+  if (size < 16)
+    return false;
+  uint16_t tag = ReadLE16(chunk);
+  fmt->channels = ReadLE16(chunk + 2);
+  fmt->sample_rate = static_cast<int>(ReadLE32(chunk + 4));
+  fmt->bits_per_sample = ReadLE16(chunk + 14);
+  if (tag == 0xFFFE && size >= 40) {
+    // The first two bytes of the SubFormat GUID carry the real format tag.
+    tag = ReadLE16(chunk + 24);
+    fmt->layout = LayoutFromWaveMask(ReadLE32(chunk + 20), fmt->channels);
+  }
+  fmt->big_endian = false;
+  fmt->is_float = (tag == 3);
+  if (tag == 1) {
+    return fmt->bits_per_sample == 8 || fmt->bits_per_sample == 16 ||
+           fmt->bits_per_sample == 24 || fmt->bits_per_sample == 32;
+  }
+  if (tag == 3)
+    return fmt->bits_per_sample == 32 || fmt->bits_per_sample == 64;
+  return false;
+}
+
+void MetaAppendInfoField(Metadata* meta, const char* id, std::string value) {
+  value.erase(std::find(value.begin(), value.end(), '\0'), value.end());
+  if (memcmp(id, "INAM", 4) == 0) {
+    meta->title = value;
+  } else if (memcmp(id, "IART", 4) == 0) {
+    meta->artist = value;
+  } else if (memcmp(id, "IPRD", 4) == 0) {
+    meta->album = value;
+  } else if (memcmp(id, "ICRD", 4) == 0) {
+    meta->year = value;
+  } else if (memcmp(id, "IGNR", 4) == 0) {
+    meta->genre = value;
+  } else if (memcmp(id, "ICMT", 4) == 0) {
+    meta->comment = value;
+  }
+}
+
+// Plays RIFF/WAVE, RF64 and BW64 files straight out of a memory mapping,
+// or from a stream as it arrives. The chunk list is walked properly, so fmt,
+// LIST and data may come in any order with any amount of padding in between.
+class WavPlayer : public AudioDecoder {
+ public:
+  bool Open(const std::string& path) override {
+    if (!file.Open(path)) {
+      TRACE_ERROR("Failed to open file");
+      return false;
+    }
+    std::string message = string_format("Opened %s", path.c_str());
+    TRACE_INFO(message.c_str());
+
+    if (!ParseChunks()) {
+      TRACE_ERROR("Not a playable RIFF/RF64 WAVE file");
+      return false;
+    }
+
+    block_align =
+        static_cast<size_t>(format.channels) * (format.bits_per_sample / 8);
+    if (block_align == 0) {
+      TRACE_ERROR("Invalid block alignment");
+      return false;
+    }
+    data_end = data_offset +
+               (std::min)(data_size, file.Size() - data_offset) / block_align *
+                   block_align;
+    position = data_offset;
+    buffer_size = default_span_size - default_span_size % block_align;
+    duration = static_cast<double>(data_end - data_offset) / block_align /
+               format.sample_rate;
+    audio_offset = data_offset;
+
+    if (metadata.title.empty()) {
+      fs::path current_path(path);
+      metadata.title = current_path.stem().string();
+    }
+    return true;
+  }
+
+  bool OpenStream(std::shared_ptr<InputStream> stream) override {
+    this->stream = stream;
+    std::string message = string_format("Opened %s", stream->Path().c_str());
+    TRACE_INFO(message.c_str());
+
+    if (!ParseStreamChunks()) {
+      TRACE_ERROR("Not a playable RIFF/RF64 WAVE stream");
+      return false;
+    }
+
+    block_align =
+        static_cast<size_t>(format.channels) * (format.bits_per_sample / 8);
+    if (block_align == 0) {
+      TRACE_ERROR("Invalid block alignment");
+      return false;
+    }
+    data_offset = stream->Tell();
+    if (stream->Seekable())
+      data_size = (std::min)(data_size, stream->Size() - data_offset);
+    position = data_offset;
+    buffer_size = default_span_size - default_span_size % block_align;
+    if (data_size == UINT64_MAX) {
+      data_end = UINT64_MAX;
+    } else {
+      data_end = data_offset + data_size / block_align * block_align;
+      duration = static_cast<double>(data_size / block_align) /
+                 format.sample_rate;
+    }
+    audio_offset = data_offset;
+
+    if (metadata.title.empty() && stream->Seekable()) {
+      fs::path current_path(stream->Path());
+      metadata.title = current_path.stem().string();
+    }
+    return true;
+  }
+
+  size_t Read(char* buffer, size_t size) override {
+    const char* data;
+    size_t count = ReadSpan(buffer, size, &data);
+    if (data != buffer)
+      memcpy(buffer, data, count);
+    return count;
+  }
+
+  // Samples are handed to the sink straight from the mapping, except on
+  // big-endian hosts where they are swapped into |buffer| first. Streams
+  // are always read into |buffer|.
+  size_t ReadSpan(char* buffer, size_t size, const char** data) override {
+    size_t count = static_cast<size_t>(std::min<uint64_t>(
+        size - size % block_align, data_end - position));
+    *data = buffer;
+    if (count == 0)
+      return 0;
+    if (stream) {
+      count = stream->Read(buffer, count);
+      count -= count % block_align;
+    } else {
+      *data = file.View(position, &count);
+      if (*data == nullptr) {
+        *data = buffer;
+        return 0;
+      }
+    }
+    position += count;
+    int sample_bytes = format.bits_per_sample / 8;
+    if (!IsLittleEndian() && sample_bytes > 1) {
+      if (*data != buffer)
+        memcpy(buffer, *data, count);
+      SwapSampleBytes(buffer, count / sample_bytes, sample_bytes);
+      *data = buffer;
+    }
+    return count;
+  }
+
+  // Uncompressed, so the frame's position is plain arithmetic.
+  bool Seek(uint64_t frame) override {
+    if ((stream && !stream->Seekable()) ||
+        frame > (data_end - data_offset) / block_align)
+      return false;
+    position = data_offset + frame * block_align;
+    return !stream || stream->Seek(static_cast<int64_t>(position), SEEK_SET);
+  }
+
+  // PCM has no checksums; the one thing to catch is a data chunk that
+  // states more than the file or stream turned out to hold.
+  void Verify() override {
+    uint64_t end = stream ? position : file.Size();
+    if (data_size == UINT64_MAX || data_offset + data_size <= end)
+      return;
+    ReportError(static_cast<int64_t>(end),
+                string_format("data chunk cut short, %llu of %llu bytes",
+                              static_cast<unsigned long long>(end - data_offset),
+                              static_cast<unsigned long long>(data_size)));
+  }
+
+  void Close() override {
+    file.Close();
+    stream.reset();
+  }
+
+ private:
+  bool ParseChunks() {
+    size_t length = 12;
+    const char* riff = file.View(0, &length);
+    if (riff == nullptr || length < 12 || memcmp(riff + 8, "WAVE", 4) != 0)
+      return false;
+    bool rf64 = memcmp(riff, "RF64", 4) == 0 || memcmp(riff, "BW64", 4) == 0;
+    if (!rf64 && memcmp(riff, "RIFF", 4) != 0)
+      return false;
+
+    uint64_t ds64_data_size = 0;
+    bool have_format = false;
+    uint64_t offset = 12;
+    while (offset + 8 <= file.Size()) {
+      length = 8;
+      const char* header = file.View(offset, &length);
+      if (header == nullptr || length < 8)
+        return false;
+      char id[4];
+      memcpy(id, header, 4);
+      uint64_t size = ReadLE32(header + 4);
+      uint64_t body = offset + 8;
+
+      if (memcmp(id, "ds64", 4) == 0) {
+        length = 24;
+        const char* ds64 = file.View(body, &length);
+        if (ds64 == nullptr || length < 24)
+          return false;
+        ds64_data_size = ReadLE64(ds64 + 8);
+      } else if (memcmp(id, "fmt ", 4) == 0) {
+        length = static_cast<size_t>(std::min<uint64_t>(size, 64));
+        const char* chunk = file.View(body, &length);
+        if (chunk == nullptr ||
+            !Format_From_WaveFormatChunk(chunk, static_cast<uint32_t>(length),
+                                         &format)) {
+          return false;
+        }
+        have_format = true;
+      } else if (memcmp(id, "LIST", 4) == 0) {
+        length = static_cast<size_t>(std::min<uint64_t>(size, 0x10000));
+        const char* list = file.View(body, &length);
+        if (list != nullptr)
+          ParseInfo(list, length);
+      } else if (memcmp(id, "data", 4) == 0) {
+        // RF64 stores 0xFFFFFFFF here and the real size in ds64. Streams
+        // written without a final size run to the end of the file.
+        if (rf64 && size == 0xFFFFFFFF)
+          size = ds64_data_size;
+        if (size == 0 || size == 0xFFFFFFFF)
+          size = file.Size() - body;
+        data_offset = body;
+        data_size = size;
+        return have_format;
+      }
+      offset = body + size + (size & 1);
+    }
+    return false;
+  }
+
+  // The same walk in a single pass over a stream. Chunks ahead of the data
+  // are small; only their first 64 KiB are kept, the rest is read past, or
+  // seeked over in a file. A data chunk without a final size runs to the
+  // end of the stream.
+  bool ParseStreamChunks() {
+    char riff[12];
+    if (stream->Read(riff, 12) < 12 || memcmp(riff + 8, "WAVE", 4) != 0)
+      return false;
+    bool rf64 = memcmp(riff, "RF64", 4) == 0 || memcmp(riff, "BW64", 4) == 0;
+    if (!rf64 && memcmp(riff, "RIFF", 4) != 0)
+      return false;
+
+    uint64_t ds64_data_size = 0;
+    bool have_format = false;
+    char header[8];
+    std::vector<char> chunk;
+    while (stream->Read(header, 8) == 8) {
+      uint64_t size = ReadLE32(header + 4);
+      if (memcmp(header, "data", 4) == 0) {
+        if (rf64 && size == 0xFFFFFFFF)
+          size = ds64_data_size;
+        if (size == 0 || size == 0xFFFFFFFF)
+          size = UINT64_MAX;
+        data_size = size;
+        return have_format;
+      }
+      uint64_t padded = size + (size & 1);
+      size_t length = static_cast<size_t>(std::min<uint64_t>(padded, 0x10000));
+      chunk.resize(length);
+      if (stream->Read(chunk.data(), length) < length)
+        return false;
+      uint64_t skipped = length;
+      if (skipped < padded && stream->Seekable()) {
+        if (!stream->Seek(static_cast<int64_t>(padded - skipped), SEEK_CUR))
+          return false;
+        skipped = padded;
+      }
+      while (skipped < padded) {
+        char discard[0x1000];
+        size_t count = static_cast<size_t>(
+            std::min<uint64_t>(sizeof(discard), padded - skipped));
+        if (stream->Read(discard, count) < count)
+          return false;
+        skipped += count;
+      }
+      length = static_cast<size_t>(std::min<uint64_t>(size, length));
+
+      if (memcmp(header, "ds64", 4) == 0) {
+        if (length < 24)
+          return false;
+        ds64_data_size = ReadLE64(chunk.data() + 8);
+      } else if (memcmp(header, "fmt ", 4) == 0) {
+        if (!Format_From_WaveFormatChunk(
+                chunk.data(),
+                static_cast<uint32_t>((std::min)(length, size_t(64))),
+                &format)) {
+          return false;
+        }
+        have_format = true;
+      } else if (memcmp(header, "LIST", 4) == 0) {
+        ParseInfo(chunk.data(), length);
+      }
+    }
+    return false;
+  }
+
+  void ParseInfo(const char* list, size_t length) {
+    if (length < 4 || memcmp(list, "INFO", 4) != 0)
+      return;
+    size_t offset = 4;
+    while (offset + 8 <= length) {
+      uint32_t field_size = ReadLE32(list + offset + 4);
+      if (offset + 8 + field_size > length)
+        break;
+      MetaAppendInfoField(&metadata, list + offset,
+                          std::string(list + offset + 8, field_size));
+      offset += 8 + field_size + (field_size & 1);
+    }
+  }
+
+  enum { default_span_size = 0x10000 };
+
+  MappedFile file;
+  std::shared_ptr<InputStream> stream;
+  uint64_t data_offset = 0, data_size = 0, data_end = 0, position = 0;
+  size_t block_align = 1;
+};
+
+typedef mpg123_handle MPG123Handle;
+
+AudioFormat Format_From_MPG123Handle(MPG123Handle* mh) {
+  AudioFormat fmt;
+
+  long rate = 0;
+  mpg123_getformat(mh, &rate, &fmt.channels, &fmt.encoding);
+  fmt.sample_rate = static_cast<int>(rate);
+
+  fmt.is_float = (fmt.encoding & (MPG123_ENC_FLOAT_64 | MPG123_ENC_FLOAT_32));
+  if (fmt.encoding & MPG123_ENC_FLOAT_64)
+    fmt.bits_per_sample = 64;
+  else if (fmt.encoding & MPG123_ENC_FLOAT_32)
+    fmt.bits_per_sample = 32;
+  else if (fmt.encoding & MPG123_ENC_16)
+    fmt.bits_per_sample = 16;
+  else
+    fmt.bits_per_sample = 8;
+  return fmt;
+}
+
+void MetaAppendField(Metadata* meta, std::string& key, std::string& value) {
+  if (APP_STRNCASECMP(key.c_str(), "artist") == 0) {
+    meta->artist.append(value);
+  } else if (APP_STRNCASECMP(key.c_str(), "title") == 0) {
+    meta->title.append(value);
+  } else if (APP_STRNCASECMP(key.c_str(), "year") == 0) {
+    meta->year.append(value);
+  } else if (APP_STRNCASECMP(key.c_str(), "date") == 0) {
+    meta->year.append(value);
+  } else if (APP_STRNCASECMP(key.c_str(), "genre") == 0) {
+    meta->genre.append(value);
+  } else if (APP_STRNCASECMP(key.c_str(), "album") == 0) {
+    meta->album.append(value);
+  } else if (APP_STRNCASECMP(key.c_str(), "comment") == 0) {
+    meta->comment.append(value);
+  } else if (APP_STRNCASECMP(key.c_str(), "replaygain_track_gain") == 0) {
+    meta->track_gain = static_cast<float>(atof(value.c_str()));
+  } else if (APP_STRNCASECMP(key.c_str(), "replaygain_album_gain") == 0) {
+    meta->album_gain = static_cast<float>(atof(value.c_str()));
+  } else if (APP_STRNCASECMP(key.c_str(), "replaygain_track_peak") == 0) {
+    meta->track_peak = static_cast<float>(atof(value.c_str()));
+  } else if (APP_STRNCASECMP(key.c_str(), "replaygain_album_peak") == 0) {
+    meta->album_peak = static_cast<float>(atof(value.c_str()));
+  } else if (APP_STRNCASECMP(key.c_str(), "r128_track_gain") == 0) {
+    // Opus: Q7.8 dB relative to -23 LUFS, ReplayGain's reference is 5 dB
+    // louder.
+    meta->track_gain = atoi(value.c_str()) / 256.0f + 5.0f;
+  } else if (APP_STRNCASECMP(key.c_str(), "r128_album_gain") == 0) {
+    meta->album_gain = atoi(value.c_str()) / 256.0f + 5.0f;
+  }
+};
+
+Metadata Metadata_From_Handle(MPG123Handle* mh) {
+  Metadata mt;
+
+  auto copy_field = [](std::string& str, mpg123_string* input) {
+    if (input != nullptr) {
+      str = input->p;
+    }
+  };
+
+  AudioResult meta_result = mpg123_meta_check(mh);
+
+  if (meta_result & MPG123_ID3) {
+    mpg123_id3v1* v1;
+    mpg123_id3v2* v2;
+    AudioResult id3_result = mpg123_id3(mh, &v1, &v2);
+    if (id3_result == MPG123_OK) {
+      if (v1 != nullptr) {
+        mt.title = v1->title;
+        mt.artist = v1->artist;
+        mt.album = v1->album;
+        mt.year = v1->year;
+        mt.comment = v1->comment;
+        mt.genre = v1->genre;
+      } else if (v2 != nullptr) {
+        copy_field(mt.title, v2->title);
+        copy_field(mt.artist, v2->artist);
+        copy_field(mt.album, v2->album);
+        copy_field(mt.year, v2->year);
+        copy_field(mt.comment, v2->comment);
+        copy_field(mt.genre, v2->genre);
+      }
+      // ReplayGain lives in TXXX frames, whichever tag supplied the text.
+      for (size_t i = 0; v2 != nullptr && i < v2->extras; i++) {
+        const mpg123_text& extra = v2->extra[i];
+        if (extra.description.p == nullptr || extra.text.p == nullptr)
+          continue;
+        std::string key = extra.description.p, value = extra.text.p;
+        if (APP_STRNCASECMP(key.substr(0, 11).c_str(), "replaygain_") == 0)
+          MetaAppendField(&mt, key, value);
+      }
+    }
+  }
+  return mt;
+}
+
+// The fields of an MPEG audio frame header that locate and size the frame.
+typedef struct _Mp3FrameHeader {
+  int sample_rate = 0;
+  int frame_samples = 0;
+  size_t frame_size = 0;
+  bool mpeg1 = false;
+  bool mono = false;
+} Mp3FrameHeader;
+
+// Parses the four header bytes at |h|. Free-format frames, which state no
+// bitrate and so no size, are rejected along with anything invalid.
+bool ParseMp3FrameHeader(const unsigned char* h, Mp3FrameHeader* header) {
+  static const int rates[4][3] = {{11025, 12000, 8000},
+                                  {0, 0, 0},
+                                  {22050, 24000, 16000},
+                                  {44100, 48000, 32000}};
+  // kbit/s by [MPEG-1][layer 1, 2, 3][index]; MPEG-2 and 2.5 share a row.
+  static const int bitrates[2][3][15] = {
+      {{0, 32, 48, 56, 64, 80, 96, 112, 128, 144, 160, 176, 192, 224, 256},
+       {0, 8, 16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 144, 160},
+       {0, 8, 16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 144, 160}},
+      {{0, 32, 64, 96, 128, 160, 192, 224, 256, 288, 320, 352, 384, 416, 448},
+       {0, 32, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320, 384},
+       {0, 32, 40, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320}}};
+  int version = (h[1] >> 3) & 3, layer_bits = (h[1] >> 1) & 3;
+  int rate_index = (h[2] >> 2) & 3, bitrate_index = h[2] >> 4;
+  if (h[0] != 0xff || (h[1] & 0xe0) != 0xe0 || version == 1 ||
+      layer_bits == 0 || rate_index == 3 || bitrate_index == 0 ||
+      bitrate_index == 15)
+    return false;
+  int layer = 4 - layer_bits, padding = (h[2] >> 1) & 1;
+  header->mpeg1 = version == 3;
+  header->mono = (h[3] >> 6) == 3;
+  header->sample_rate = rates[version][rate_index];
+  int bitrate = bitrates[header->mpeg1][layer - 1][bitrate_index] * 1000;
+  if (layer == 1) {
+    header->frame_samples = 384;
+    header->frame_size = (12 * bitrate / header->sample_rate + padding) * 4;
+  } else {
+    header->frame_samples = (layer == 2 || header->mpeg1) ? 1152 : 576;
+    header->frame_size =
+        header->frame_samples / 8 * bitrate / header->sample_rate + padding;
+  }
+  return true;
+}
+
+// Whether the frame at |data| is a Xing/Info or VBRI header rather than
+// audio. Returns its frame count through |frames|, 0 when not stated.
+bool IsMp3InfoFrame(const char* data,
+                    size_t length,
+                    const Mp3FrameHeader& header,
+                    uint32_t* frames) {
+  *frames = 0;
+  // Xing/Info follows the side information, VBRI sits at a fixed offset.
+  size_t xing = 4 + (header.mpeg1 ? (header.mono ? 17 : 32)
+                                  : (header.mono ? 9 : 17));
+  if (xing + 12 <= length && (memcmp(data + xing, "Xing", 4) == 0 ||
+                              memcmp(data + xing, "Info", 4) == 0)) {
+    if (ReadBE32(data + xing + 4) & 1)
+      *frames = ReadBE32(data + xing + 8);
+    return true;
+  }
+  if (36 + 18 <= length && memcmp(data + 36, "VBRI", 4) == 0) {
+    *frames = ReadBE32(data + 36 + 14);
+    return true;
+  }
+  return false;
+}
+
+// Length of an MP3 in seconds from the Xing/Info or VBRI header in its first
+// frame, or NAN for plain CBR files without one. Only the ID3v2 tag and that
+// frame are read; |frame_offset| receives where the frame starts.
+double Mp3HeaderDuration(const std::string& path, uint64_t* frame_offset) {
+  MappedFile file;
+  if (!file.Open(path))
+    return NAN;
+  uint64_t offset = 0;
+  size_t length = 10;
+  const char* data = file.View(0, &length);
+  if (data != nullptr && length == 10 && memcmp(data, "ID3", 3) == 0) {
+    const unsigned char* tag = reinterpret_cast<const unsigned char*>(data);
+    offset = 10 + ((tag[6] & 0x7f) << 21 | (tag[7] & 0x7f) << 14 |
+                   (tag[8] & 0x7f) << 7 | (tag[9] & 0x7f));
+    if (tag[5] & 0x10)
+      offset += 10;
+  }
+  // Some files carry junk before the first frame; look a little way in.
+  length = 0x10000;
+  data = file.View(offset, &length);
+  Mp3FrameHeader header;
+  for (size_t i = 0; data != nullptr && i + 4 <= length; i++) {
+    if (!ParseMp3FrameHeader(
+            reinterpret_cast<const unsigned char*>(data + i), &header))
+      continue;
+    *frame_offset = offset + i;
+    uint32_t frames;
+    if (!IsMp3InfoFrame(data + i, length - i, header, &frames) || frames == 0)
+      return NAN;
+    return static_cast<double>(frames) * header.frame_samples /
+           header.sample_rate;
+  }
+  return NAN;
+}
+
+// Byte offsets of every |step|-th audio frame of an MP3, starting at
+// |frame_offset|, found by hopping from header to header without decoding.
+// The Xing/Info frame is not audio and is left out, as mpg123 does. Junk
+// between frames is skipped by searching for the next valid header.
+std::vector<off_t> BuildMp3FrameIndex(const std::string& path,
+                                      uint64_t frame_offset,
+                                      size_t step) {
+  std::vector<off_t> offsets;
+  MappedFile file;
+  if (!file.Open(path))
+    return offsets;
+  uint64_t offset = frame_offset;
+  size_t frame = 0;
+  bool first = true;
+  Mp3FrameHeader header;
+  while (offset + 4 <= file.Size()) {
+    size_t length = 4;
+    const unsigned char* h =
+        reinterpret_cast<const unsigned char*>(file.View(offset, &length));
+    if (h == nullptr || length < 4)
+      break;
+    if (!ParseMp3FrameHeader(h, &header) || header.frame_size < 4) {
+      offset++;
+      continue;
+    }
+    if (first) {
+      first = false;
+      length = 64;
+      const char* data = file.View(offset, &length);
+      uint32_t frames;
+      if (data != nullptr && IsMp3InfoFrame(data, length, header, &frames)) {
+        offset += header.frame_size;
+        continue;
+      }
+    }
+    if (frame++ % step == 0)
+      offsets.push_back(static_cast<off_t>(offset));
+    offset += header.frame_size;
+  }
+  return offsets;
+}
+
+// Walks the frames of an MP3 from |frame_offset| like BuildMp3FrameIndex
+// and calls |report| wherever the chain breaks: bytes between one frame and
+// the next header, which mpg123 skips quietly when it resyncs, a last frame
+// cut short, and anything after the last frame other than a tag. Junk ahead
+// of the first frame is common and left alone.
+void CheckMp3Frames(const std::string& path,
+                    uint64_t frame_offset,
+                    const std::function<void(int64_t, std::string)>& report) {
+  MappedFile file;
+  if (!file.Open(path))
+    return;
+  uint64_t offset = frame_offset, junk = 0;
+  bool synced = false, tagged = false;
+  Mp3FrameHeader header;
+  while (offset + 4 <= file.Size()) {
+    size_t length = 11;
+    const char* data = file.View(offset, &length);
+    if (data == nullptr || length < 4)
+      break;
+    if (!ParseMp3FrameHeader(reinterpret_cast<const unsigned char*>(data),
+                             &header) ||
+        header.frame_size < 4) {
+      if (synced && (memcmp(data, "TAG", 3) == 0 ||
+                     (length >= 8 && memcmp(data, "APETAGEX", 8) == 0) ||
+                     (length >= 11 && memcmp(data, "LYRICSBEGIN", 11) == 0))) {
+        tagged = true;
+        break;
+      }
+      junk += synced;
+      offset++;
+      continue;
+    }
+    if (junk > 0) {
+      report(static_cast<int64_t>(offset - junk),
+             string_format("lost frame sync, %llu bytes skipped",
+                           static_cast<unsigned long long>(junk)));
+      junk = 0;
+    }
+    synced = true;
+    if (offset + header.frame_size > file.Size()) {
+      report(static_cast<int64_t>(offset),
+             string_format("last frame cut short, %llu of %zu bytes",
+                           static_cast<unsigned long long>(file.Size() - offset),
+                           header.frame_size));
+      return;
+    }
+    offset += header.frame_size;
+  }
+  uint64_t start = offset - junk, end = tagged ? offset : file.Size();
+  if (synced && end > start) {
+    report(static_cast<int64_t>(start),
+           string_format("%llu stray bytes after the last frame",
+                         static_cast<unsigned long long>(end - start)));
+  }
+}
+
+class MP3Player : public AudioDecoder {
+ public:
+  ~MP3Player() { Close(); }
+
+  bool Open(const std::string& path) override {
+    if (!Create())
+      return false;
+
+    if (!Opened(mpg123_open(mh, path.c_str()), path))
+      return false;
+
+    // Getting the format parses the ID3v2 tag and the first frame, which is
+    // all the metadata needs; the file is never scanned to its end.
+    this->path = path;
+    ReadHeaders();
+    ReadLength();
+    return true;
+  }
+
+  // mpg123 reads the stream through its reader hooks. Pipes get no seek
+  // hook, so it never looks at the end for an ID3v1 tag and states no
+  // length; files read ahead get one and behave as if opened by name.
+  bool OpenStream(std::shared_ptr<InputStream> stream) override {
+    if (!Create())
+      return false;
+    this->stream = stream;
+    mpg123_replace_reader_handle(mh, ReadStream,
+                                 stream->Seekable() ? SeekStream : nullptr,
+                                 nullptr);
+    if (!Opened(mpg123_open_handle(mh, stream.get()), stream->Path()))
+      return false;
+    ReadHeaders();
+    if (stream->Seekable()) {
+      path = stream->Path();
+      ReadLength();
+    }
+    return true;
+  }
+
+  size_t Read(char* buffer, size_t size) override {
+    size_t read_bytes = 0;
+    AudioResult result;
+    do {
+      result = mpg123_read(mh, reinterpret_cast<unsigned char*>(buffer), size,
+                           &read_bytes);
+      if (result == MPG123_NEW_FORMAT)
+        TakeFormat();
+    } while (result == MPG123_NEW_FORMAT && read_bytes == 0);
+    if (result != MPG123_OK && result != MPG123_DONE &&
+        result != MPG123_NEW_FORMAT) {
+      ReportError(static_cast<int64_t>(mpg123_tell_stream(mh)),
+                  HandleErrorToString(mh));
+    }
+    return read_bytes;
+  }
+
+  // mpg123 seeks to the sample, but only knows where frames start up to the
+  // furthest point it has read; anything beyond would be reached by reading
+  // every frame in between. A Xing TOC is too coarse to land on a sample, so
+  // past that point it is given an index built from the frame headers.
+  bool Seek(uint64_t frame) override {
+    if (stream && !stream->Seekable())
+      return false;
+    off_t* offsets;
+    off_t step;
+    size_t fill;
+    uint64_t frame_samples = (format.sample_rate < 32000) ? 576 : 1152;
+    if (!indexed && mpg123_index(mh, &offsets, &step, &fill) == MPG123_OK &&
+        frame / frame_samples >= static_cast<uint64_t>(step) * fill) {
+      indexed = true;
+      std::vector<off_t> index =
+          BuildMp3FrameIndex(path, audio_offset, index_step);
+      if (!index.empty())
+        mpg123_set_index(mh, index.data(), index_step, index.size());
+    }
+    off_t result = mpg123_seek(mh, static_cast<off_t>(frame), SEEK_SET);
+    return result >= 0 && static_cast<uint64_t>(result) == frame;
+  }
+
+  // mpg123 only fails on damage it cannot step over; gaps it resynced
+  // across are found by walking the frame headers.
+  void Verify() override {
+    if (path.empty())
+      return;
+    CheckMp3Frames(path, audio_offset,
+                   [this](int64_t offset, std::string what) {
+                     ReportError(offset, what);
+                   });
+  }
+
+  void Close() override {
+    if (mh == nullptr)
+      return;
+    mpg123_close(mh);
+    mpg123_delete(mh);
+    mh = nullptr;
+    stream.reset();
+  }
+
+  const char* ErrorCodeToString(int error_code) {
+    return mpg123_plain_strerror(error_code);
+  }
+  const char* HandleErrorToString(MPG123Handle* mh) {
+    return mpg123_strerror(mh);
+  }
+
+ private:
+  bool Create() {
+    AudioResult result = MPG123_OK;
+
+    mh = mpg123_new(nullptr, &result);
+
+    if (mh == nullptr) {
+      std::string message =
+          string_format("mpg123_new error: %s", ErrorCodeToString(result));
+      TRACE_ERROR(message.c_str());
+      return false;
+    }
+
+    // Trim the encoder delay and padding recorded in the LAME/Xing header so
+    // consecutive tracks splice without a gap.
+    mpg123_param(mh, MPG123_ADD_FLAGS, MPG123_GAPLESS, 0.);
+    // Many files decode at once, and what they would print about resyncs
+    // is reported per file instead.
+    if (GetOptions().verify)
+      mpg123_param(mh, MPG123_ADD_FLAGS, MPG123_QUIET, 0.);
+
+    if (GetOptions().float_pipeline) {
+      // With float32 as the only accepted encoding the synth writes floats
+      // directly instead of rounding to 16 bits first.
+      const long* rates;
+      size_t rate_count;
+      mpg123_rates(&rates, &rate_count);
+      mpg123_format_none(mh);
+      for (size_t i = 0; i < rate_count; i++) {
+        mpg123_format(mh, rates[i], MPG123_MONO | MPG123_STEREO,
+                      MPG123_ENC_FLOAT_32);
+      }
+    }
+    return true;
+  }
+
+  bool Opened(AudioResult result, const std::string& path) {
+    if (result != MPG123_OK) {
+      std::string message =
+          string_format("Cannot open file: %s", HandleErrorToString(mh));
+      TRACE_ERROR(message.c_str());
+      Close();
+      return false;
+    }
+    std::string message = string_format("Opened %s", path.c_str());
+    TRACE_INFO(message.c_str());
+    return true;
+  }
+
+  // mpg123 itself synthesises floats under --float; without it, it gives
+  // 16-bit samples.
+  void TakeFormat() {
+    format = native_format = Format_From_MPG123Handle(mh);
+    if (GetOptions().float_pipeline) {
+      native_format.encoding = MPG123_ENC_SIGNED_16;
+      native_format.bits_per_sample = 16;
+      native_format.is_float = false;
+    }
+  }
+
+  void ReadHeaders() {
+    TakeFormat();
+    metadata = Metadata_From_Handle(mh);
+    buffer_size = mpg123_outblock(mh);
+  }
+
+  void ReadLength() {
+    duration = Mp3HeaderDuration(path, &audio_offset);
+    if (isnan(duration) && format.sample_rate > 0) {
+      // Without a VBR header mpg123 estimates from the size and bitrate.
+      off_t samples = mpg123_length(mh);
+      if (samples > 0)
+        duration = static_cast<double>(samples) / format.sample_rate;
+    }
+  }
+
+  static ssize_t ReadStream(void* handle, void* buffer, size_t size) {
+    return static_cast<ssize_t>(
+        reinterpret_cast<InputStream*>(handle)->Read(buffer, size));
+  }
+
+  static off_t SeekStream(void* handle, off_t offset, int whence) {
+    InputStream* stream = reinterpret_cast<InputStream*>(handle);
+    if (!stream->Seek(offset, whence))
+      return -1;
+    return static_cast<off_t>(stream->Tell());
+  }
+
+  // Frames per generated index entry; mpg123 reads forward from the entry.
+  enum { index_step = 16 };
+
+  MPG123Handle* mh = nullptr;
+  std::string path;
+  std::shared_ptr<InputStream> stream;
+  bool indexed = false;
+};
+
+typedef vorbis_info VorbisInfo;
+typedef vorbis_comment VorbisComment;
+
+AudioFormat Format_From_VorbisFile(OggVorbis_File* vf) {
+  AudioFormat fmt;
+  VorbisInfo* vi = ov_info(vf, -1);
+  if (vi != nullptr) {
+    fmt.channels = vi->channels;
+    fmt.sample_rate = vi->rate;
+    fmt.bits_per_sample = 16;
+    fmt.layout = VorbisChannelLayout(fmt.channels);
+  }
+  return fmt;
+};
+
+Metadata Metadata_From_OggVorbis_File(OggVorbis_File* vf) {
+  Metadata mt;
+  const VorbisComment* comment = ov_comment(vf, -1);
+  if (comment != nullptr) {
+    for (int i = 0; i < comment->comments; i++) {
+      size_t comment_length = comment->comment_lengths[i];
+      std::string comment_str(comment_length + 1, '\0');
+      strncpy(&comment_str[0], comment->user_comments[i], comment_length);
+      std::vector<std::string> tokens = split(comment_str, '=');
+      if (tokens.size() > 1) {
+        for (size_t j = 1; j < tokens.size(); j++) {
+          MetaAppendField(&mt, tokens[0], tokens[j]);
+        }
+      }
+    }
+  }
+  return mt;
+}
+
+  // Windows UTF-16 Names
+
+#ifdef _WIN32
+int ov_wfopen(const wchar_t* path, OggVorbis_File* vf) {
+  int ret;
+  FILE* f = _wfopen(path, L"rb");
+  if (!f)
+    return -1;
+
+  ret = ov_open(f, vf, NULL, 0);
+  if (ret)
+    fclose(f);
+  return ret;
+}
+#endif
+
+class VorbisPlayer : public AudioDecoder {
+ public:
+  ~VorbisPlayer() { Close(); }
+
+  bool Open(const std::string& path) override {
+    AudioResult result;
+
+#ifdef _WIN32
+    std::wstring wpath = to_wstring(path.c_str());
+    result = ov_wfopen(wpath.c_str(), &vf);
+#else
+    result = ov_fopen(path.c_str(), &vf);
+#endif
+
+    return Opened(result, path);
+  }
+
+  // Without seek and tell callbacks libvorbisfile treats a pipe as
+  // unseekable and reads the headers of the first link only.
+  bool OpenStream(std::shared_ptr<InputStream> stream) override {
+    this->stream = stream;
+    ov_callbacks callbacks = {ReadStream, nullptr, nullptr, nullptr};
+    if (stream->Seekable()) {
+      callbacks.seek_func = SeekStream;
+      callbacks.tell_func = TellStream;
+    }
+    return Opened(ov_open_callbacks(stream.get(), &vf, nullptr, 0, callbacks),
+                  stream->Path());
+  }
+
+  size_t Read(char* buffer, size_t size) override {
+    if (format.is_float)
+      return ReadFloat(reinterpret_cast<float*>(buffer), size);
+    int is_bigendian = (IsLittleEndian()) ? 0 : 1;
+    int word_size = (format.bits_per_sample == 8) ? 1 : 2;
+    for (;;) {
+      long read_bytes = ov_read(&vf, buffer, static_cast<int>(size),
+                                is_bigendian, word_size, 1, &link);
+      if (!Decoded(read_bytes))
+        continue;
+      if (link != current_link) {
+        // A chained stream moved to its next logical bitstream, which may
+        // use a different rate or channel count.
+        current_link = link;
+        SetFormat(Format_From_VorbisFile(&vf));
+      }
+      return (read_bytes > 0) ? static_cast<size_t>(read_bytes) : 0;
+    }
+  }
+
+  // libvorbisfile bisects over the pages and decodes up to the sample.
+  bool Seek(uint64_t frame) override {
+    return ov_pcm_seek(&vf, static_cast<ogg_int64_t>(frame)) == 0;
+  }
+
+  void Close() override {
+    if (!is_open)
+      return;
+    ov_clear(&vf);
+    is_open = false;
+    stream.reset();
+  }
+
+ private:
+  bool Opened(AudioResult result, const std::string& path) {
+    if (result != 0) {
+      std::string message = string_format("Error opening file %d", result);
+      TRACE_ERROR(message.c_str());
+      return false;
+    } else {
+      std::string message = string_format("Opened %s", path.c_str());
+      TRACE_INFO(message.c_str());
+    }
+    is_open = true;
+
+    SetFormat(Format_From_VorbisFile(&vf));
+    metadata = Metadata_From_OggVorbis_File(&vf);
+    // A packet decodes to at most half a long block per channel.
+    VorbisInfo* info = ov_info(&vf, -1);
+    if (info != nullptr) {
+      buffer_size = vorbis_info_blocksize(info, 1) / 2 * format.channels *
+                    (format.bits_per_sample / 8);
+    }
+    // Opening already walked the links of a seekable file.
+    double total = ov_time_total(&vf, -1);
+    if (total >= 0.0)
+      duration = total;
+    return true;
+  }
+
+  // libogg drops pages that fail their CRC, which libvorbisfile reports as
+  // a hole before carrying on behind it; any other error ends the stream.
+  // Returns false for a hole.
+  bool Decoded(long result) {
+    if (result >= 0)
+      return true;
+    int64_t offset = static_cast<int64_t>(ov_raw_tell(&vf));
+    if (result == OV_HOLE) {
+      ReportError(offset, "gap in the Ogg stream: bad page CRC or lost sync");
+      return false;
+    }
+    ReportError(offset, string_format("libvorbisfile error %ld", result));
+    return true;
+  }
+
+  static size_t ReadStream(void* buffer,
+                           size_t size,
+                           size_t count,
+                           void* handle) {
+    return reinterpret_cast<InputStream*>(handle)->Read(buffer, size * count) /
+           size;
+  }
+
+  static int SeekStream(void* handle, ogg_int64_t offset, int whence) {
+    return reinterpret_cast<InputStream*>(handle)->Seek(offset, whence) ? 0
+                                                                        : -1;
+  }
+
+  static long TellStream(void* handle) {
+    return static_cast<long>(reinterpret_cast<InputStream*>(handle)->Tell());
+  }
+
+  // libvorbis hands out planar floats; interleave them into |buffer|.
+  size_t ReadFloat(float* buffer, size_t size) {
+    for (;;) {
+      float** pcm;
+      int frames = static_cast<int>(size / (format.channels * sizeof(float)));
+      long count = ov_read_float(&vf, &pcm, frames, &link);
+      if (!Decoded(count))
+        continue;
+      if (link != current_link) {
+        current_link = link;
+        SetFormat(Format_From_VorbisFile(&vf));
+      }
+      if (count <= 0)
+        return 0;
+      InterleaveFloat(pcm, format.channels, count, buffer);
+      return count * format.channels * sizeof(float);
+    }
+  }
+
+  OggVorbis_File vf;
+  std::shared_ptr<InputStream> stream;
+  bool is_open = false;
+  int link = 0, current_link = 0;
+};
+
+AudioFormat Format_From_FLAC_Metadata(const FLAC__StreamMetadata* metadata) {
+  AudioFormat fmt;
+  fmt.sample_rate = metadata->data.stream_info.sample_rate;
+  fmt.channels = metadata->data.stream_info.channels;
+
+  // 24-bit streams are widened to left aligned 32-bit samples, which every
+  // sink understands without a packed 3-byte path.
+  int bits_per_sample = metadata->data.stream_info.bits_per_sample;
+  fmt.bits_per_sample = (bits_per_sample == 24) ? 32 : bits_per_sample;
+
+  return fmt;
+}
+
+Metadata Metadata_FLAC__StreamMetadata(const FLAC__StreamMetadata* metadata) {
+  Metadata mt;
+  auto tags = metadata->data.vorbis_comment;
+  for (size_t i = 0; i < tags.num_comments; i++) {
+    auto flac_comment = tags.comments[i];
+    size_t length = sizeof(FLAC__byte) * flac_comment.length;
+    std::string comment(length + 1, '\0');
+    strncpy(&comment[0], reinterpret_cast<char*>(flac_comment.entry), length);
+    std::vector<std::string> tokens = split(comment, '=');
+    if (tokens.size() > 1) {
+      for (size_t j = 1; j < tokens.size(); j++) {
+        MetaAppendField(&mt, tokens[0], tokens[j]);
+      }
+    }
+  }
+  return mt;
+}
+
+class FlacPlayer : public AudioDecoder {
+ public:
+  ~FlacPlayer() { Close(); }
+
+  bool Open(const std::string& path) override {
+    FLAC__StreamDecoderInitStatus init_status;
+
+    if (!Create())
+      return false;
+
+#ifdef _WIN32
+    // The decoder takes ownership of the FILE and closes it on finish.
+    std::wstring wpath = to_wstring(path.c_str());
+    FILE* audio_file = _wfopen(wpath.c_str(), L"rb");
+    if (audio_file == nullptr) {
+      TRACE_ERROR("Failed to open file");
+      return false;
+    }
+    init_status =
+        FLAC__stream_decoder_init_FILE(decoder, audio_file, write_callback,
+                                       metadata_callback, error_callback, this);
+#else
+    init_status =
+        FLAC__stream_decoder_init_file(decoder, path.c_str(), write_callback,
+                                       metadata_callback, error_callback, this);
+#endif
+    return Initialized(init_status, path);
+  }
+
+  // A pipe gets only a read callback, and libFLAC then reports it as
+  // unseekable. Files read ahead seek through the rest.
+  bool OpenStream(std::shared_ptr<InputStream> stream) override {
+    if (!Create())
+      return false;
+    this->stream = stream;
+    bool seekable = stream->Seekable();
+    return Initialized(
+        FLAC__stream_decoder_init_stream(
+            decoder, read_callback, seekable ? seek_callback : nullptr,
+            seekable ? tell_callback : nullptr,
+            seekable ? length_callback : nullptr,
+            seekable ? eof_callback : nullptr, write_callback,
+            metadata_callback, error_callback, this),
+        stream->Path());
+  }
+
+  // A frame that fits in |buffer| is interleaved by write_callback straight
+  // from libFLAC's planes into it, which may be a device mmap area. Only a
+  // frame that does not fit, or one decoded by a seek, is kept planar and
+  // handed out over several calls.
+  size_t Read(char* buffer, size_t size) override {
+    while (frame_position == frame_samples) {
+      frame_position = frame_samples = 0;
+      if (FLAC__stream_decoder_get_state(decoder) ==
+          FLAC__STREAM_DECODER_END_OF_STREAM) {
+        return 0;
+      }
+      target = buffer;
+      target_size = size;
+      target_bytes = 0;
+      FLAC__bool ok = FLAC__stream_decoder_process_single(decoder);
+      target = nullptr;
+      FLAC__StreamDecoderState state = FLAC__stream_decoder_get_state(decoder);
+      if (!ok || state == FLAC__STREAM_DECODER_END_OF_STREAM) {
+        std::string message =
+            string_format("decoding: %s   state: %s",
+                          ok ? "succeeded" : "FAILED",
+                          FLAC__StreamDecoderStateString[state]);
+        if (ok) {
+          TRACE_SUCCESS(message.c_str());
+        } else {
+          TRACE_ERROR(message.c_str());
+          ReportError(DecodePosition(),
+                      string_format("decoding stopped in state %s",
+                                    FLAC__StreamDecoderStateString[state]));
+          return 0;
+        }
+      }
+      if (target_bytes > 0)
+        return target_bytes;
+    }
+    uint32_t count = static_cast<uint32_t>(
+        (std::min)(size / frame_bytes,
+                   static_cast<size_t>(frame_samples - frame_position)));
+    const int32_t* planes[FLAC__MAX_CHANNELS];
+    for (uint32_t channel = 0; channel < channels; channel++)
+      planes[channel] = planar[channel].data() + frame_position;
+    Interleave(planes, count, buffer);
+    frame_position += count;
+    return count * frame_bytes;
+  }
+
+  // libFLAC narrows the search with the SEEKTABLE when there is one and
+  // bisects the file otherwise. The frame holding |frame| then arrives in
+  // write_callback already trimmed to start at it.
+  bool Seek(uint64_t frame) override {
+    frame_position = frame_samples = 0;
+    if (FLAC__stream_decoder_seek_absolute(decoder, frame))
+      return true;
+    if (FLAC__stream_decoder_get_state(decoder) ==
+        FLAC__STREAM_DECODER_SEEK_ERROR)
+      FLAC__stream_decoder_flush(decoder);
+    return false;
+  }
+
+  // libFLAC checks the signature as it finishes, once every frame has gone
+  // through its MD5; after a seek it has stopped checking and passes.
+  void Verify() override {
+    if (decoder == nullptr || FLAC__stream_decoder_get_state(decoder) !=
+                                  FLAC__STREAM_DECODER_END_OF_STREAM)
+      return;
+    if (!FLAC__stream_decoder_finish(decoder))
+      ReportError(-1, "MD5 signature mismatch");
+  }
+
+  void Close() override {
+    if (decoder == nullptr)
+      return;
+    FLAC__stream_decoder_finish(decoder);
+    FLAC__stream_decoder_delete(decoder);
+    decoder = nullptr;
+    stream.reset();
+  }
+
+  static FLAC__StreamDecoderWriteStatus write_callback(
+      const FLAC__StreamDecoder* decoder,
+      const FLAC__Frame* frame,
+      const FLAC__int32* const buffer[],
+      void* client_data) {
+    (void)decoder;
+
+    FlacPlayer* player = reinterpret_cast<FlacPlayer*>(client_data);
+    uint32_t samples = frame->header.blocksize,
+             channels = frame->header.channels;
+
+    int bits_per_sample = player->format.bits_per_sample;
+
+    if (channels == 0 || channels > FLAC__MAX_CHANNELS) {
+      std::string message = string_format(
+          "This frame contains %d channels (should be 1 to %d)", channels,
+          FLAC__MAX_CHANNELS);
+      TRACE_ERROR(message.c_str());
+      return FLAC__STREAM_DECODER_WRITE_STATUS_ABORT;
+    }
+    for (uint32_t channel = 0; channel < channels; channel++) {
+      if (buffer[channel] == nullptr) {
+        std::string message =
+            string_format("buffer[%u] is null", channel);
+        TRACE_ERROR(message.c_str());
+        return FLAC__STREAM_DECODER_WRITE_STATUS_ABORT;
+      }
+    }
+    if (!(bits_per_sample == 8 || bits_per_sample == 16 ||
+          bits_per_sample == 32)) {
+      return FLAC__STREAM_DECODER_WRITE_STATUS_CONTINUE;
+    }
+
+    if (player->interleave == nullptr || channels != player->channels) {
+      int sample_bytes = bits_per_sample / 8;
+      player->interleave = SelectInterleave(channels, sample_bytes);
+      player->interleave_shift =
+          (sample_bytes == 4) ? 32 - player->stream_bits : 0;
+    }
+    player->channels = channels;
+    player->frame_bytes = channels * (bits_per_sample / 8);
+    player->frame_position = 0;
+    size_t bytes = samples * player->frame_bytes;
+    if (player->target != nullptr && bytes <= player->target_size) {
+      player->Interleave(buffer, samples, player->target);
+      player->target_bytes = bytes;
+      player->frame_samples = 0;
+      return FLAC__STREAM_DECODER_WRITE_STATUS_CONTINUE;
+    }
+    for (uint32_t channel = 0; channel < channels; channel++)
+      player->planar[channel].assign(buffer[channel], buffer[channel] + samples);
+    player->frame_samples = samples;
+
+    return FLAC__STREAM_DECODER_WRITE_STATUS_CONTINUE;
+  }
+
+  static void metadata_callback(const FLAC__StreamDecoder* decoder,
+                                const FLAC__StreamMetadata* metadata,
+                                void* client_data) {
+    (void)decoder;
+    FlacPlayer* player = reinterpret_cast<FlacPlayer*>(client_data);
+
+    switch (metadata->type) {
+      case FLAC__METADATA_TYPE_STREAMINFO: {
+        player->SetFormat(Format_From_FLAC_Metadata(metadata));
+        player->stream_bits = metadata->data.stream_info.bits_per_sample;
+        // Zero when the encoder did not know the length up front.
+        if (metadata->data.stream_info.total_samples > 0) {
+          player->duration =
+              static_cast<double>(metadata->data.stream_info.total_samples) /
+              metadata->data.stream_info.sample_rate;
+        }
+        // Sized for the largest block, so a Read takes a whole frame
+        // straight from libFLAC and the planes never grow.
+        uint32_t block = (std::max)(
+            metadata->data.stream_info.max_blocksize, uint32_t(16));
+        player->buffer_size = block * player->format.channels *
+                              (player->format.bits_per_sample / 8);
+        for (int channel = 0; channel < player->format.channels; channel++)
+          player->planar[channel].reserve(block);
+      } break;
+      case FLAC__METADATA_TYPE_VORBIS_COMMENT: {
+        player->metadata = Metadata_FLAC__StreamMetadata(metadata);
+      } break;
+      default:
+        break;
+    }
+  }
+
+  static void error_callback(const FLAC__StreamDecoder* decoder,
+                             FLAC__StreamDecoderErrorStatus status,
+                             void* client_data) {
+    (void)decoder;
+    FlacPlayer* player = reinterpret_cast<FlacPlayer*>(client_data);
+    std::string message = string_format(
+        "Got error callback: %s", FLAC__StreamDecoderErrorStatusString[status]);
+    TRACE_ERROR(message.c_str());
+    player->ReportError(player->DecodePosition(),
+                        FLAC__StreamDecoderErrorStatusString[status]);
+  }
+
+ private:
+  bool Create() {
+    if ((decoder = FLAC__stream_decoder_new()) == nullptr) {
+      TRACE_ERROR("allocating decoder");
+      return false;
+    }
+
+    // Hashing every frame costs time that playback rarely needs to spend.
+    FLAC__stream_decoder_set_md5_checking(
+        decoder, GetOptions().verify || GetOptions().check);
+    FLAC__stream_decoder_set_metadata_respond(decoder,
+                                              FLAC__METADATA_TYPE_STREAMINFO);
+    FLAC__stream_decoder_set_metadata_respond(
+        decoder, FLAC__METADATA_TYPE_VORBIS_COMMENT);
+    return true;
+  }
+
+  bool Initialized(FLAC__StreamDecoderInitStatus init_status,
+                   const std::string& path) {
+    if (init_status != FLAC__STREAM_DECODER_INIT_STATUS_OK) {
+      std::string message = string_format(
+          "initializing decoder: %s  %s",
+          FLAC__StreamDecoderInitStatusString[init_status], path.c_str());
+      TRACE_ERROR(message.c_str());
+      return false;
+    } else {
+      std::string message = string_format("Opened %s", path.c_str());
+      TRACE_INFO(message.c_str());
+    }
+
+    if (!FLAC__stream_decoder_process_until_end_of_metadata(decoder) ||
+        format.channels == 0) {
+      TRACE_ERROR("reading STREAMINFO");
+      return false;
+    }
+    int64_t position = DecodePosition();
+    if (position >= 0)
+      audio_offset = static_cast<uint64_t>(position);
+    return true;
+  }
+
+  void Interleave(const int32_t* const* planes, uint32_t count, char* out) {
+    if (format.is_float) {
+      InterleaveScaled(planes, channels, count,
+                       1.0f / static_cast<float>(1u << (stream_bits - 1)),
+                       reinterpret_cast<float*>(out));
+    } else {
+      interleave(planes, count, interleave_shift, out);
+    }
+  }
+
+  // Byte offset of the first undecoded byte, or -1 for pipes, which have no
+  // tell callback.
+  int64_t DecodePosition() const {
+    FLAC__uint64 position = 0;
+    if (!FLAC__stream_decoder_get_decode_position(decoder, &position))
+      return -1;
+    return static_cast<int64_t>(position);
+  }
+
+  static FLAC__StreamDecoderReadStatus read_callback(
+      const FLAC__StreamDecoder* decoder,
+      FLAC__byte buffer[],
+      size_t* bytes,
+      void* client_data) {
+    (void)decoder;
+    FlacPlayer* player = reinterpret_cast<FlacPlayer*>(client_data);
+    *bytes = player->stream->Read(buffer, *bytes);
+    return (*bytes == 0) ? FLAC__STREAM_DECODER_READ_STATUS_END_OF_STREAM
+                         : FLAC__STREAM_DECODER_READ_STATUS_CONTINUE;
+  }
+
+  static FLAC__StreamDecoderSeekStatus seek_callback(
+      const FLAC__StreamDecoder* decoder,
+      FLAC__uint64 absolute_byte_offset,
+      void* client_data) {
+    (void)decoder;
+    FlacPlayer* player = reinterpret_cast<FlacPlayer*>(client_data);
+    return player->stream->Seek(static_cast<int64_t>(absolute_byte_offset),
+                                SEEK_SET)
+               ? FLAC__STREAM_DECODER_SEEK_STATUS_OK
+               : FLAC__STREAM_DECODER_SEEK_STATUS_ERROR;
+  }
+
+  static FLAC__StreamDecoderTellStatus tell_callback(
+      const FLAC__StreamDecoder* decoder,
+      FLAC__uint64* absolute_byte_offset,
+      void* client_data) {
+    (void)decoder;
+    FlacPlayer* player = reinterpret_cast<FlacPlayer*>(client_data);
+    *absolute_byte_offset = player->stream->Tell();
+    return FLAC__STREAM_DECODER_TELL_STATUS_OK;
+  }
+
+  static FLAC__StreamDecoderLengthStatus length_callback(
+      const FLAC__StreamDecoder* decoder,
+      FLAC__uint64* stream_length,
+      void* client_data) {
+    (void)decoder;
+    FlacPlayer* player = reinterpret_cast<FlacPlayer*>(client_data);
+    *stream_length = player->stream->Size();
+    return FLAC__STREAM_DECODER_LENGTH_STATUS_OK;
+  }
+
+  static FLAC__bool eof_callback(const FLAC__StreamDecoder* decoder,
+                                 void* client_data) {
+    (void)decoder;
+    FlacPlayer* player = reinterpret_cast<FlacPlayer*>(client_data);
+    return player->stream->Tell() >= player->stream->Size();
+  }
+
+  FLAC__StreamDecoder* decoder = nullptr;
+  std::shared_ptr<InputStream> stream;
+  std::vector<FLAC__int32> planar[FLAC__MAX_CHANNELS];
+  uint32_t channels = 0, frame_samples = 0, frame_position = 0;
+  size_t frame_bytes = 1;
+  int stream_bits = 16;
+  // Chosen for the stream's layout when the first frame arrives.
+  InterleaveFn interleave = nullptr;
+  int interleave_shift = 0;
+  // Where Read wants the next frame, and how much of it write_callback put
+  // there directly.
+  char* target = nullptr;
+  size_t target_size = 0, target_bytes = 0;
+};
+
+AudioFormat Format_From_OggOpusFile(OggOpusFile* op_file) {
+  AudioFormat fmt;
+
+  const OpusHead* head = op_head(op_file, -1);
+  if (head != nullptr) {
+    // libopusfile always decodes at 48 kHz; input_sample_rate is only the
+    // rate the encoder was fed.
+    fmt.sample_rate = 48000;
+    fmt.channels = head->channel_count;
+    fmt.bits_per_sample = 16;
+    // Mapping family 255 has no defined order; it is played as is.
+    if (head->mapping_family <= 1)
+      fmt.layout = VorbisChannelLayout(fmt.channels);
+  }
+  return fmt;
+}
+Metadata Metadata_From_OggOpusFile(OggOpusFile* op_file) {
+  Metadata mt;
+  const OpusTags* tags = op_tags(op_file, -1);
+  if (tags != nullptr) {
+    for (int i = 0; i < tags->comments; i++) {
+      size_t comment_length = tags->comment_lengths[i];
+      std::string comment(comment_length + 1, '\0');
+      strncpy(&comment[0], tags->user_comments[i], comment_length);
+      std::vector<std::string> tokens = split(comment, '=');
+      if (tokens.size() > 1) {
+        for (size_t j = 1; j < tokens.size(); j++) {
+          MetaAppendField(&mt, tokens[0], tokens[j]);
+        }
+      }
+    }
+  }
+  return mt;
+}
+class OpusPlayer : public AudioDecoder {
+ public:
+  ~OpusPlayer() { Close(); }
+
+  // opusfile already drops the pre-skip samples and trims the final packet
+  // to the end granule position, so tracks splice without extra work.
+  bool Open(const std::string& path) override {
+    int err;
+    op_file = op_open_file(path.c_str(), &err);
+    return Opened(err, path);
+  }
+
+  // A pipe gets no seek or tell callback, so opusfile reads it once through.
+  bool OpenStream(std::shared_ptr<InputStream> stream) override {
+    this->stream = stream;
+    OpusFileCallbacks callbacks = {ReadStream, nullptr, nullptr, nullptr};
+    if (stream->Seekable()) {
+      callbacks.seek = SeekStream;
+      callbacks.tell = TellStream;
+    }
+    int err;
+    op_file = op_open_callbacks(stream.get(), &callbacks, nullptr, 0, &err);
+    return Opened(err, stream->Path());
+  }
+
+  size_t Read(char* buffer, size_t size) override {
+    for (;;) {
+      int link = 0;
+      int samples =
+          format.is_float
+              ? op_read_float(op_file, reinterpret_cast<float*>(buffer),
+                              static_cast<int>(size / sizeof(float)), &link)
+              : op_read(op_file, reinterpret_cast<opus_int16*>(buffer),
+                        static_cast<int>(size / sizeof(opus_int16)), &link);
+      if (samples == OP_HOLE) {
+        ReportError(static_cast<int64_t>(op_raw_tell(op_file)),
+                    "gap in the Ogg stream: bad page CRC or lost sync");
+        continue;
+      }
+      if (samples < 0) {
+        ReportError(static_cast<int64_t>(op_raw_tell(op_file)),
+                    string_format("libopusfile error %d", samples));
+      }
+      if (samples <= 0)
+        return 0;
+      if (link != current_link) {
+        current_link = link;
+        SetFormat(Format_From_OggOpusFile(op_file));
+      }
+      return samples * format.channels * (format.bits_per_sample / 8);
+    }
+  }
+
+  // Positions are always 48 kHz samples, which is also the output rate.
+  bool Seek(uint64_t frame) override {
+    return op_pcm_seek(op_file, static_cast<long long>(frame)) == 0;
+  }
+
+  void Close() override {
+    if (op_file == nullptr)
+      return;
+    op_free(op_file);
+    op_file = nullptr;
+    stream.reset();
+  }
+
+ private:
+  bool Opened(int err, const std::string& path) {
+    if (op_file == nullptr || err) {
+      TRACE_ERROR("Failed to Open File");
+      return false;
+    } else {
+      std::string message = string_format("Opened %s", path.c_str());
+      TRACE_INFO(message.c_str());
+    }
+
+    SetFormat(Format_From_OggOpusFile(op_file));
+    metadata = Metadata_From_OggOpusFile(op_file);
+    buffer_size =
+        max_packet_frames * format.channels * (format.bits_per_sample / 8);
+    long long total = op_pcm_total(op_file, -1);
+    if (total >= 0)
+      duration = total / 48000.0;
+    return true;
+  }
+
+  static int ReadStream(void* handle, unsigned char* buffer, int size) {
+    return static_cast<int>(reinterpret_cast<InputStream*>(handle)->Read(
+        buffer, static_cast<size_t>(size)));
+  }
+
+  static int SeekStream(void* handle, opus_int64 offset, int whence) {
+    return reinterpret_cast<InputStream*>(handle)->Seek(offset, whence) ? 0
+                                                                        : -1;
+  }
+
+  static opus_int64 TellStream(void* handle) {
+    return static_cast<opus_int64>(
+        reinterpret_cast<InputStream*>(handle)->Tell());
+  }
+
+  // The longest Opus packet, 120 ms at 48 kHz.
+  enum { max_packet_frames = 5760 };
+
+  OggOpusFile* op_file = nullptr;
+  std::shared_ptr<InputStream> stream;
+  int current_link = 0;
+};
+
+typedef std::unique_ptr<AudioDecoder> (*DecoderFactory)();
+
+template <typename Decoder>
+std::unique_ptr<AudioDecoder> CreateDecoder() {
+  return std::make_unique<Decoder>();
+}
+
+typedef std::map<std::string, DecoderFactory> PlayerRegistry;
+
+// A stream has no extension to go by, so its first bytes name the decoder.
+// Returns nullptr for anything unrecognised.
+DecoderFactory DetectFormat(const char* head, size_t size) {
+  if (size >= 4 && memcmp(head, "fLaC", 4) == 0)
+    return &CreateDecoder<FlacPlayer>;
+  // The first Ogg page carries the codec's identification header.
+  if (size >= 36 && memcmp(head, "OggS", 4) == 0) {
+    if (memcmp(head + 28, "OpusHead", 8) == 0)
+      return &CreateDecoder<OpusPlayer>;
+    if (memcmp(head + 28, "\x01vorbis", 7) == 0)
+      return &CreateDecoder<VorbisPlayer>;
+    return nullptr;
+  }
+  if (size >= 12 && memcmp(head + 8, "WAVE", 4) == 0 &&
+      (memcmp(head, "RIFF", 4) == 0 || memcmp(head, "RF64", 4) == 0 ||
+       memcmp(head, "BW64", 4) == 0))
+    return &CreateDecoder<WavPlayer>;
+  Mp3FrameHeader header;
+  if ((size >= 3 && memcmp(head, "ID3", 3) == 0) ||
+      (size >= 4 && ParseMp3FrameHeader(
+                        reinterpret_cast<const unsigned char*>(head), &header)))
+    return &CreateDecoder<MP3Player>;
+  return nullptr;
+}
+
+// Opens a stream and picks its decoder by content.
+std::unique_ptr<AudioDecoder> OpenStreamInput(const std::string& path) {
+  auto stream = std::make_shared<InputStream>();
+  if (!stream->Open(path)) {
+    TRACE_ERROR("Failed to open stream");
+    return nullptr;
+  }
+  char head[64];
+  DecoderFactory factory = DetectFormat(head, stream->Peek(head, sizeof(head)));
+  if (factory == nullptr) {
+    std::string message =
+        string_format("Unrecognised stream format in %s", path.c_str());
+    TRACE_ERROR(message.c_str());
+    return nullptr;
+  }
+  std::unique_ptr<AudioDecoder> decoder = factory();
+  if (!decoder->OpenStream(stream))
+    return nullptr;
+  return decoder;
+}
+
+std::unique_ptr<AudioSink> CreateSink(const std::string& spec) {
+  if (spec == "device")
+    return std::make_unique<SimplePlayer>();
+  if (spec == "null")
+    return std::make_unique<NullSink>();
+  if (spec.compare(0, 4, "wav:") == 0 && spec.size() > 4)
+    return std::make_unique<FileSink>(spec.substr(4), true);
+  if (spec.compare(0, 4, "raw:") == 0 && spec.size() > 4)
+    return std::make_unique<FileSink>(spec.substr(4), false);
+  return nullptr;
+}
+
+// What --analyze-loudness measured: LUFS, LU and linear true peaks; NAN
+// until a file has been analysed.
+typedef struct _Loudness {
+  float integrated = NAN, range = NAN, true_peak = NAN;
+  float album_integrated = NAN, album_true_peak = NAN;
+} Loudness;
+
+// What the index remembers about one file, enough to list it without
+// opening it.
+typedef struct _IndexEntry {
+  AudioFormat format;
+  Metadata tags;
+  double duration = NAN;
+  uint64_t audio_offset = 0;
+  Loudness loudness;
+} IndexEntry;
+
+IndexEntry IndexEntry_From_Decoder(const AudioDecoder& decoder) {
+  IndexEntry entry;
+  entry.format = decoder.NativeFormat();
+  entry.tags = decoder.Tags();
+  entry.duration = decoder.Duration();
+  entry.audio_offset = decoder.AudioOffset();
+  return entry;
+}
+
+// |tags| with the gain --analyze-loudness measured wherever the file has no
+// ReplayGain of its own, aimed at the ReplayGain 2.0 reference of -18 LUFS.
+Metadata WithMeasuredGain(Metadata tags, const Loudness& loudness) {
+  const float reference = -18.0f;
+  if (isnan(tags.track_gain) && !isnan(loudness.integrated)) {
+    tags.track_gain = reference - loudness.integrated;
+    tags.track_peak = loudness.true_peak;
+  }
+  if (isnan(tags.album_gain) && !isnan(loudness.album_integrated)) {
+    tags.album_gain = reference - loudness.album_integrated;
+    tags.album_peak = loudness.album_true_peak;
+  }
+  return tags;
+}
+
+// Size and modification time, which decide whether an entry is current.
+// Costs a stat, not an open.
+bool FileStamp(const std::string& path, uint64_t* size, int64_t* mtime) {
+  std::error_code error;
+  fs::path file(path);
+  *size = fs::file_size(file, error);
+  if (error)
+    return false;
+  auto time = fs::last_write_time(file, error);
+  if (error)
+    return false;
+  *mtime = static_cast<int64_t>(time.time_since_epoch().count());
+  return true;
+}
+
+void AppendLE32(std::string* out, uint32_t value) {
+  for (int i = 0; i < 4; i++)
+    out->push_back(static_cast<char>(value >> (8 * i)));
+}
+
+void AppendLE64(std::string* out, uint64_t value) {
+  AppendLE32(out, static_cast<uint32_t>(value));
+  AppendLE32(out, static_cast<uint32_t>(value >> 32));
+}
+
+void AppendString(std::string* out, const std::string& text) {
+  AppendLE32(out, static_cast<uint32_t>(text.size()));
+  out->append(text);
+}
+
+// Bounds-checked reader over one serialised record.
+class RecordReader {
+ public:
+  RecordReader(const char* data, size_t size) : data(data), end(data + size) {}
+
+  bool ok() const { return good; }
+  uint8_t U8() {
+    return Take(1) ? static_cast<uint8_t>(data[-1]) : 0;
+  }
+  uint32_t U32() { return Take(4) ? ReadLE32(data - 4) : 0; }
+  uint64_t U64() { return Take(8) ? ReadLE64(data - 8) : 0; }
+  double F64() {
+    uint64_t bits = U64();
+    double value;
+    memcpy(&value, &bits, sizeof(value));
+    return value;
+  }
+  float F32() {
+    uint32_t bits = U32();
+    float value;
+    memcpy(&value, &bits, sizeof(value));
+    return value;
+  }
+  std::string String() {
+    uint32_t size = U32();
+    if (!Take(size))
+      return std::string();
+    return std::string(data - size, size);
+  }
+
+ private:
+  bool Take(size_t size) {
+    if (!good || static_cast<size_t>(end - data) < size) {
+      good = false;
+      return false;
+    }
+    data += size;
+    return true;
+  }
+
+  const char* data;
+  const char* end;
+  bool good = true;
+};
+
+// Persistent cache of IndexEntry keyed by path, size and mtime. The file is
+// a sorted table of path hashes, binary searched straight from the mapping,
+// followed by a journal that new entries are appended to:
+//
+//   "LPIX" version count journal   header, 4 x u32
+//   count x (u64 hash, u64 offset) table, sorted by hash
+//   records                        u32 length, then the fields
+//   journal records                same layout, newest last
+//
+// A file that changed simply stops matching its entry, which is replaced the
+// next time the file is opened. Save() folds a long journal into the table.
+class MetadataIndex {
+ public:
+  ~MetadataIndex() {
+    if (journal_file != nullptr)
+      fclose(journal_file);
+  }
+
+  // Maps |path|. A missing or foreign file leaves the index empty.
+  void Load(const std::string& path) {
+    std::lock_guard<std::mutex> lock(mutex);
+    this->path = path;
+    Map();
+  }
+
+  // Returns true and fills |entry| when |track| is indexed and unchanged.
+  bool Find(const std::string& track, IndexEntry* entry) {
+    uint64_t file_size;
+    int64_t mtime;
+    if (!FileStamp(track, &file_size, &mtime))
+      return false;
+    std::string key = Key(track);
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = pending.find(key);
+    if (it != pending.end()) {
+      return Decode(it->second.data(), it->second.size(), key, file_size,
+                    mtime, entry);
+    }
+    size_t offset = Locate(key);
+    if (offset == 0)
+      return false;
+    return Decode(data + offset + 4, ReadLE32(data + offset), key, file_size,
+                  mtime, entry);
+  }
+
+  // Records |entry| for |track| and appends it to the journal on disk, so
+  // nothing is lost if the session never ends cleanly.
+  void Update(const std::string& track, const IndexEntry& entry) {
+    uint64_t file_size;
+    int64_t mtime;
+    if (path.empty() || !FileStamp(track, &file_size, &mtime))
+      return;
+    std::string key = Key(track);
+    std::string record = Encode(key, file_size, mtime, entry);
+    std::lock_guard<std::mutex> lock(mutex);
+    pending[key] = record;
+    // The first entry of a new index writes the file the rest append to.
+    if (data == nullptr) {
+      Rewrite();
+      return;
+    }
+    std::string framed;
+    AppendLE32(&framed, static_cast<uint32_t>(record.size()));
+    framed += record;
+    // Kept open for the session, so a scan of many new files does not
+    // reopen it for each.
+    if (journal_file == nullptr)
+      journal_file = fopen(path.c_str(), "ab");
+    if (journal_file != nullptr &&
+        fwrite(framed.data(), 1, framed.size(), journal_file) == framed.size() &&
+        fflush(journal_file) == 0)
+      appended++;
+  }
+
+  // Folds the journal into the sorted table once it has grown past a small
+  // fraction of it, or when some entry never made it to disk.
+  void Save() {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (path.empty())
+      return;
+    size_t journal_size = journal.size() + appended;
+    if (pending.size() > appended || journal_size > count / 8 + 256)
+      Rewrite();
+  }
+
+ private:
+  enum { version = 2, header_size = 16, slot_size = 16 };
+
+  void Unmap() {
+    if (journal_file != nullptr) {
+      fclose(journal_file);
+      journal_file = nullptr;
+    }
+    file.Close();
+    data = nullptr;
+    size = 0;
+    count = 0;
+    journal.clear();
+  }
+
+  void Map() {
+    Unmap();
+    if (!file.Open(path))
+      return;
+    size = static_cast<size_t>(file.Size());
+    data = file.View(0, &size);
+    if (data == nullptr || size < header_size || memcmp(data, "LPIX", 4) != 0 ||
+        ReadLE32(data + 4) != version) {
+      data = nullptr;
+      return;
+    }
+    count = ReadLE32(data + 8);
+    size_t offset = ReadLE32(data + 12);
+    if (header_size + static_cast<size_t>(count) * slot_size > size ||
+        offset > size) {
+      data = nullptr;
+      count = 0;
+      return;
+    }
+    // A torn last record, from a crash mid-append, is ignored.
+    while (offset + 4 <= size) {
+      uint32_t length = ReadLE32(data + offset);
+      if (length > size - offset - 4)
+        break;
+      RecordReader reader(data + offset + 4, length);
+      journal[reader.String()] = offset;
+      offset += 4 + length;
+    }
+  }
+
+  // Writes every current record into a fresh table, aside and renamed over
+  // the old file (unmapped first, for Windows), then maps the result.
+  void Rewrite() {
+    // Latest record per path: this session's, then the journal, then the
+    // table.
+    std::map<std::string, std::string> records(pending);
+    for (auto& item : journal) {
+      if (records.count(item.first) == 0)
+        records[item.first] = RecordAt(item.second);
+    }
+    for (uint32_t i = 0; data != nullptr && i < count; i++) {
+      std::string record = RecordAt(static_cast<size_t>(
+          ReadLE64(data + header_size + i * slot_size + 8)));
+      RecordReader reader(record.data(), record.size());
+      std::string key = reader.String();
+      if (reader.ok() && records.count(key) == 0)
+        records[key] = record;
+    }
+
+    typedef std::pair<uint64_t, const std::string*> Slot;
+    std::vector<Slot> slots;
+    for (auto& item : records)
+      slots.push_back(Slot(Hash(item.first), &item.second));
+    std::sort(slots.begin(), slots.end(), [](const Slot& a, const Slot& b) {
+      return a.first < b.first;
+    });
+    std::string out("LPIX"), body;
+    size_t base = header_size + slots.size() * slot_size;
+    for (auto& slot : slots) {
+      AppendLE32(&body, static_cast<uint32_t>(slot.second->size()));
+      body += *slot.second;
+    }
+    AppendLE32(&out, version);
+    AppendLE32(&out, static_cast<uint32_t>(slots.size()));
+    AppendLE32(&out, static_cast<uint32_t>(base + body.size()));
+    size_t offset = base;
+    for (auto& slot : slots) {
+      AppendLE64(&out, slot.first);
+      AppendLE64(&out, offset);
+      offset += 4 + slot.second->size();
+    }
+    out += body;
+
+    std::error_code error;
+    fs::create_directories(fs::path(path).parent_path(), error);
+    std::string temporary = path + ".tmp";
+    FILE* file_out = fopen(temporary.c_str(), "wb");
+    if (file_out == nullptr)
+      return;
+    bool written = fwrite(out.data(), 1, out.size(), file_out) == out.size();
+    written = (fclose(file_out) == 0) && written;
+    Unmap();
+    if (written)
+      fs::rename(fs::path(temporary), fs::path(path), error);
+    if (!written || error) {
+      remove(temporary.c_str());
+    } else {
+      pending.clear();
+      appended = 0;
+    }
+    Map();
+  }
+
+  static std::string Key(const std::string& track) {
+    return fs::absolute(fs::path(track)).string();
+  }
+
+  // FNV-1a; only needs to spread paths evenly.
+  static uint64_t Hash(const std::string& key) {
+    uint64_t hash = 0xcbf29ce484222325ull;
+    for (unsigned char c : key)
+      hash = (hash ^ c) * 0x100000001b3ull;
+    return hash;
+  }
+
+  // Offset of the newest record for |key| in the mapping, or 0.
+  size_t Locate(const std::string& key) {
+    if (data == nullptr)
+      return 0;
+    auto it = journal.find(key);
+    if (it != journal.end())
+      return it->second;
+    uint64_t hash = Hash(key);
+    uint32_t low = 0, high = count;
+    while (low < high) {
+      uint32_t middle = low + (high - low) / 2;
+      if (ReadLE64(data + header_size + middle * slot_size) < hash)
+        low = middle + 1;
+      else
+        high = middle;
+    }
+    for (; low < count; low++) {
+      const char* slot = data + header_size + low * slot_size;
+      if (ReadLE64(slot) != hash)
+        break;
+      size_t offset = static_cast<size_t>(ReadLE64(slot + 8));
+      std::string record = RecordAt(offset);
+      RecordReader reader(record.data(), record.size());
+      if (reader.String() == key)
+        return offset;
+    }
+    return 0;
+  }
+
+  std::string RecordAt(size_t offset) const {
+    if (offset + 4 > size)
+      return std::string();
+    uint32_t length = ReadLE32(data + offset);
+    if (length > size - offset - 4)
+      return std::string();
+    return std::string(data + offset + 4, length);
+  }
+
+  static std::string Encode(const std::string& key,
+                            uint64_t file_size,
+                            int64_t mtime,
+                            const IndexEntry& entry) {
+    std::string out;
+    AppendString(&out, key);
+    AppendLE64(&out, file_size);
+    AppendLE64(&out, static_cast<uint64_t>(mtime));
+    const AudioFormat& fmt = entry.format;
+    AppendLE32(&out, static_cast<uint32_t>(fmt.channels));
+    AppendLE32(&out, static_cast<uint32_t>(fmt.encoding));
+    AppendLE32(&out, static_cast<uint32_t>(fmt.sample_rate));
+    AppendLE32(&out, static_cast<uint32_t>(fmt.bits_per_sample));
+    AppendLE32(&out, fmt.is_float ? 1 : 0);
+    AppendLE32(&out, static_cast<uint32_t>(fmt.layout.count));
+    for (int i = 0; i < fmt.layout.count; i++)
+      out.push_back(static_cast<char>(fmt.layout.speakers[i]));
+    uint64_t bits;
+    memcpy(&bits, &entry.duration, sizeof(bits));
+    AppendLE64(&out, bits);
+    AppendLE64(&out, entry.audio_offset);
+    const Metadata& tags = entry.tags;
+    for (const std::string* text : {&tags.artist, &tags.title, &tags.year,
+                                    &tags.genre, &tags.comment, &tags.album})
+      AppendString(&out, *text);
+    const Loudness& loudness = entry.loudness;
+    for (float value : {tags.track_gain, tags.album_gain, tags.track_peak,
+                        tags.album_peak, loudness.integrated, loudness.range,
+                        loudness.true_peak, loudness.album_integrated,
+                        loudness.album_true_peak}) {
+      uint32_t value_bits;
+      memcpy(&value_bits, &value, sizeof(value_bits));
+      AppendLE32(&out, value_bits);
+    }
+    return out;
+  }
+
+  static bool Decode(const char* record,
+                     size_t length,
+                     const std::string& key,
+                     uint64_t file_size,
+                     int64_t mtime,
+                     IndexEntry* entry) {
+    RecordReader reader(record, length);
+    if (reader.String() != key || reader.U64() != file_size ||
+        static_cast<int64_t>(reader.U64()) != mtime)
+      return false;
+    AudioFormat& fmt = entry->format;
+    fmt.channels = static_cast<int>(reader.U32());
+    fmt.encoding = static_cast<int>(reader.U32());
+    fmt.sample_rate = static_cast<int>(reader.U32());
+    fmt.bits_per_sample = static_cast<int>(reader.U32());
+    fmt.is_float = reader.U32() != 0;
+    uint32_t speakers = reader.U32();
+    if (speakers > 8)
+      return false;
+    fmt.layout.count = static_cast<int>(speakers);
+    for (uint32_t i = 0; i < speakers; i++)
+      fmt.layout.speakers[i] = static_cast<Speaker>(reader.U8());
+    entry->duration = reader.F64();
+    entry->audio_offset = reader.U64();
+    Metadata& tags = entry->tags;
+    for (std::string* text : {&tags.artist, &tags.title, &tags.year,
+                              &tags.genre, &tags.comment, &tags.album})
+      *text = reader.String();
+    tags.track_gain = reader.F32();
+    tags.album_gain = reader.F32();
+    tags.track_peak = reader.F32();
+    tags.album_peak = reader.F32();
+    Loudness& loudness = entry->loudness;
+    loudness.integrated = reader.F32();
+    loudness.range = reader.F32();
+    loudness.true_peak = reader.F32();
+    loudness.album_integrated = reader.F32();
+    loudness.album_true_peak = reader.F32();
+    return reader.ok();
+  }
+
+  std::mutex mutex;
+  std::string path;
+  MappedFile file;
+  const char* data = nullptr;
+  size_t size = 0;
+  uint32_t count = 0;
+  // Journal records found in the mapping, by path.
+  std::map<std::string, size_t> journal;
+  // This session's entries, and how many of them reached the journal.
+  std::map<std::string, std::string> pending;
+  size_t appended = 0;
+  FILE* journal_file = nullptr;
+};
+
+// $XDG_CACHE_HOME/looper/index (~/.cache) or %LOCALAPPDATA%\looper\index.
+std::string DefaultIndexPath() {
+#ifdef _WIN32
+  const char* base = getenv("LOCALAPPDATA");
+  if (base == nullptr)
+    return std::string();
+  return (fs::path(base) / "looper" / "index").string();
+#elif __linux__
+  const char* cache = getenv("XDG_CACHE_HOME");
+  const char* home = getenv("HOME");
+  if (cache != nullptr && cache[0] != '\0')
+    return (fs::path(cache) / "looper" / "index").string();
+  if (home == nullptr)
+    return std::string();
+  return (fs::path(home) / ".cache" / "looper" / "index").string();
+#endif
+}
+
+MetadataIndex& GetMetadataIndex() {
+  static MetadataIndex index;
+  return index;
+}
+
+// Runs tasks on a fixed set of threads. Every worker has its own deque: it
+// takes its newest task first, and an idle worker steals the oldest task of
+// another, so a directory walk stays local until someone runs dry.
+class WorkStealingPool {
+ public:
+  typedef std::function<void()> Task;
+
+  explicit WorkStealingPool(unsigned threads) : queues((std::max)(threads, 1u)) {}
+
+  unsigned Threads() const { return static_cast<unsigned>(queues.size()); }
+
+  // From a task, queues on the calling worker; otherwise round-robin.
+  void Submit(Task task) {
+    size_t target = (CurrentPool() == this)
+                        ? CurrentWorker()
+                        : next_queue++ % queues.size();
+    pending++;
+    {
+      std::lock_guard<std::mutex> lock(queues[target].mutex);
+      queues[target].tasks.push_back(std::move(task));
+      queued++;
+    }
+    Wake(false);
+  }
+
+  // Returns once every task, including those submitted while running, has
+  // finished.
+  void Run() {
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < queues.size(); i++)
+      threads.emplace_back(&WorkStealingPool::Work, this, i);
+    Work(0);
+    for (auto& thread : threads)
+      thread.join();
+  }
+
+ private:
+  typedef struct _Queue {
+    std::mutex mutex;
+    std::deque<Task> tasks;
+  } Queue;
+
+  static WorkStealingPool*& CurrentPool() {
+    static thread_local WorkStealingPool* pool = nullptr;
+    return pool;
+  }
+
+  static size_t& CurrentWorker() {
+    static thread_local size_t worker = 0;
+    return worker;
+  }
+
+  bool Take(size_t self, Task* task) {
+    {
+      std::lock_guard<std::mutex> lock(queues[self].mutex);
+      if (!queues[self].tasks.empty()) {
+        *task = std::move(queues[self].tasks.back());
+        queues[self].tasks.pop_back();
+        queued--;
+        return true;
+      }
+    }
+    for (size_t i = 1; i < queues.size(); i++) {
+      Queue& victim = queues[(self + i) % queues.size()];
+      std::lock_guard<std::mutex> lock(victim.mutex);
+      if (!victim.tasks.empty()) {
+        *task = std::move(victim.tasks.front());
+        victim.tasks.pop_front();
+        queued--;
+        return true;
+      }
+    }
+    return false;
+  }
+
+  void Work(size_t self) {
+    WorkStealingPool* previous_pool = CurrentPool();
+    size_t previous_worker = CurrentWorker();
+    CurrentPool() = this;
+    CurrentWorker() = self;
+    while (pending > 0) {
+      Task task;
+      if (!Take(self, &task)) {
+        // Someone is still running a task that may submit more; sleep until
+        // it does or the last one finishes.
+        std::unique_lock<std::mutex> lock(idle_mutex);
+        idle.wait(lock, [this]() { return pending == 0 || queued > 0; });
+        continue;
+      }
+      task();
+      if (--pending == 0)
+        Wake(true);
+    }
+    CurrentPool() = previous_pool;
+    CurrentWorker() = previous_worker;
+  }
+
+  // Passing through the mutex orders the change to the counters before an
+  // idle worker's next look at them.
+  void Wake(bool all) {
+    { std::lock_guard<std::mutex> lock(idle_mutex); }
+    if (all)
+      idle.notify_all();
+    else
+      idle.notify_one();
+  }
+
+  std::vector<Queue> queues;
+  // Tasks submitted and not yet finished, and those not yet taken.
+  std::atomic<size_t> pending{0}, next_queue{0}, queued{0};
+  std::mutex idle_mutex;
+  std::condition_variable idle;
+};
+
+std::string LowerExtension(const std::string& path) {
+  std::string extension = fs::path(path).extension().string();
+  std::transform(extension.begin(), extension.end(), extension.begin(),
+                 [](char c) { return static_cast<char>(tolower(c)); });
+  return extension;
+}
+
+// The player for |path|, by its extension in any case, or nullptr.
+DecoderFactory FindPlayer(const PlayerRegistry& registry,
+                          const std::string& path) {
+  auto it = registry.find(LowerExtension(path));
+  return (it == registry.end()) ? nullptr : it->second;
+}
+
+// Every playable file below |root|, each directory listed by its own task.
+// The result is sorted, so the order never depends on the filesystem or on
+// which thread got where first.
+std::vector<std::string> ScanDirectory(const std::string& root,
+                                       const PlayerRegistry& registry,
+                                       WorkStealingPool* pool) {
+  std::mutex mutex;
+  std::vector<std::string> found;
+  std::function<void(fs::path)> walk = [&](fs::path directory) {
+    std::vector<std::string> files;
+    std::error_code error;
+    for (fs::directory_iterator it(directory, error), end; !error && it != end;
+         it.increment(error)) {
+      const fs::path& entry = it->path();
+      std::error_code status_error;
+      // Directory symlinks are not followed, so a cycle cannot trap the walk.
+      if (fs::is_directory(it->symlink_status(status_error))) {
+        pool->Submit([&walk, entry]() { walk(entry); });
+      } else if (FindPlayer(registry, entry.string()) != nullptr) {
+        files.push_back(entry.string());
+      }
+    }
+    std::lock_guard<std::mutex> lock(mutex);
+    found.insert(found.end(), files.begin(), files.end());
+  };
+  pool->Submit([&walk, root]() { walk(fs::path(root)); });
+  pool->Run();
+  std::sort(found.begin(), found.end());
+  return found;
+}
+
+// One file of a scan, identified and read without playing it.
+typedef struct _ProbeResult {
+  std::string path;
+  DecoderFactory factory = nullptr;
+  bool ok = false;
+  // Answered by the metadata index instead of opening the file.
+  bool cached = false;
+  IndexEntry entry;
+} ProbeResult;
+
+void ProbeFile(ProbeResult* result) {
+  if (result->factory == nullptr)
+    return;
+  MetadataIndex& index = GetMetadataIndex();
+  if (index.Find(result->path, &result->entry)) {
+    result->ok = result->cached = true;
+    return;
+  }
+  std::unique_ptr<AudioDecoder> decoder = result->factory();
+  if (!decoder->Open(result->path))
+    return;
+  result->entry = IndexEntry_From_Decoder(*decoder);
+  decoder->Close();
+  index.Update(result->path, result->entry);
+  result->ok = true;
+}
+
+// Runs |fn| on every one of |results| across |pool|, in place, with
+// decoder logging silenced. Returns the seconds it took.
+template <typename Result>
+double RunOnPool(std::vector<Result>* results,
+                 void (*fn)(Result*),
+                 WorkStealingPool* pool) {
+  auto start = std::chrono::steady_clock::now();
+  for (auto& result : *results) {
+    Result* target = &result;
+    pool->Submit([target, fn]() {
+      TraceMessage::Muted() = true;
+      fn(target);
+      TraceMessage::Muted() = false;
+    });
+  }
+  pool->Run();
+  return (std::max)(std::chrono::duration<double>(
+                        std::chrono::steady_clock::now() - start)
+                        .count(),
+                    1e-9);
+}
+
+std::string JsonString(const std::string& text) {
+  std::string out = "\"";
+  for (unsigned char c : text) {
+    if (c == '"' || c == '\\') {
+      out += '\\';
+      out += static_cast<char>(c);
+    } else if (c < 0x20) {
+      out += string_format("\\u%04x", c);
+    } else {
+      out += static_cast<char>(c);
+    }
+  }
+  return out + "\"";
+}
+
+std::string JsonNumber(double value) {
+  return isnan(value) ? "null" : string_format("%.6g", value);
+}
+
+// One line of --probe output.
+std::string ProbeResult_To_Json(const ProbeResult& result) {
+  std::string line = "{\"path\":" + JsonString(result.path);
+  if (!result.ok)
+    return line + ",\"error\":\"cannot open\"}";
+  const AudioFormat& fmt = result.entry.format;
+  const Metadata& tags = result.entry.tags;
+  line += string_format(
+      ",\"channels\":%d,\"sample_rate\":%d,\"bits\":%d,\"float\":%s",
+      fmt.channels, fmt.sample_rate, fmt.bits_per_sample,
+      fmt.is_float ? "true" : "false");
+  line += ",\"duration\":" + JsonNumber(result.entry.duration);
+  line += ",\"title\":" + JsonString(tags.title);
+  line += ",\"artist\":" + JsonString(tags.artist);
+  line += ",\"album\":" + JsonString(tags.album);
+  line += ",\"year\":" + JsonString(tags.year);
+  line += ",\"genre\":" + JsonString(tags.genre);
+  line += ",\"track_gain\":" + JsonNumber(tags.track_gain);
+  line += ",\"album_gain\":" + JsonNumber(tags.album_gain);
+  line += string_format(",\"cached\":%s}", result.cached ? "true" : "false");
+  return line;
+}
+
+// Opens |path| for a batch run: a stream by its content, a file through
+// |factory|. |file_bytes|, when given, is set to the size of a file.
+// Returns nullptr if it cannot be opened.
+std::unique_ptr<AudioDecoder> OpenForBatch(const std::string& path,
+                                           DecoderFactory factory,
+                                           uint64_t* file_bytes) {
+  if (IsStreamInput(path))
+    return OpenStreamInput(path);
+  if (factory == nullptr)
+    return nullptr;
+  std::unique_ptr<AudioDecoder> decoder = factory();
+  if (!decoder->Open(path))
+    return nullptr;
+  if (file_bytes != nullptr) {
+    std::error_code error;
+    *file_bytes = fs::file_size(fs::path(path), error);
+    if (error)
+      *file_bytes = 0;
+  }
+  return decoder;
+}
+
+// Seconds of audio in |bytes| of PCM.
+double PcmSeconds(const AudioFormat& fmt, size_t bytes) {
+  return static_cast<double>(bytes) /
+         (fmt.channels * fmt.bits_per_sample / 8) / fmt.sample_rate;
+}
+
+// The end every batch summary shares: how long, how wide and how fast.
+std::string BatchSpeed(double seconds,
+                       unsigned threads,
+                       uint64_t bytes,
+                       double audio_seconds) {
+  return string_format("in %.2f s on %u threads, %.1f MB/s, %.0fx realtime",
+                       seconds, threads, bytes / seconds / 1e6,
+                       audio_seconds / seconds);
+}
+
+// One file of a --verify run.
+typedef struct _VerifyResult {
+  std::string path;
+  DecoderFactory factory = nullptr;
+  bool opened = false;
+  uint64_t file_bytes = 0;
+  double audio_seconds = 0.0;
+  size_t error_count = 0;
+  std::vector<StreamError> errors;
+} VerifyResult;
+
+// Decodes the whole file and throws the samples away; what counts is what
+// the decoder ran into on the way.
+void VerifyFile(VerifyResult* result) {
+  std::unique_ptr<AudioDecoder> decoder =
+      OpenForBatch(result->path, result->factory, &result->file_bytes);
+  if (!decoder)
+    return;
+  result->opened = true;
+  PooledBuffer buffer(decoder->BufferSize());
+  for (;;) {
+    const char* data;
+    size_t read_bytes = decoder->ReadSpan(buffer.Data(), buffer.Size(), &data);
+    if (read_bytes == 0)
+      break;
+    result->audio_seconds += PcmSeconds(decoder->Format(), read_bytes);
+  }
+  decoder->Verify();
+  result->error_count = decoder->ErrorCount();
+  result->errors = decoder->Errors();
+  decoder->Close();
+}
+
+// One file of an --export run.
+typedef struct _ExportResult {
+  std::string path;
+  DecoderFactory factory = nullptr;
+  std::string output;
+  bool ok = false;
+  uint64_t file_bytes = 0;
+  uint64_t pcm_bytes = 0;
+  double audio_seconds = 0.0;
+} ExportResult;
+
+// Decodes the file into result->output through a FileSink, so the samples
+// come out in WAVE channel order, as they would with --output=wav:.
+void ExportFile(ExportResult* result) {
+  std::unique_ptr<AudioDecoder> decoder =
+      OpenForBatch(result->path, result->factory, &result->file_bytes);
+  if (!decoder)
+    return;
+  FileSink sink(result->output, GetOptions().export_format == "wav", false);
+  PooledBuffer buffer(decoder->BufferSize());
+  for (;;) {
+    const char* data;
+    size_t read_bytes = decoder->ReadSpan(buffer.Data(), buffer.Size(), &data);
+    if (read_bytes == 0 || sink.Failed())
+      break;
+    const AudioFormat& fmt = decoder->Format();
+    sink.Configure(fmt);
+    sink.WriteAudio(data, read_bytes);
+    result->audio_seconds += PcmSeconds(fmt, read_bytes);
+  }
+  decoder->Close();
+  sink.Finish();
+  result->pcm_bytes = sink.BytesWritten();
+  result->ok = !sink.Failed() && result->pcm_bytes > 0;
+}
+
+// Names the output of every result in |dir| after its input, with a
+// counter for inputs from different directories that share a name.
+void NameExports(std::vector<ExportResult>* results, const std::string& dir) {
+  std::string extension = (GetOptions().export_format == "wav") ? ".wav"
+                                                                 : ".raw";
+  std::set<std::string> taken;
+  for (auto& result : *results) {
+    std::string stem = IsStreamInput(result.path)
+                           ? "stdin"
+                           : fs::path(result.path).stem().string();
+    std::string name = stem + extension;
+    for (int i = 2; !taken.insert(name).second; i++)
+      name = stem + string_format("-%d", i) + extension;
+    result.output = (fs::path(dir) / name).string();
+  }
+}
+
+// One file of an --analyze-loudness run. The album figures are filled in
+// once every track is done.
+typedef struct _LoudnessResult {
+  std::string path;
+  DecoderFactory factory = nullptr;
+  bool ok = false;
+  IndexEntry entry;
+  std::vector<double> blocks;
+  uint64_t file_bytes = 0;
+  double audio_seconds = 0.0;
+} LoudnessResult;
+
+// Decodes the file through a LoudnessMeter. The entry is taken as the file
+// opens, so it matches what playback would index.
+void AnalyzeFile(LoudnessResult* result) {
+  std::unique_ptr<AudioDecoder> decoder =
+      OpenForBatch(result->path, result->factory, &result->file_bytes);
+  if (!decoder)
+    return;
+  result->entry = IndexEntry_From_Decoder(*decoder);
+  LoudnessMeter meter;
+  AudioFormat measured = decoder->Format();
+  meter.Configure(measured);
+  PooledBuffer buffer(decoder->BufferSize());
+  std::vector<float> samples;
+  for (;;) {
+    const char* data;
+    size_t read_bytes = decoder->ReadSpan(buffer.Data(), buffer.Size(), &data);
+    if (read_bytes == 0)
+      break;
+    const AudioFormat& fmt = decoder->Format();
+    if (!SameFormat(fmt, measured)) {
+      measured = fmt;
+      meter.Configure(measured);
+    }
+    size_t count = read_bytes / (fmt.bits_per_sample / 8);
+    samples.resize(count);
+    LoadFloatSamples(data, fmt, count, 1.0f, samples.data());
+    meter.Process(samples.data(), count / fmt.channels);
+    result->audio_seconds += PcmSeconds(fmt, read_bytes);
+  }
+  decoder->Close();
+  Loudness& loudness = result->entry.loudness;
+  loudness.integrated = static_cast<float>(meter.Integrated());
+  loudness.range = static_cast<float>(meter.Range());
+  loudness.true_peak = static_cast<float>(meter.TruePeak());
+  loudness.album_integrated = loudness.integrated;
+  loudness.album_true_peak = loudness.true_peak;
+  result->blocks = meter.Blocks();
+  result->ok = true;
+}
+
+// Gives tracks that share a directory and an album tag the loudness of the
+// whole album, gated over all of their blocks as one programme. Tracks with
+// no album tag stay their own album.
+void MeasureAlbums(std::vector<LoudnessResult>* results) {
+  std::map<std::string, std::vector<LoudnessResult*>> albums;
+  for (auto& result : *results) {
+    if (!result.ok || result.entry.tags.album.empty())
+      continue;
+    std::string key = fs::path(result.path).parent_path().string() + '\0' +
+                      result.entry.tags.album;
+    albums[key].push_back(&result);
+  }
+  for (auto& album : albums) {
+    std::vector<double> blocks;
+    float true_peak = 0.0f;
+    for (LoudnessResult* track : album.second) {
+      blocks.insert(blocks.end(), track->blocks.begin(), track->blocks.end());
+      true_peak = (std::max)(true_peak, track->entry.loudness.true_peak);
     }
-  };
+    float integrated =
+        static_cast<float>(LoudnessMeter::GatedLoudness(blocks));
+    for (LoudnessResult* track : album.second) {
+      track->entry.loudness.album_integrated = integrated;
+      track->entry.loudness.album_true_peak = true_peak;
+    }
+  }
+}
 
-  mpg123_scan(mh);
-  AudioResult meta_result = mpg123_meta_check(mh);
+// The --analyze-loudness line of one file: integrated loudness, loudness
+// range, true peak and the ReplayGain that playback derives from them.
+std::string LoudnessResult_To_String(const LoudnessResult& result) {
+  const Loudness& loudness = result.entry.loudness;
+  // Nothing above the -70 LUFS gate, or shorter than one 400 ms block.
+  if (isnan(loudness.integrated))
+    return "silent  " + result.path + "\n";
+  Metadata gain = WithMeasuredGain(Metadata(), loudness);
+  // Too short or too even for a range.
+  std::string range = isnan(loudness.range)
+                          ? std::string("    -")
+                          : string_format("%5.1f", loudness.range);
+  return string_format(
+      "%6.1f LUFS %s LU %6.1f dBTP  track %+6.2f dB  album %+6.2f dB  %s\n",
+      loudness.integrated, range.c_str(), 20.0 * log10(loudness.true_peak),
+      gain.track_gain, gain.album_gain, result.path.c_str());
+}
 
-  if (meta_result & MPG123_ID3) {
-    mpg123_id3v1* v1;
-    mpg123_id3v2* v2;
-    AudioResult id3_result = mpg123_id3(mh, &v1, &v2);
-    if (id3_result == MPG123_OK) {
-      if (v1 != nullptr) {
-        mt.title = v1->title;
-        mt.artist = v1->artist;
-        mt.album = v1->album;
-        mt.year = v1->year;
-        mt.comment = v1->comment;
-        mt.genre = v1->genre;
-      } else if (v2 != nullptr) {
-        copy_field(mt.title, v2->title);
-        copy_field(mt.artist, v2->artist);
-        copy_field(mt.album, v2->album);
-        copy_field(mt.year, v2->year);
-        copy_field(mt.comment, v2->comment);
-        copy_field(mt.genre, v2->genre);
-      }
-    }
+// The --verify report of one file: a status line, then one per problem.
+std::string VerifyResult_To_String(const VerifyResult& result) {
+  if (!result.opened)
+    return "UNREADABLE  " + result.path + "\n";
+  if (result.error_count == 0)
+    return "OK  " + result.path + "\n";
+  std::string text = "CORRUPT  " + result.path + "\n";
+  for (auto& error : result.errors)
+    text += "  " + StreamError_To_String(error) + "\n";
+  if (result.error_count > result.errors.size()) {
+    text += string_format("  and %zu more\n",
+                          result.error_count - result.errors.size());
   }
-  return mt;
+  return text;
 }
 
-class MP3Player : public SimplePlayer {
+// The tracks of a session. Path bytes live back to back in one arena and
+// each track is a fixed-size record pointing into it, so a playlist costs
+// about its path bytes however many entries it has. Paths read from a
+// playlist file stay as written and are resolved against the playlist's
+// directory only when the track is reached.
+class Playlist {
  public:
-  void play(const std::string& path) {
-    MPG123Handle* mh;
-
-    size_t buffer_size, read_bytes;
+  explicit Playlist(const PlayerRegistry& registry) : registry(registry) {}
 
-    AudioResult result = MPG123_OK;
+  size_t Size() const { return tracks.size(); }
 
-    result = mpg123_init();
+  // Appends a path named directly, which is already relative to the current
+  // directory.
+  void Add(const std::string& path) { Intern(path.data(), path.size(), none); }
 
-    if (result != MPG123_OK) {
-      std::string message =
-          string_format("mpg123_init error: %s", ErrorCodeToString(result));
-      TRACE_ERROR(message.c_str());
-      AudioExitProcess(AudioStatus::kIoError);
+  // Appends the entries of an M3U, M3U8 or PLS file. The file is read in
+  // fixed chunks, so only the arena grows with its length.
+  bool Load(const std::string& path) {
+#ifdef _WIN32
+    FILE* file = _wfopen(to_wstring(path.c_str()).c_str(), L"rb");
+#else
+    FILE* file = fopen(path.c_str(), "rb");
+#endif
+    if (file == nullptr)
+      return false;
+    bool pls = IsPls(path);
+    size_t slash = path.find_last_of(Separators());
+    std::string directory =
+        (slash == std::string::npos) ? "" : path.substr(0, slash + 1);
+    uint32_t base = static_cast<uint32_t>(bases.size());
+    bases.push_back({static_cast<uint32_t>(arena.size()),
+                     static_cast<uint32_t>(directory.size())});
+    arena.insert(arena.end(), directory.begin(), directory.end());
+    // The entries cannot take more than the file itself, so the arena is
+    // sized once up front rather than regrown as lines arrive.
+    uint64_t file_size;
+    int64_t mtime;
+    if (FileStamp(path, &file_size, &mtime))
+      arena.reserve(arena.size() + static_cast<size_t>(file_size));
+
+    // |chunk| holds the unfinished line of the previous read at its front.
+    std::vector<char> chunk(1 << 16);
+    size_t held = 0;
+    bool first = true;
+    for (;;) {
+      if (held == chunk.size())
+        chunk.resize(chunk.size() * 2);
+      size_t read_bytes = fread(&chunk[held], 1, chunk.size() - held, file);
+      size_t end = held + read_bytes, start = 0;
+      const char* scan = &chunk[held];
+      while (const char* newline = static_cast<const char*>(
+                 memchr(scan, '\n', &chunk[0] + end - scan))) {
+        Line(&chunk[start], newline - &chunk[start], pls, base, first);
+        first = false;
+        start = newline + 1 - &chunk[0];
+        scan = newline + 1;
+      }
+      if (read_bytes == 0) {
+        Line(&chunk[start], end - start, pls, base, first);
+        break;
+      }
+      held = end - start;
+      memmove(&chunk[0], &chunk[start], held);
     }
+    bool ok = !ferror(file);
+    fclose(file);
+    return ok;
+  }
 
-    mh = mpg123_new(nullptr, &result);
+  // Track |index| as a path that can be opened from the current directory.
+  std::string Path(size_t index) const {
+    const Track& track = tracks[index];
+    std::string path(&arena[track.offset], track.length);
+    if (track.base == none || IsAbsolute(path))
+      return path;
+    const Span& base = bases[track.base];
+    return std::string(&arena[base.offset], base.length) + path;
+  }
 
-    if (result != MPG123_OK) {
-      std::string message =
-          string_format("mpg123_new error: %s", ErrorCodeToString(result));
-      TRACE_ERROR(message.c_str());
-      Cleanup(mh);
-      AudioExitProcess(AudioStatus::kIoError);
-    }
+  // Track |index| resolved, with the player for its extension, or nullptr
+  // when no player takes it.
+  std::pair<std::string, DecoderFactory> At(size_t index) const {
+    std::string path = Path(index);
+    DecoderFactory factory = FindPlayer(registry, path);
+    return std::make_pair(path, factory);
+  }
 
-    result = mpg123_open(mh, path.c_str());
+  static bool IsPlaylist(const std::string& path) {
+    std::string extension = LowerExtension(path);
+    return extension == ".m3u" || extension == ".m3u8" || IsPls(path);
+  }
 
-    if (result != MPG123_OK) {
-      std::string message =
-          string_format("Cannot open file: %s", HandleErrorToString(mh));
-      TRACE_ERROR(message.c_str());
-      Cleanup(mh);
-      AudioExitProcess(AudioStatus::kIoError);
-    } else {
-      std::string message = string_format("Opened %s", path.c_str());
-      TRACE_INFO(message.c_str());
-    }
+ private:
+  typedef struct _Span {
+    uint32_t offset;
+    uint32_t length;
+  } Span;
 
-    PrintPlayingInfo(Metadata_From_Handle(mh));
+  typedef struct _Track {
+    uint32_t offset;
+    uint32_t length;
+    uint32_t base;
+  } Track;
 
-    buffer_size = mpg123_outblock(mh);
-    std::string buffer(buffer_size, '\0');
-    SetFormat(Format_From_MPG123Handle(mh));
+  static const uint32_t none = 0xffffffff;
 
+  static const char* Separators() {
 #ifdef _WIN32
-    SetupBlocks();
+    return "/\\";
+#else
+    return "/";
 #endif
+  }
 
-    Open();
+  static bool IsPls(const std::string& path) {
+    return LowerExtension(path) == ".pls";
+  }
 
-    while (mpg123_read(mh, reinterpret_cast<unsigned char*>(&buffer[0]),
-                       buffer_size, &read_bytes) == MPG123_OK) {
-      if (read_bytes <= 0)
-        break;
-#ifdef _WIN32
-      WriteAudio(&buffer[0], read_bytes);
-#elif __linux__
-      frames = bytes_to_frames(read_bytes);
-      WriteAudio(&buffer[0], frames);
-#endif
+  static bool HasPrefix(const char* data, size_t size, const char* prefix) {
+    size_t length = strlen(prefix);
+    if (size < length)
+      return false;
+    for (size_t i = 0; i < length; i++) {
+      if (tolower(static_cast<unsigned char>(data[i])) != prefix[i])
+        return false;
     }
+    return true;
+  }
 
+  static bool IsAbsolute(const std::string& path) {
 #ifdef _WIN32
-    FreeBlocks();
+    if (path.size() >= 2 && isalpha(static_cast<unsigned char>(path[0])) &&
+        path[1] == ':')
+      return true;
+    return !path.empty() && (path[0] == '\\' || path[0] == '/');
+#else
+    return !path.empty() && path[0] == '/';
 #endif
-
-    Cleanup(mh);
-    Close();
-    print_color("Done Playing Song\n\n", Color::light_yellow);
   }
 
-  const char* ErrorCodeToString(int error_code) {
-    return mpg123_plain_strerror(error_code);
-  }
-  const char* HandleErrorToString(MPG123Handle* mh) {
-    return mpg123_strerror(mh);
+  // One line of a playlist file: comments, #EXT tags, PLS keys other than
+  // FileN and streams are skipped, file:// URLs are taken as local paths.
+  void Line(const char* data, size_t size, bool pls, uint32_t base, bool first) {
+    if (first && size >= 3 && memcmp(data, "\xEF\xBB\xBF", 3) == 0) {
+      data += 3;
+      size -= 3;
+    }
+    while (size > 0 && isspace(static_cast<unsigned char>(data[size - 1])))
+      size--;
+    while (size > 0 && isspace(static_cast<unsigned char>(*data))) {
+      data++;
+      size--;
+    }
+    if (size == 0 || (!pls && data[0] == '#'))
+      return;
+    if (pls) {
+      if (!HasPrefix(data, size, "file") || size < 5 ||
+          !isdigit(static_cast<unsigned char>(data[4])))
+        return;
+      const char* equals =
+          static_cast<const char*>(memchr(data, '=', size));
+      if (equals == nullptr)
+        return;
+      size -= equals + 1 - data;
+      data = equals + 1;
+    }
+    if (HasPrefix(data, size, "file://")) {
+      data += 7;
+      size -= 7;
+    } else if (std::search(data, data + size, "://", "://" + 3) != data + size) {
+      return;
+    }
+    Intern(data, size, base);
   }
 
-  void Cleanup(MPG123Handle* mh) {
-    mpg123_close(mh);
-    mpg123_delete(mh);
-    mpg123_exit();
+  void Intern(const char* data, size_t size, uint32_t base) {
+    if (size == 0)
+      return;
+    tracks.push_back({static_cast<uint32_t>(arena.size()),
+                      static_cast<uint32_t>(size), base});
+    arena.insert(arena.end(), data, data + size);
   }
+
+  const PlayerRegistry& registry;
+  std::vector<char> arena;
+  std::vector<Track> tracks;
+  std::vector<Span> bases;
 };
 
-typedef vorbis_info VorbisInfo;
-typedef vorbis_comment VorbisComment;
+// One batch result per track of |playlist|, with its path and player.
+template <typename Result>
+std::vector<Result> BatchResults(const Playlist& playlist) {
+  std::vector<Result> results(playlist.Size());
+  for (size_t i = 0; i < results.size(); i++) {
+    auto entry = playlist.At(i);
+    results[i].path = entry.first;
+    results[i].factory = entry.second;
+  }
+  return results;
+}
 
-AudioFormat Format_From_VorbisFile(OggVorbis_File* vf) {
-  AudioFormat fmt;
-  VorbisInfo* vi = ov_info(vf, -1);
-  if (vi != nullptr) {
-    fmt.channels = vi->channels;
-    fmt.sample_rate = vi->rate;
-    fmt.bits_per_sample = 16;
+// A track opened ahead of time, with the start of its audio already decoded.
+typedef struct _PreparedTrack {
+  std::unique_ptr<AudioDecoder> decoder;
+  PooledBuffer preroll;
+  // Frames left before --end once the preroll has played.
+  uint64_t remaining = UINT64_MAX;
+  // Where the decoder stands, in frames from the start of the track.
+  uint64_t position = 0;
+  // From the index, for files without ReplayGain tags.
+  Loudness loudness;
+} PreparedTrack;
+
+// Opens |path| through a read-ahead stream rather than by name. The buffer
+// starts at the default size, which covers the headers, and is then sized to
+// --read-ahead seconds at the file's average bitrate.
+bool OpenReadAhead(AudioDecoder* decoder, const std::string& path) {
+  auto stream = std::make_shared<InputStream>();
+  if (!stream->Open(path)) {
+    TRACE_ERROR("Failed to open file");
+    return false;
   }
-  return fmt;
-};
+  if (!decoder->OpenStream(stream))
+    return false;
+  // Without a stated length, assume uncompressed PCM, the worst case.
+  const AudioFormat& fmt = decoder->Format();
+  double duration = decoder->Duration();
+  double byte_rate = (duration > 0.0)
+                         ? stream->Size() / duration
+                         : static_cast<double>(fmt.sample_rate) *
+                               fmt.channels * fmt.bits_per_sample / 8;
+  double bytes = GetOptions().read_ahead_seconds * byte_rate;
+  // At least one full read, at most 64 MiB.
+  stream->SetReadAhead(
+      static_cast<size_t>((std::min)((std::max)(bytes, 0x40000 * 2.0),
+                                     static_cast<double>(0x4000000))));
+  return true;
+}
 
-void MetaAppendField(Metadata* meta, std::string& key, std::string& value) {
-  if (APP_STRNCASECMP(key.c_str(), "artist") == 0) {
-    meta->artist.append(value);
-  } else if (APP_STRNCASECMP(key.c_str(), "title") == 0) {
-    meta->title.append(value);
-  } else if (APP_STRNCASECMP(key.c_str(), "year") == 0) {
-    meta->year.append(value);
-  } else if (APP_STRNCASECMP(key.c_str(), "date") == 0) {
-    meta->year.append(value);
-  } else if (APP_STRNCASECMP(key.c_str(), "genre") == 0) {
-    meta->genre.append(value);
-  } else if (APP_STRNCASECMP(key.c_str(), "album") == 0) {
-    meta->album.append(value);
-  } else if (APP_STRNCASECMP(key.c_str(), "comment") == 0) {
-    meta->comment.append(value);
+// Decodes and drops |frames|, for streams that cannot seek to --start.
+// Returns false if the stream ends first.
+bool SkipFrames(AudioDecoder* decoder, uint64_t frames) {
+  const AudioFormat& fmt = decoder->Format();
+  uint64_t frame_bytes = fmt.channels * fmt.bits_per_sample / 8;
+  PooledBuffer buffer(decoder->BufferSize());
+  while (frames > 0) {
+    size_t size = static_cast<size_t>(
+        std::min<uint64_t>(buffer.Size(), frames * frame_bytes));
+    size_t read_bytes = decoder->Read(buffer.Data(), size);
+    if (read_bytes == 0)
+      return false;
+    frames -= read_bytes / frame_bytes;
   }
-};
+  return true;
+}
 
-Metadata Metadata_From_OggVorbis_File(OggVorbis_File* vf) {
-  Metadata mt;
-  const VorbisComment* comment = ov_comment(vf, -1);
-  if (comment != nullptr) {
-    for (int i = 0; i < comment->comments; i++) {
-      size_t comment_length = comment->comment_lengths[i];
-      std::string comment_str(comment_length + 1, '\0');
-      strncpy(&comment_str[0], comment->user_comments[i], comment_length);
-      std::vector<std::string> tokens = split(comment_str, '=');
-      if (tokens.size() > 1) {
-        for (size_t j = 1; j < tokens.size(); j++) {
-          MetaAppendField(&mt, tokens[0], tokens[j]);
-        }
-      }
+// Opens |path|, seeks to --start and decodes the first |preroll_ms| from
+// there. Runs on a helper thread while the previous track is still playing.
+// Streams are opened by content and never indexed.
+PreparedTrack PrepareTrack(const std::string& path,
+                           DecoderFactory factory,
+                           int preroll_ms) {
+  PreparedTrack track;
+  bool streamed = IsStreamInput(path);
+  if (streamed) {
+    track.decoder = OpenStreamInput(path);
+    if (!track.decoder)
+      return track;
+  } else {
+    if (factory == nullptr)
+      return track;
+    track.decoder = factory();
+    bool opened = (GetOptions().read_ahead_seconds > 0.0)
+                      ? OpenReadAhead(track.decoder.get(), path)
+                      : track.decoder->Open(path);
+    if (!opened) {
+      track.decoder.reset();
+      return track;
     }
+    MetadataIndex& index = GetMetadataIndex();
+    IndexEntry cached;
+    if (index.Find(path, &cached))
+      track.loudness = cached.loudness;
+    else
+      index.Update(path, IndexEntry_From_Decoder(*track.decoder));
   }
-  return mt;
-}
 
-  // Windows UTF-16 Names
+  const LooperOptions& options = GetOptions();
+  const AudioFormat& fmt = track.decoder->Format();
+  track.position =
+      static_cast<uint64_t>(llround(options.start_seconds * fmt.sample_rate));
+  if (track.position > 0 &&
+      !(streamed ? SkipFrames(track.decoder.get(), track.position)
+                 : track.decoder->Seek(track.position))) {
+    std::string message = string_format("Cannot seek to %.3f s in %s",
+                                        options.start_seconds, path.c_str());
+    TRACE_WARNING(message.c_str());
+    track.decoder.reset();
+    return track;
+  }
+  if (options.end_seconds > 0.0) {
+    track.remaining = static_cast<uint64_t>(llround(
+        (options.end_seconds - options.start_seconds) * fmt.sample_rate));
+  }
 
-#ifdef _WIN32
-int ov_wfopen(const wchar_t* path, OggVorbis_File* vf) {
-  int ret;
-  FILE* f = _wfopen(path, L"rb");
-  if (!f)
-    return -1;
+  size_t frame_bytes = fmt.channels * fmt.bits_per_sample / 8;
+  size_t target = static_cast<size_t>(fmt.sample_rate) * frame_bytes *
+                  preroll_ms / 1000;
+  // Decoded in place a whole buffer at a time, so it may end up to one
+  // buffer past the target.
+  size_t block = track.decoder->BufferSize(), filled = 0;
+  if (target > 0)
+    track.preroll = PooledBuffer(target + block);
+  while (filled < target) {
+    size_t read_bytes = track.decoder->Read(track.preroll.Data() + filled,
+                                            block);
+    if (read_bytes == 0)
+      break;
+    filled += read_bytes;
+  }
+  uint64_t frames = filled / frame_bytes;
+  track.position += frames;
+  if (frames > track.remaining) {
+    filled = static_cast<size_t>(track.remaining) * frame_bytes;
+    frames = track.remaining;
+  }
+  track.preroll.Resize(filled);
+  if (track.remaining != UINT64_MAX)
+    track.remaining -= frames;
+  return track;
+}
 
-  ret = ov_open(f, vf, NULL, 0);
-  if (ret)
-    fclose(f);
-  return ret;
+// Linear gain for a track: --volume plus whichever ReplayGain the options
+// ask for (album falls back to track), held back where the tagged peak would
+// otherwise clip.
+float TrackGain(const Metadata& tags) {
+  const LooperOptions& options = GetOptions();
+  double replaygain = 1.0;
+  float db = NAN, peak = NAN;
+  if (options.replaygain == "album" && !isnan(tags.album_gain)) {
+    db = tags.album_gain;
+    peak = tags.album_peak;
+  } else if (options.replaygain != "off" && !isnan(tags.track_gain)) {
+    db = tags.track_gain;
+    peak = tags.track_peak;
+  }
+  if (!isnan(db)) {
+    replaygain = pow(10.0, db / 20.0);
+    if (!isnan(peak) && peak > 0.0f && replaygain * peak > 1.0)
+      replaygain = 1.0 / peak;
+  }
+  return static_cast<float>(replaygain * pow(10.0, options.volume_db / 20.0));
 }
-#endif
 
-class VorbisPlayer : public SimplePlayer {
+// Applies the track gain to decoded audio and converts it to integer PCM in
+// one pass over float blocks. With unity gain and integer input it stays out
+// of the way, so the sink still gets the decoder's samples untouched.
+class GainStage {
  public:
-  void play(const std::string& path) {
-    OggVorbis_File vf;
-    size_t buffer_size = default_buffer_size, read_bytes = 0;
-
-    AudioResult result, secs;
-
-#ifdef _WIN32
-    std::wstring wpath = to_wstring(path.c_str());
-    result = ov_wfopen(wpath.c_str(), &vf);
-#else
-    result = ov_fopen(path.c_str(), &vf);
-#endif
+  // Returns the format the sink should be configured with.
+  AudioFormat Configure(const AudioFormat& format, float gain) {
+    if (configured && gain == this->gain && SameFormat(format, input))
+      return output;
+    configured = true;
+    input = format;
+    this->gain = gain;
+    active = gain != 1.0f || (format.is_float && GetOptions().float_pipeline);
+    output = format;
+    if (active) {
+      // Float and wide integer streams keep their precision in S32.
+      output.is_float = false;
+      output.bits_per_sample =
+          (format.is_float || format.bits_per_sample > 16) ? 32 : 16;
+    }
+    return output;
+  }
 
-    if (result != 0) {
-      std::string message = string_format("Error opening file %d", result);
-      TRACE_ERROR(message.c_str());
-      AudioExitProcess(AudioStatus::kIoError);
-    } else {
-      std::string message = string_format("Opened %s", path.c_str());
-      TRACE_INFO(message.c_str());
+  bool Active() const { return active; }
+
+  // Converts |*size| bytes; the result stays valid until the next call and
+  // |*size| is updated to its length.
+  const char* Process(const char* data, size_t* size) {
+    size_t in_bytes = input.bits_per_sample / 8;
+    size_t out_bytes = output.bits_per_sample / 8;
+    size_t samples = *size / in_bytes;
+    converted.resize(samples * out_bytes);
+    block.resize(block_samples);
+    for (size_t done = 0; done < samples; done += block_samples) {
+      size_t count =
+          (std::min)(samples - done, static_cast<size_t>(block_samples));
+      LoadFloatSamples(data + done * in_bytes, input, count, gain,
+                       block.data());
+      StoreFloatSamples(block.data(), output, count,
+                        &converted[done * out_bytes]);
     }
+    *size = converted.size();
+    return converted.data();
+  }
 
-    std::string buffer(buffer_size, '\0');
+ private:
+  enum { block_samples = 2048 };
 
-    SetFormat(Format_From_VorbisFile(&vf));
+  AudioFormat input, output;
+  float gain = 1.0f;
+  bool configured = false, active = false;
+  std::vector<char> converted;
+  std::vector<float> block;
+};
 
-    PrintPlayingInfo(Metadata_From_OggVorbis_File(&vf));
+#ifdef __linux__
+// Terminal settings from before raw mode, restored on every way out.
+static struct termios saved_terminal;
+static volatile sig_atomic_t terminal_raw = 0;
+
+void RestoreTerminal() {
+  if (terminal_raw) {
+    tcsetattr(STDIN_FILENO, TCSANOW, &saved_terminal);
+    terminal_raw = 0;
+  }
+}
 
-#ifdef _WIN32
-    SetupBlocks();
+static void RestoreTerminalAndDie(int signal_number) {
+  RestoreTerminal();
+  signal(signal_number, SIG_DFL);
+  raise(signal_number);
+}
+#else
+void RestoreTerminal() {}
 #endif
 
-    Open();
-    int is_bigendian = (IsLittleEndian()) ? 0 : 1;
-    int word_size = (BitsPerSample() == 8) ? 1 : 2;
-
-    for (;;) {
-      read_bytes = ov_read(&vf, &buffer[0], buffer_size, is_bigendian,
-                           word_size, 1, &secs);
+// Turns key presses into commands for the playback thread. Keys are read
+// on a thread of their own with the terminal in raw mode, so nothing is
+// echoed and no Enter is needed; the audio path never waits on input.
+class KeyboardControl {
+ public:
+  ~KeyboardControl() { Stop(); }
 
-      if (read_bytes <= 0)
-        break;
+  // Does nothing unless stdin is a terminal.
+  void Start() {
 #ifdef _WIN32
-      WriteAudio(&buffer[0], read_bytes);
+    if (!_isatty(_fileno(stdin)))
+      return;
 #elif __linux__
-      frames = bytes_to_frames(read_bytes);
-      WriteAudio(&buffer[0], frames);
+    if (!isatty(STDIN_FILENO) || tcgetattr(STDIN_FILENO, &saved_terminal) != 0)
+      return;
+    struct termios raw = saved_terminal;
+    raw.c_lflag &= ~(ICANON | ECHO);
+    raw.c_cc[VMIN] = 1;
+    raw.c_cc[VTIME] = 0;
+    signal(SIGINT, RestoreTerminalAndDie);
+    signal(SIGTERM, RestoreTerminalAndDie);
+    if (tcsetattr(STDIN_FILENO, TCSANOW, &raw) != 0)
+      return;
+    terminal_raw = 1;
 #endif
+    print_color(
+        "Keys: space pause, n next, left/right seek 10 s, +/- volume, "
+        "q quit\n",
+        Color::light_blue);
+    thread = std::thread(&KeyboardControl::Loop, this);
+  }
+
+  void Stop() {
+    if (thread.joinable()) {
+      stopping = true;
+      thread.join();
     }
+    RestoreTerminal();
+  }
 
+ private:
+  void Loop() {
+    // Arrow keys arrive as ESC [ C and the like; |escape| counts how far
+    // into such a sequence the last bytes were.
+    int escape = 0;
+    while (!stopping) {
 #ifdef _WIN32
-    FreeBlocks();
+      if (!_kbhit()) {
+        Sleep(20);
+        continue;
+      }
+      int key = _getch();
+      // Arrows come as a 0 or 0xE0 prefix and then the scan code.
+      if (key == 0 || key == 0xE0) {
+        int code = _getch();
+        if (code == 'K')
+          Post(Command::kSeekBack);
+        else if (code == 'M')
+          Post(Command::kSeekForward);
+        continue;
+      }
+      Key(key, &escape);
+#elif __linux__
+      struct pollfd input = {STDIN_FILENO, POLLIN, 0};
+      if (poll(&input, 1, 100) <= 0)
+        continue;
+      unsigned char keys[16];
+      ssize_t count = read(STDIN_FILENO, keys, sizeof(keys));
+      if (count <= 0)
+        break;
+      for (ssize_t i = 0; i < count; i++)
+        Key(keys[i], &escape);
 #endif
-    Cleanup(&vf);
-    Close();
-    print_color("Done Playing Song\n\n", Color::light_yellow);
+    }
+  }
+
+  void Key(int key, int* escape) {
+    if (*escape == 1 && key == '[') {
+      *escape = 2;
+      return;
+    }
+    if (*escape == 2) {
+      *escape = 0;
+      if (key == 'D')
+        Post(Command::kSeekBack);
+      else if (key == 'C')
+        Post(Command::kSeekForward);
+      return;
+    }
+    *escape = 0;
+    switch (key) {
+      case 27:
+        *escape = 1;
+        break;
+      case ' ':
+        Post(Command::kPause);
+        break;
+      case 'n':
+        Post(Command::kNext);
+        break;
+      case '-':
+        Post(Command::kVolumeDown);
+        break;
+      case '+':
+      case '=':
+        Post(Command::kVolumeUp);
+        break;
+      case 'q':
+        Post(Command::kQuit);
+        break;
+      default:
+        break;
+    }
   }
 
-  void Cleanup(OggVorbis_File* vf) { ov_clear(vf); }
+  // A key pressed faster than sixty-odd times ahead of playback is dropped.
+  void Post(Command command) { GetCommandQueue().Push(command); }
+
+  std::thread thread;
+  std::atomic<bool> stopping{false};
 };
 
-AudioFormat Format_From_FLAC_Metadata(const FLAC__StreamMetadata* metadata) {
-  AudioFormat fmt;
-  fmt.sample_rate = metadata->data.stream_info.sample_rate;
-  fmt.channels = metadata->data.stream_info.channels;
+// Plays a list of tracks back to back into one sink that stays open for the
+// whole session. While a track plays the next one is prepared in the
+// background; when both share a format its samples follow the last frame of
+// the current track directly. Tracks that cannot be opened are skipped.
+class PlaylistPlayer {
+ public:
+  explicit PlaylistPlayer(AudioSink* sink) : sink(sink) {}
+
+  void play(const Playlist& playlist, bool repeat) {
+    if (playlist.Size() == 0)
+      return;
+
+    // The first track has nothing to splice onto, so it skips the preroll
+    // and starts with its first buffer, while the device opens alongside.
+    typedef std::chrono::steady_clock Clock;
+    Clock::time_point started = Clock::now();
+    std::future<void> warmup =
+        std::async(std::launch::async, &AudioSink::Warmup, sink);
+    size_t index = 0, failures = 0;
+    auto entry = playlist.At(0);
+    PreparedTrack current = PrepareTrack(entry.first, entry.second, 0);
+    warmup.get();
+    for (;;) {
+      size_t next_index = (index + 1) % playlist.Size();
+      bool has_next = repeat || next_index != 0;
+      if (!current.decoder) {
+        // Only a whole pass without a single playable track is fatal.
+        if (++failures >= playlist.Size())
+          AudioExitProcess(AudioStatus::kIoError);
+        std::string message = string_format(
+            "Skipping %s", playlist.Path(index).c_str());
+        TRACE_WARNING(message.c_str());
+        if (!has_next)
+          break;
+        entry = playlist.At(next_index);
+        current = PrepareTrack(entry.first, entry.second, 0);
+        index = next_index;
+        continue;
+      }
+      failures = 0;
 
-#ifdef _WIN32
-  int bits_per_sample = metadata->data.stream_info.bits_per_sample;
-  fmt.bits_per_sample = (bits_per_sample == 24) ? 32 : bits_per_sample;
-#else
-  fmt.bits_per_sample = metadata->data.stream_info.bits_per_sample;
-#endif
+      std::future<PreparedTrack> next;
+      if (has_next) {
+        entry = playlist.At(next_index);
+        next = std::async(std::launch::async, PrepareTrack, entry.first,
+                          entry.second, GetOptions().preroll_ms);
+      }
 
-  return fmt;
-}
+      PrintPlayingInfo(current.decoder->Tags(), current.decoder->Duration());
+      loudness = current.loudness;
+      track_gain =
+          TrackGain(WithMeasuredGain(current.decoder->Tags(), loudness));
+      if (track_gain != 1.0f) {
+        std::string message =
+            string_format("Gain %+.2f dB", 20.0 * log10(track_gain));
+        TRACE_INFO(message.c_str());
+      }
+      Configure(current.decoder->Format());
+
+      remaining = current.remaining;
+      position = current.position;
+      Output(current.preroll.Data(), current.preroll.Size());
+      current.preroll = PooledBuffer();
+      PooledBuffer buffer(current.decoder->BufferSize());
+      bool playing = true;
+      while ((playing = HandleCommands(current.decoder.get())) &&
+             Transfer(current.decoder.get(), &buffer))
+        ReportFirstSample(started);
+      // Skipped tracks and those stopped at --end were not read through.
+      if (GetOptions().check && playing && remaining != 0)
+        ReportDamage(playlist.Path(index), current.decoder.get());
+      current.decoder->Close();
+      print_color("Done Playing Song\n\n", Color::light_yellow);
 
-Metadata Metadata_FLAC__StreamMetadata(const FLAC__StreamMetadata* metadata) {
-  Metadata mt;
-  auto tags = metadata->data.vorbis_comment;
-  for (size_t i = 0; i < tags.num_comments; i++) {
-    auto flac_comment = tags.comments[i];
-    size_t length = sizeof(FLAC__byte) * flac_comment.length;
-    std::string comment(length + 1, '\0');
-    strncpy(&comment[0], reinterpret_cast<char*>(flac_comment.entry), length);
-    std::vector<std::string> tokens = split(comment, '=');
-    if (tokens.size() > 1) {
-      for (size_t j = 1; j < tokens.size(); j++) {
-        MetaAppendField(&mt, tokens[0], tokens[j]);
+      if (!has_next || quit)
+        break;
+      current = next.get();
+      index = next_index;
+    }
+    sink->Close();
+    ReportFirstSample(started);
+    sink->PrintStats();
+  }
+
+ private:
+  enum { seek_step_seconds = 10 };
+
+  // Applies the keys pressed since the last buffer. While paused it sleeps
+  // here until the next one, which never holds up the output: the sink
+  // keeps its queued audio. Returns false when the track should stop.
+  bool HandleCommands(AudioDecoder* decoder) {
+    CommandQueue& commands = GetCommandQueue();
+    Command command;
+    for (;;) {
+      if (!commands.Pop(&command)) {
+        if (!paused)
+          return true;
+        commands.WaitPop(&command);
+      }
+      switch (command) {
+        case Command::kPause:
+          paused = !paused;
+          sink->Pause(paused);
+          TRACE_INFO(paused ? "Paused" : "Resumed");
+          break;
+        case Command::kQuit:
+          quit = true;
+          [[fallthrough]];
+        case Command::kNext:
+          sink->Flush();
+          if (paused) {
+            paused = false;
+            sink->Pause(false);
+          }
+          return false;
+        case Command::kSeekBack:
+        case Command::kSeekForward:
+          SeekBy(decoder, (command == Command::kSeekBack) ? -seek_step_seconds
+                                                          : seek_step_seconds);
+          break;
+        case Command::kVolumeDown:
+        case Command::kVolumeUp: {
+          LooperOptions& options = GetOptions();
+          options.volume_db += (command == Command::kVolumeDown) ? -1.0 : 1.0;
+          track_gain = TrackGain(WithMeasuredGain(decoder->Tags(), loudness));
+          Configure(decoder->Format());
+          std::string message =
+              string_format("Volume %+.1f dB", options.volume_db);
+          TRACE_INFO(message.c_str());
+        } break;
       }
     }
   }
-  return mt;
-}
-
-class FlacPlayer : public SimplePlayer {
- public:
-  void play(const std::string& path) {
-    FLAC__bool ok = true;
-    FLAC__StreamDecoder* decoder = 0;
-    FLAC__StreamDecoderInitStatus init_status;
 
-#if _WIN32
-    SetupBlocks();
-#endif
-    if ((decoder = FLAC__stream_decoder_new()) == nullptr) {
-      TRACE_ERROR("allocating decoder");
-      AudioExitProcess(AudioStatus::kIoError);
+  // Moves the decoder |seconds| away from where it is and drops what the
+  // sink still holds from before, so the jump is heard at once.
+  void SeekBy(AudioDecoder* decoder, double seconds) {
+    int64_t frames =
+        static_cast<int64_t>(llround(seconds * decoder->Format().sample_rate));
+    uint64_t target = (frames < 0 && static_cast<uint64_t>(-frames) > position)
+                          ? 0
+                          : position + frames;
+    if (!decoder->Seek(target)) {
+      TRACE_WARNING("Cannot seek there");
+      return;
     }
+    sink->Flush();
+    if (remaining != UINT64_MAX) {
+      uint64_t end = position + remaining;
+      remaining = (end > target) ? end - target : 0;
+    }
+    position = target;
+    std::string message =
+        string_format("At %.1f s",
+                      static_cast<double>(target) / decoder->Format().sample_rate);
+    TRACE_INFO(message.c_str());
+  }
 
-    FLAC__stream_decoder_set_md5_checking(decoder, true);
-    FLAC__stream_decoder_set_metadata_respond(decoder,
-                                              FLAC__METADATA_TYPE_STREAMINFO);
-    FLAC__stream_decoder_set_metadata_respond(
-        decoder, FLAC__METADATA_TYPE_VORBIS_COMMENT);
+  // Prints, once, how long the session took from start to the first sample
+  // reaching the output.
+  void ReportFirstSample(std::chrono::steady_clock::time_point started) {
+    std::chrono::steady_clock::time_point first = sink->FirstSample();
+    if (first_sample_reported ||
+        first == std::chrono::steady_clock::time_point())
+      return;
+    first_sample_reported = true;
+    std::string message = string_format(
+        "Time to first sample: %.1f ms",
+        std::chrono::duration<double, std::milli>(first - started).count());
+    TRACE_INFO(message.c_str());
+  }
 
-#ifdef _WIN32
+  void Configure(const AudioFormat& format) {
+    sink->Configure(gain.Configure(format, track_gain));
+  }
 
-    std::wstring wpath = to_wstring(path.c_str());
-    FILE* audio_file = _wfopen(wpath.c_str(), L"rb");
-    if (audio_file == nullptr) {
-      TRACE_ERROR("Failed to open file");
-      AudioExitProcess(AudioStatus::kIoError);
-    }
-    init_status =
-        FLAC__stream_decoder_init_FILE(decoder, audio_file, write_callback,
-                                       metadata_callback, error_callback, this);
-#else
-    init_status =
-        FLAC__stream_decoder_init_file(decoder, path.c_str(), write_callback,
-                                       metadata_callback, error_callback, this);
-#endif
+  void Output(const char* data, size_t size) {
+    if (size == 0)
+      return;
+    if (gain.Active())
+      data = gain.Process(data, &size);
+    sink->WriteAudio(data, size);
+  }
 
-    if (init_status != FLAC__STREAM_DECODER_INIT_STATUS_OK) {
-      std::string message = string_format(
-          "initializing decoder: %s  %s",
-          FLAC__StreamDecoderInitStatusString[init_status], path.c_str());
-      TRACE_ERROR(message.c_str());
-      AudioExitProcess(AudioStatus::kIoError);
-      ok = false;
-    } else {
-      std::string message = string_format("Opened %s", path.c_str());
-      TRACE_INFO(message.c_str());
+  // Moves one buffer from |decoder| to the sink, decoding straight into the
+  // sink's own memory when it offers any. Returns false at end of stream or
+  // once --end is reached.
+  bool Transfer(AudioDecoder* decoder, PooledBuffer* buffer) {
+    const char* data;
+    char* region;
+    size_t limit = Limit(decoder->Format(), buffer->Size());
+    if (limit == 0)
+      return false;
+    // Samples that still need gain cannot go straight to the sink.
+    size_t capacity = gain.Active() ? 0 : sink->BeginWrite(&region, limit);
+    if (capacity == 0) {
+      size_t read_bytes = decoder->ReadSpan(buffer->Data(), limit, &data);
+      // Chained Ogg links and mpg123 may switch format mid-stream.
+      Configure(decoder->Format());
+      Consume(decoder->Format(), read_bytes);
+      Output(data, read_bytes);
+      return read_bytes > 0;
     }
 
-    if (ok) {
-      ok = FLAC__stream_decoder_process_until_end_of_stream(decoder);
-      std::string message = string_format(
-          "decoding: %s   state: %s", ok ? "succeeded" : "FAILED",
-          FLAC__StreamDecoderStateString[FLAC__stream_decoder_get_state(
-              decoder)]);
-
-      if (ok) {
-        TRACE_SUCCESS(message.c_str());
-      } else {
-        TRACE_ERROR(message.c_str());
-      }
+    AudioFormat before = decoder->Format();
+    size_t read_bytes = decoder->ReadSpan(region, capacity, &data);
+    Consume(decoder->Format(), read_bytes);
+    if (!SameFormat(decoder->Format(), before)) {
+      // The region belongs to the old configuration, so set the samples
+      // aside and queue them once the sink has been renegotiated.
+      memmove(buffer->Data(), data, read_bytes);
+      sink->CommitWrite(0);
+      Configure(decoder->Format());
+      Output(buffer->Data(), read_bytes);
+      return read_bytes > 0;
     }
-
-#ifdef _WIN32
-    FreeBlocks();
-    fclose(audio_file);
-#endif
-    Cleanup(decoder);
-    Close();
-    print_color("Done Playing Song\n\n", Color::light_yellow);
+    if (data != region)
+      memcpy(region, data, read_bytes);
+    sink->CommitWrite(read_bytes);
+    return read_bytes > 0;
   }
 
-  void Cleanup(FLAC__StreamDecoder* decoder) {
-    FLAC__stream_decoder_delete(decoder);
+  void ReportDamage(const std::string& path, AudioDecoder* decoder) {
+    decoder->Verify();
+    if (decoder->ErrorCount() == 0)
+      return;
+    std::string message = string_format(
+        "%zu problems in %s", decoder->ErrorCount(), path.c_str());
+    TRACE_WARNING(message.c_str());
+    for (auto& error : decoder->Errors()) {
+      message = StreamError_To_String(error);
+      TRACE_WARNING(message.c_str());
+    }
   }
 
-  static FLAC__StreamDecoderWriteStatus write_callback(
-      const FLAC__StreamDecoder* decoder,
-      const FLAC__Frame* frame,
-      const FLAC__int32* const buffer[],
-      void* client_data) {
-    (void)decoder;
-
-    FlacPlayer* player = reinterpret_cast<FlacPlayer*>(client_data);
-    uint32_t samples = frame->header.blocksize,
-             channels = frame->header.channels;
-
-    int bits_per_sample = player->BitsPerSample();
+  // |size| clipped to the whole frames left before --end.
+  size_t Limit(const AudioFormat& format, size_t size) const {
+    uint64_t frame_bytes = format.channels * format.bits_per_sample / 8;
+    if (remaining == UINT64_MAX || frame_bytes == 0)
+      return size;
+    return static_cast<size_t>(
+        (std::min)(static_cast<uint64_t>(size), remaining * frame_bytes));
+  }
 
-    static int32_t
-        buf[FLAC__MAX_BLOCK_SIZE * FLAC__MAX_CHANNELS * sizeof(uint32_t)];
+  void Consume(const AudioFormat& format, size_t bytes) {
+    size_t frame_bytes = format.channels * format.bits_per_sample / 8;
+    if (frame_bytes > 0)
+      position += bytes / frame_bytes;
+    if (remaining != UINT64_MAX && frame_bytes > 0)
+      remaining -= (std::min)(remaining,
+                              static_cast<uint64_t>(bytes / frame_bytes));
+  }
 
-#ifdef _WIN32
-    uint32_t decoded_size = samples * channels * (bits_per_sample / 8);
-    uint16_t* u16buf = reinterpret_cast<uint16_t*>(buf);
-    uint32_t* u32buf = reinterpret_cast<uint32_t*>(buf);
-    uint8_t* u8buf = reinterpret_cast<uint8_t*>(buf);
-#endif
+  AudioSink* sink;
+  GainStage gain;
+  float track_gain = 1.0f;
+  Loudness loudness;
+  uint64_t remaining = UINT64_MAX, position = 0;
+  bool paused = false, quit = false;
+  bool first_sample_reported = false;
+};
 
-    if (!(channels == 2 || channels == 1)) {
-      std::string message = string_format(
-          "This frame contains %d channels (should be 1 or 2)", channels);
-      TRACE_ERROR(message.c_str());
-      return FLAC__STREAM_DECODER_WRITE_STATUS_ABORT;
-    }
-    if (buffer[0] == nullptr) {
-      TRACE_ERROR("buffer[0] is null");
-      return FLAC__STREAM_DECODER_WRITE_STATUS_ABORT;
-    }
-    if (buffer[1] == nullptr && 2 == channels) {
-      TRACE_ERROR("buffer[1] is null");
-      return FLAC__STREAM_DECODER_WRITE_STATUS_ABORT;
-    }
-    if (bits_per_sample == 8 || bits_per_sample == 16 ||
-        bits_per_sample == 24 || bits_per_sample == 32) {
-      for (uint32_t sample = 0, i = 0; sample < samples; sample++) {
-        for (uint32_t channel = 0; channel < channels; channel++, i++) {
+uint64_t PeakResidentKiB() {
 #ifdef _WIN32
-          switch (bits_per_sample) {
-            case 8:
-              u8buf[i] = static_cast<uint8_t>(buffer[channel][sample] & 0xff);
-              break;
-            case 16:
-              u16buf[i] =
-                  static_cast<uint16_t>(buffer[channel][sample] & 0xffffff);
-              break;
-            case 24:
-              u32buf[i] = static_cast<uint32_t>(buffer[channel][sample]);
-              break;
-            case 32:
-              u32buf[i] = static_cast<uint32_t>(buffer[channel][sample]);
-              break;
-          }
+  PROCESS_MEMORY_COUNTERS counters;
+  if (!GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)))
+    return 0;
+  return counters.PeakWorkingSetSize / 1024;
 #elif __linux__
-          buf[i] = static_cast<uint32_t>(buffer[channel][sample]);
+  struct rusage usage;
+  if (getrusage(RUSAGE_SELF, &usage) != 0)
+    return 0;
+  return static_cast<uint64_t>(usage.ru_maxrss);
 #endif
-        }
-      }
+}
 
-#ifdef _WIN32
-      player->WriteAudio(reinterpret_cast<LPSTR>(buf), decoded_size);
-#elif __linux
-      player->WriteAudio(buf, samples);
-#endif
+// Deterministic test signal: a logarithmic sweep per channel with a little
+// noise on top, so lossless coders cannot collapse it to nothing.
+std::vector<float> SynthesizeSignal(int seconds, int sample_rate, int channels) {
+  size_t frames = static_cast<size_t>(seconds) * sample_rate;
+  std::vector<float> signal(frames * channels);
+  const double pi = 3.14159265358979323846;
+  const double low = 50.0, high = 12000.0;
+  double rate = log(high / low) / frames;
+  uint32_t seed = 0x12345678;
+  for (int channel = 0; channel < channels; channel++) {
+    double phase = 0.0, offset = 0.25 * pi * channel;
+    for (size_t frame = 0; frame < frames; frame++) {
+      phase += 2.0 * pi * low * exp(rate * frame) / sample_rate;
+      seed = seed * 1664525u + 1013904223u;
+      double noise = (static_cast<int32_t>(seed) / 2147483648.0) * 0.02;
+      signal[frame * channels + channel] =
+          static_cast<float>(0.5 * sin(phase + offset) + noise);
     }
+  }
+  return signal;
+}
 
-    return FLAC__STREAM_DECODER_WRITE_STATUS_CONTINUE;
+bool WriteBenchWav(const std::string& path,
+                   const std::vector<float>& signal,
+                   const AudioFormat& fmt) {
+  std::vector<int16_t> pcm(signal.size());
+  ConvertFloatToS16(signal.data(), pcm.data(), signal.size());
+  FileSink sink(path, true, false);
+  sink.Configure(fmt);
+  sink.WriteAudio(reinterpret_cast<const char*>(pcm.data()),
+                  pcm.size() * sizeof(int16_t));
+  sink.Finish();
+  return !sink.Failed();
+}
+
+bool WriteBenchFlac(const std::string& path,
+                    const std::vector<float>& signal,
+                    const AudioFormat& fmt) {
+  FLAC__StreamEncoder* encoder = FLAC__stream_encoder_new();
+  if (encoder == nullptr)
+    return false;
+  size_t frames = signal.size() / fmt.channels;
+  FLAC__stream_encoder_set_channels(encoder, fmt.channels);
+  FLAC__stream_encoder_set_bits_per_sample(encoder, fmt.bits_per_sample);
+  FLAC__stream_encoder_set_sample_rate(encoder, fmt.sample_rate);
+  FLAC__stream_encoder_set_compression_level(encoder, 5);
+  FLAC__stream_encoder_set_total_samples_estimate(encoder, frames);
+  bool ok = FLAC__stream_encoder_init_file(encoder, path.c_str(), nullptr,
+                                           nullptr) ==
+            FLAC__STREAM_ENCODER_INIT_STATUS_OK;
+
+  const size_t chunk = 4096;
+  std::vector<FLAC__int32> pcm(chunk * fmt.channels);
+  for (size_t frame = 0; ok && frame < frames; frame += chunk) {
+    size_t count = (std::min)(chunk, frames - frame);
+    for (size_t i = 0; i < count * fmt.channels; i++)
+      pcm[i] = FloatToS16(signal[frame * fmt.channels + i]);
+    ok = FLAC__stream_encoder_process_interleaved(
+        encoder, pcm.data(), static_cast<uint32_t>(count));
   }
+  ok = FLAC__stream_encoder_finish(encoder) && ok;
+  FLAC__stream_encoder_delete(encoder);
+  return ok;
+}
 
-  static void metadata_callback(const FLAC__StreamDecoder* decoder,
-                                const FLAC__StreamMetadata* metadata,
-                                void* client_data) {
-    (void)decoder;
-    FlacPlayer* player = reinterpret_cast<FlacPlayer*>(client_data);
+// Writes the pages |os| has ready, or everything it holds when |flush|.
+bool WriteOggPages(ogg_stream_state* os, bool flush, FILE* file) {
+  ogg_page og;
+  while ((flush ? ogg_stream_flush(os, &og) : ogg_stream_pageout(os, &og)) !=
+         0) {
+    if (fwrite(og.header, 1, og.header_len, file) !=
+            static_cast<size_t>(og.header_len) ||
+        fwrite(og.body, 1, og.body_len, file) !=
+            static_cast<size_t>(og.body_len))
+      return false;
+  }
+  return true;
+}
 
-    switch (metadata->type) {
-      case FLAC__METADATA_TYPE_STREAMINFO: {
-        player->SetFormat(Format_From_FLAC_Metadata(metadata));
-        player->Open();
-      } break;
-      case FLAC__METADATA_TYPE_VORBIS_COMMENT: {
-        PrintPlayingInfo(Metadata_FLAC__StreamMetadata(metadata));
-      } break;
-      default:
-        break;
+bool WriteBenchVorbis(const std::string& path,
+                      const std::vector<float>& signal,
+                      const AudioFormat& fmt) {
+  FILE* file = fopen(path.c_str(), "wb");
+  if (file == nullptr)
+    return false;
+
+  vorbis_info vi;
+  vorbis_comment vc;
+  vorbis_dsp_state vd;
+  vorbis_block vb;
+  ogg_stream_state os;
+  ogg_packet op;
+
+  vorbis_info_init(&vi);
+  if (vorbis_encode_init_vbr(&vi, fmt.channels, fmt.sample_rate, 0.4f) != 0) {
+    vorbis_info_clear(&vi);
+    fclose(file);
+    return false;
+  }
+  vorbis_comment_init(&vc);
+  vorbis_comment_add_tag(&vc, "TITLE", "looper bench sweep");
+  vorbis_analysis_init(&vd, &vi);
+  vorbis_block_init(&vd, &vb);
+  ogg_stream_init(&os, 0x6c6f6f70);
+
+  ogg_packet header, header_comment, header_code;
+  vorbis_analysis_headerout(&vd, &vc, &header, &header_comment, &header_code);
+  ogg_stream_packetin(&os, &header);
+  ogg_stream_packetin(&os, &header_comment);
+  ogg_stream_packetin(&os, &header_code);
+  bool ok = WriteOggPages(&os, true, file);
+
+  const size_t chunk = 1024;
+  size_t frames = signal.size() / fmt.channels;
+  for (size_t frame = 0; ok; frame += chunk) {
+    size_t count = (frame < frames) ? (std::min)(chunk, frames - frame) : 0;
+    if (count > 0) {
+      float** buffer = vorbis_analysis_buffer(&vd, static_cast<int>(count));
+      for (size_t i = 0; i < count; i++)
+        for (int channel = 0; channel < fmt.channels; channel++)
+          buffer[channel][i] = signal[(frame + i) * fmt.channels + channel];
+    }
+    // A zero count marks the end of the stream and flushes the encoder.
+    vorbis_analysis_wrote(&vd, static_cast<int>(count));
+    while (ok && vorbis_analysis_blockout(&vd, &vb) == 1) {
+      vorbis_analysis(&vb, nullptr);
+      vorbis_bitrate_addblock(&vb);
+      while (ok && vorbis_bitrate_flushpacket(&vd, &op)) {
+        ogg_stream_packetin(&os, &op);
+        ok = WriteOggPages(&os, false, file);
+      }
     }
+    if (count == 0)
+      break;
   }
+  ok = ok && WriteOggPages(&os, true, file);
+
+  ogg_stream_clear(&os);
+  vorbis_block_clear(&vb);
+  vorbis_dsp_clear(&vd);
+  vorbis_comment_clear(&vc);
+  vorbis_info_clear(&vi);
+  // A full disk may only show when the last buffer is flushed.
+  return fclose(file) == 0 && ok;
+}
 
-  static void error_callback(const FLAC__StreamDecoder* decoder,
-                             FLAC__StreamDecoderErrorStatus status,
-                             void* client_data) {
-    (void)decoder;
-    (void)client_data;
+// Encodes the bench signal with every encoder we link against. MP3 and Opus
+// only have decoders here, so those formats need files on the command line.
+std::vector<std::string> SynthesizeBenchInputs(int seconds) {
+  std::vector<std::string> files;
+  std::error_code error;
+  fs::path dir = fs::temp_directory_path(error) / "looper_bench";
+  if (!error)
+    fs::create_directories(dir, error);
+  if (error) {
     std::string message = string_format(
-        "Got error callback: %s", FLAC__StreamDecoderErrorStatusString[status]);
-    TRACE_ERROR(message.c_str());
+        "Can't create %s: %s", dir.string().c_str(), error.message().c_str());
+    TRACE_WARNING(message.c_str());
+    return files;
   }
-};
 
-AudioFormat Format_From_OggOpusFile(OggOpusFile* op_file) {
   AudioFormat fmt;
+  fmt.channels = 2;
+  fmt.sample_rate = 44100;
+  fmt.bits_per_sample = 16;
+  std::vector<float> signal =
+      SynthesizeSignal(seconds, fmt.sample_rate, fmt.channels);
+
+  typedef bool (*Writer)(const std::string&, const std::vector<float>&,
+                         const AudioFormat&);
+  const std::pair<const char*, Writer> writers[] = {
+      {"sweep.wav", WriteBenchWav},
+      {"sweep.flac", WriteBenchFlac},
+      {"sweep.ogg", WriteBenchVorbis}};
+  for (auto& writer : writers) {
+    std::string path = (dir / writer.first).string();
+    if (writer.second(path, signal, fmt)) {
+      files.push_back(path);
+    } else {
+      std::string message = string_format("Can't synthesise %s", path.c_str());
+      TRACE_WARNING(message.c_str());
+    }
+  }
+  return files;
+}
 
-  const OpusHead* head = op_head(op_file, -1);
-  if (head != nullptr) {
-    fmt.sample_rate = head->input_sample_rate;
-    fmt.channels = head->channel_count;
-    fmt.bits_per_sample = 16;
+typedef struct _BenchResult {
+  std::string path;
+  uint64_t frames = 0, pcm_bytes = 0, file_bytes = 0;
+  double seconds = 0.0, audio_seconds = 0.0;
+  double p50_us = 0.0, p99_us = 0.0, max_us = 0.0;
+  uint64_t peak_rss_kib = 0;
+} BenchResult;
+
+// Decodes |path| as fast as possible, timing every Read() call.
+bool BenchFile(const std::string& path,
+               DecoderFactory factory,
+               BenchResult* result) {
+  typedef std::chrono::steady_clock Clock;
+  std::unique_ptr<AudioDecoder> decoder = factory();
+  Clock::time_point start = Clock::now();
+  if (!decoder->Open(path))
+    return false;
+
+  NullSink sink;
+  sink.Configure(decoder->Format());
+  std::vector<double> latencies;
+  std::string buffer(decoder->BufferSize(), '\0');
+  for (;;) {
+    const char* data;
+    Clock::time_point before = Clock::now();
+    size_t read_bytes = decoder->ReadSpan(&buffer[0], buffer.size(), &data);
+    Clock::time_point after = Clock::now();
+    if (read_bytes == 0)
+      break;
+    latencies.push_back(
+        std::chrono::duration<double, std::micro>(after - before).count());
+    sink.WriteAudio(data, read_bytes);
+    const AudioFormat& fmt = decoder->Format();
+    result->frames += read_bytes / (fmt.channels * fmt.bits_per_sample / 8);
+    result->audio_seconds += static_cast<double>(read_bytes) /
+                             (fmt.channels * fmt.bits_per_sample / 8) /
+                             fmt.sample_rate;
   }
-  return fmt;
+  decoder->Close();
+  sink.Close();
+
+  result->path = path;
+  result->seconds =
+      std::chrono::duration<double>(Clock::now() - start).count();
+  result->pcm_bytes = sink.bytes_written;
+  result->file_bytes = fs::file_size(fs::path(path));
+  if (!latencies.empty()) {
+    std::sort(latencies.begin(), latencies.end());
+    result->p50_us = latencies[latencies.size() / 2];
+    result->p99_us = latencies[latencies.size() * 99 / 100];
+    result->max_us = latencies.back();
+  }
+  result->peak_rss_kib = PeakResidentKiB();
+  return true;
 }
-Metadata Metadata_From_OggOpusFile(OggOpusFile* op_file) {
-  Metadata mt;
-  const OpusTags* tags = op_tags(op_file, -1);
-  if (tags != nullptr) {
-    for (int i = 0; i < tags->comments; i++) {
-      size_t comment_length = tags->comment_lengths[i];
-      std::string comment(comment_length + 1, '\0');
-      strncpy(&comment[0], tags->user_comments[i], comment_length);
-      std::vector<std::string> tokens = split(comment, '=');
-      if (tokens.size() > 1) {
-        for (size_t j = 1; j < tokens.size(); j++) {
-          MetaAppendField(&mt, tokens[0], tokens[j]);
-        }
+
+// Times the resampler on one channel of float audio, at every quality, for
+// the common 44.1 <-> 48 kHz conversions. Cost scales linearly with channels.
+void BenchResampler(int seconds) {
+  typedef std::chrono::steady_clock Clock;
+  static const int rates[][2] = {{44100, 48000}, {48000, 44100}};
+  static const char* qualities[] = {"low", "medium", "high"};
+  print_color("resample  quality  taps  ns/sample  xRT per channel\n",
+              Color::light_yellow);
+  for (auto& rate : rates) {
+    std::vector<float> signal = SynthesizeSignal(seconds, rate[0], 1);
+    AudioFormat fmt;
+    fmt.channels = 1;
+    fmt.sample_rate = rate[0];
+    fmt.bits_per_sample = 32;
+    fmt.is_float = true;
+    for (const char* quality : qualities) {
+      Resampler resampler;
+      resampler.Configure(fmt, rate[1], quality);
+      const size_t chunk = 4096;
+      uint64_t produced = 0;
+      Clock::time_point start = Clock::now();
+      for (size_t done = 0; done < signal.size(); done += chunk) {
+        size_t size = (std::min)(chunk, signal.size() - done) * sizeof(float);
+        resampler.Process(reinterpret_cast<const char*>(&signal[done]), &size);
+        produced += size / sizeof(float);
       }
+      double elapsed = (std::max)(
+          std::chrono::duration<double>(Clock::now() - start).count(), 1e-9);
+      std::cout << string_format(
+          "%d->%d  %s  %zu  %.1f  %.0fx\n", rate[0], rate[1], quality,
+          resampler.Taps(), elapsed * 1e9 / (std::max)(produced, uint64_t(1)),
+          static_cast<double>(signal.size()) / rate[0] / elapsed);
     }
   }
-  return mt;
 }
-class OpusPlayer : public SimplePlayer {
- public:
-  void play(const std::string& path) {
-    int err;
-    OggOpusFile* op_file = op_open_file(path.c_str(), &err);
-    if (err) {
-      TRACE_ERROR("Failed to Open File");
-      AudioExitProcess(AudioStatus::kIoError);
-    } else {
-      std::string message = string_format("Opened %s", path.c_str());
-      TRACE_INFO(message.c_str());
-    }
 
-    SetFormat(Format_From_OggOpusFile(op_file));
-
-    PrintPlayingInfo(Metadata_From_OggOpusFile(op_file));
+void RunBenchmark(std::vector<std::string> files,
+                  const PlayerRegistry& registry) {
+  if (files.empty())
+    files = SynthesizeBenchInputs(GetOptions().bench_seconds);
+
+  print_color("file  frames/s  PCM MB/s  input MB/s  xRT  "
+              "read p50/p99/max (us)  peak RSS (KiB)\n",
+              Color::light_yellow);
+  for (auto& file : files) {
+    DecoderFactory factory = FindPlayer(registry, file);
+    if (factory == nullptr) {
+      std::string message =
+          string_format("No player registered for %s", file.c_str());
+      TRACE_WARNING(message.c_str());
+      continue;
+    }
+    BenchResult result;
+    if (!BenchFile(file, factory, &result)) {
+      std::string message = string_format("Can't decode %s", file.c_str());
+      TRACE_ERROR(message.c_str());
+      continue;
+    }
+    double seconds = (std::max)(result.seconds, 1e-9);
+    std::cout << string_format(
+        "%s  %.0f  %.1f  %.2f  %.1fx  %.0f/%.0f/%.0f  %llu\n",
+        fs::path(file).filename().string().c_str(), result.frames / seconds,
+        result.pcm_bytes / seconds / 1e6, result.file_bytes / seconds / 1e6,
+        result.audio_seconds / seconds, result.p50_us, result.p99_us,
+        result.max_us, static_cast<unsigned long long>(result.peak_rss_kib));
+  }
+  BenchResampler(GetOptions().bench_seconds);
+}
 
-    static opus_int16 buf[0x1000];
+void PrintUsage() {
+  print_color("Usage: looper [options] <files...>\n", Color::light_yellow);
+  std::cout << "  --bench              decode files (or synthesised signals) "
+               "flat out and report speed\n"
+               "  --bench-seconds=N    length of synthesised bench signals\n"
+               "  --output=SINK        device (default), null, wav:<path> or "
+               "raw:<path>\n"
+               "  --mmap               write to ALSA through mmap access, "
+               "falling back to read/write\n"
+               "  --ring-ms=N          decode-ahead ring size in ms (0 "
+               "disables the output thread)\n"
+               "  --high-watermark=P   ring fill (percent) before output "
+               "starts and decoding pauses\n"
+               "  --low-watermark=P    ring fill (percent) at which paused "
+               "decoding resumes\n"
+               "  --preroll-ms=N       audio of the next track decoded ahead "
+               "for gapless playback\n"
+               "  --read-ahead=S       seconds of each file read ahead on an "
+               "I/O thread\n"
+               "  --memory-budget=SIZE cap on ring, read-ahead and decode "
+               "buffers, e.g. 16M\n"
+               "  --period-us=N        requested ALSA period length "
+               "(negotiated value is reported)\n"
+               "  --buffer-us=N        requested ALSA buffer length\n"
+               "  --float              decode to float and convert once, "
+               "after gain\n"
+               "  --volume=DB          playback gain in dB\n"
+               "  --replaygain=MODE    off (default), track or album\n"
+               "  --resample-quality=Q low, medium (default) or high, when "
+               "the device rate differs\n"
+               "  --index=PATH         metadata index file, or off (default: "
+               "per-user cache)\n"
+               "  --probe              print format and tags of every file "
+               "as JSON lines\n"
+               "  --verify             decode every file in parallel and "
+               "report corrupt ones\n"
+               "  --check              verify each track that plays to its "
+               "end (FLAC MD5 etc.)\n"
+               "  --export=DIR         decode every file in parallel into "
+               "DIR instead of playing\n"
+               "  --export-format=F    wav (default, RF64 past 4 GiB) or "
+               "raw\n"
+               "  --analyze-loudness   measure EBU R128 loudness and true "
+               "peak in parallel,\n"
+               "                       kept in the index for --replaygain\n"
+               "  --jobs=N             threads for scanning, probing, "
+               "verifying, exporting\n"
+               "                       and analysing (default: all cores)\n"
+               "  --start=TIME         start every track at [[h:]m:]s\n"
+               "  --end=TIME           stop every track at [[h:]m:]s\n";
+}
 
-    int read_bytes;
+// Parses [[h:]m:]s with an optional fraction, e.g. 90, 1:30 or 1:02:03.5.
+bool ParseTime(const std::string& text, double* seconds) {
+  std::vector<std::string> fields = split(text, ':');
+  if (fields.empty() || fields.size() > 3)
+    return false;
+  double total = 0.0;
+  for (auto& field : fields) {
+    char* end;
+    double value = strtod(field.c_str(), &end);
+    if (field.empty() || *end != '\0' || value < 0.0)
+      return false;
+    total = total * 60.0 + value;
+  }
+  *seconds = total;
+  return true;
+}
 
-#ifdef _WIN32
-    SetupBlocks();
-#endif
-    Open();
+// Parses a byte count with an optional K, M or G suffix, e.g. 512K or 64M.
+bool ParseSize(const std::string& text, size_t* bytes) {
+  char* end;
+  double value = strtod(text.c_str(), &end);
+  double scale = 1.0;
+  switch (toupper(static_cast<unsigned char>(*end))) {
+    case 'G':
+      scale *= 1024.0;
+      [[fallthrough]];
+    case 'M':
+      scale *= 1024.0;
+      [[fallthrough]];
+    case 'K':
+      scale *= 1024.0;
+      end++;
+      break;
+  }
+  if (text.empty() || *end != '\0' || value < 0.0)
+    return false;
+  *bytes = static_cast<size_t>(value * scale);
+  return true;
+}
 
-    for (;;) {
-      read_bytes = op_read(op_file, buf, 0x1000, nullptr);
-      if (read_bytes <= 0) {
-        break;
-      }
-#ifdef _WIN32
-      WriteAudio(reinterpret_cast<LPSTR>(buf), read_bytes * Channels() * 2);
-#elif __linux__
-      frames = bytes_to_frames(read_bytes * Channels() * 2);
-      WriteAudio(&buf[0], frames);
-#endif
+// Returns false when |arg| looks like an option but cannot be parsed.
+bool ParseOption(const std::string& arg, LooperOptions* options) {
+  size_t separator = arg.find('=');
+  if (separator == std::string::npos) {
+    if (arg == "--bench") {
+      options->bench = true;
+      return true;
     }
-#ifdef _WIN32
-    FreeBlocks();
-#endif
-    Close();
-    print_color("Done Playing Song\n\n", Color::light_yellow);
+    if (arg == "--mmap") {
+      options->mmap = true;
+      return true;
+    }
+    if (arg == "--float") {
+      options->float_pipeline = true;
+      return true;
+    }
+    if (arg == "--probe") {
+      options->probe = true;
+      return true;
+    }
+    if (arg == "--verify") {
+      options->verify = true;
+      return true;
+    }
+    if (arg == "--check") {
+      options->check = true;
+      return true;
+    }
+    if (arg == "--analyze-loudness") {
+      options->analyze_loudness = true;
+      return true;
+    }
+    return false;
   }
-};
-
-typedef std::map<std::string, SimplePlayer*> PlayerRegistry;
+  std::string name = arg.substr(0, separator);
+  std::string text = arg.substr(separator + 1);
+  int value = atoi(text.c_str());
+  if (name == "--bench-seconds") {
+    options->bench_seconds = value;
+  } else if (name == "--output") {
+    options->output = text;
+  } else if (name == "--ring-ms") {
+    options->ring_ms = value;
+  } else if (name == "--high-watermark") {
+    options->high_watermark = value;
+  } else if (name == "--low-watermark") {
+    options->low_watermark = value;
+  } else if (name == "--preroll-ms") {
+    options->preroll_ms = value;
+  } else if (name == "--read-ahead") {
+    options->read_ahead_seconds = atof(text.c_str());
+  } else if (name == "--memory-budget") {
+    return ParseSize(text, &options->memory_budget);
+  } else if (name == "--period-us") {
+    options->period_us = value;
+  } else if (name == "--buffer-us") {
+    options->buffer_us = value;
+  } else if (name == "--volume") {
+    options->volume_db = atof(text.c_str());
+  } else if (name == "--replaygain") {
+    if (text != "off" && text != "track" && text != "album")
+      return false;
+    options->replaygain = text;
+  } else if (name == "--export") {
+    options->export_dir = text;
+    return !text.empty();
+  } else if (name == "--export-format") {
+    if (text != "wav" && text != "raw")
+      return false;
+    options->export_format = text;
+  } else if (name == "--jobs") {
+    options->jobs = value;
+  } else if (name == "--index") {
+    options->index = text;
+  } else if (name == "--resample-quality") {
+    if (text != "low" && text != "medium" && text != "high")
+      return false;
+    options->resample_quality = text;
+  } else if (name == "--start") {
+    return ParseTime(text, &options->start_seconds);
+  } else if (name == "--end") {
+    return ParseTime(text, &options->end_seconds);
+  } else {
+    return false;
+  }
+  return true;
+}
 
 #ifdef _WIN32
 int __cdecl main()
@@ -1170,20 +8038,13 @@ int __cdecl main()
 int main(int argc, char* argv[])
 #endif
 {
+  PlayerRegistry registry = {{".opus", &CreateDecoder<OpusPlayer>},
+                             {".mp3", &CreateDecoder<MP3Player>},
+                             {".ogg", &CreateDecoder<VorbisPlayer>},
+                             {".flac", &CreateDecoder<FlacPlayer>},
+                             {".wav", &CreateDecoder<WavPlayer>}};
 
-  WavPlayer wav_player;
-  MP3Player mp3_player;
-  VorbisPlayer vorbis_player;
-  FlacPlayer flac_player;
-  OpusPlayer opus_player;
-
-  PlayerRegistry registry = {{".opus", &opus_player},
-                             {".mp3", &mp3_player},
-                             {".ogg", &vorbis_player},
-                             {".flac", &flac_player},
-                             {".wav", &wav_player}};
-
-  std::vector<std::string> songs;
+  std::vector<std::string> args, songs;
   std::string extension;
 
 #ifdef _WIN32
@@ -1196,7 +8057,7 @@ int main(int argc, char* argv[])
     AudioExitProcess(AudioStatus::kIoError);
   } else {
     for (int i = 1; i < nArgs; ++i) {
-      songs.push_back(to_string(szArgList[i]));
+      args.push_back(to_string(szArgList[i]));
     }
   }
   LocalFree(szArgList);
@@ -1206,50 +8067,267 @@ int main(int argc, char* argv[])
     AudioExitProcess(AudioStatus::kIoError);
   } else {
     for (int i = 1; i < argc; ++i) {
-      songs.push_back(argv[i]);
+      args.push_back(argv[i]);
+    }
+  }
+#endif
+
+  LooperOptions& options = GetOptions();
+  for (auto& arg : args) {
+    if (arg.compare(0, 2, "--") != 0) {
+      songs.push_back(arg);
+    } else if (!ParseOption(arg, &options)) {
+      std::string message = string_format("Unknown option %s", arg.c_str());
+      TRACE_ERROR(message.c_str());
+      PrintUsage();
+      AudioExitProcess(AudioStatus::kIoError);
     }
   }
+  if (options.high_watermark < 1 || options.high_watermark > 100 ||
+      options.low_watermark < 0 ||
+      options.low_watermark >= options.high_watermark) {
+    TRACE_ERROR("watermarks must satisfy 0 <= low < high <= 100");
+    AudioExitProcess(AudioStatus::kIoError);
+  }
+  if (options.end_seconds > 0.0 &&
+      options.end_seconds <= options.start_seconds) {
+    TRACE_ERROR("--end must come after --start");
+    AudioExitProcess(AudioStatus::kIoError);
+  }
+  GetMemoryBudget().SetLimit(options.memory_budget);
+  std::unique_ptr<AudioSink> sink = CreateSink(options.output);
+  if (!sink) {
+    std::string message =
+        string_format("Unknown output %s", options.output.c_str());
+    TRACE_ERROR(message.c_str());
+    PrintUsage();
+    AudioExitProcess(AudioStatus::kIoError);
+  }
+
+  mpg123_init();
+
+#ifdef __linux__
+  signal(SIGUSR1, RequestXrunReport);
 #endif
+
+  if (options.bench) {
+    RunBenchmark(songs, registry);
+    mpg123_exit();
+    return 0;
+  }
+
+  MetadataIndex& index = GetMetadataIndex();
+  if (options.index != "off")
+    index.Load(options.index.empty() ? DefaultIndexPath() : options.index);
+
+  // Directories are scanned and probed in parallel; their files join the
+  // playlist in sorted order, in place of the directory. Playlist files are
+  // streamed into it entry by entry.
+  typedef std::chrono::steady_clock Clock;
+  Clock::time_point scan_start = Clock::now();
+  WorkStealingPool pool(options.jobs > 0 ? options.jobs
+                                         : std::thread::hardware_concurrency());
+  Playlist playlist(registry);
   fs::path current_path;
-  bool should_continue = true;
-  while (should_continue) {
-    for (auto& song : songs) {
+  bool repeat = true;
+  for (auto& song : songs) {
 #ifdef _WIN32
-      current_path = to_wstring(song.c_str());
+    current_path = to_wstring(song.c_str());
 #else
-      current_path = song;
-#endif
-      extension = current_path.extension().string();
-      if (fs::exists(current_path)) {
-        if (registry.find(extension) != registry.end()) {
-          if (extension == ".mp3") {
-            MP3Player* player =
-                reinterpret_cast<MP3Player*>(registry[extension]);
-            player->play(song);
-          } else if (extension == ".opus") {
-            OpusPlayer* player =
-                reinterpret_cast<OpusPlayer*>(registry[extension]);
-            player->play(song);
-          } else if (extension == ".wav") {
-            WavPlayer* player =
-                reinterpret_cast<WavPlayer*>(registry[extension]);
-            player->play(song);
-          } else if (extension == ".ogg") {
-            VorbisPlayer* player =
-                reinterpret_cast<VorbisPlayer*>(registry[extension]);
-            player->play(song);
-          } else if (extension == ".flac") {
-            FlacPlayer* player =
-                reinterpret_cast<FlacPlayer*>(registry[extension]);
-            player->play(song);
-          }
-        } else {
-          should_continue = false;
-          TRACE_ERROR("Wrong format cannot continue");
-          break;
-        };
+    current_path = song;
+#endif
+    extension = current_path.extension().string();
+    // A stream can only be played once, so the playlist does not loop.
+    if (IsStreamInput(song)) {
+      playlist.Add(song);
+      repeat = false;
+      continue;
+    }
+    if (!fs::exists(current_path))
+      continue;
+    if (fs::is_directory(current_path)) {
+      std::vector<ProbeResult> scanned;
+      for (auto& file : ScanDirectory(song, registry, &pool)) {
+        ProbeResult result;
+        result.path = file;
+        result.factory = FindPlayer(registry, file);
+        scanned.push_back(result);
+      }
+      // Scanned files that turn out not to be playable are left out, but
+      // --probe, --verify, --export and --analyze-loudness report on them
+      // too.
+      bool report_all = options.probe || options.verify ||
+                        !options.export_dir.empty() ||
+                        options.analyze_loudness;
+      if (!report_all)
+        RunOnPool(&scanned, ProbeFile, &pool);
+      for (auto& result : scanned) {
+        if (report_all || result.ok)
+          playlist.Add(result.path);
+      }
+      continue;
+    }
+    if (Playlist::IsPlaylist(song)) {
+      if (!playlist.Load(song)) {
+        std::string message =
+            string_format("Can't read playlist %s", song.c_str());
+        TRACE_ERROR(message.c_str());
+      }
+      continue;
+    }
+    auto it = registry.find(extension);
+    if (it == registry.end()) {
+      repeat = false;
+      TRACE_ERROR("Wrong format cannot continue");
+      break;
+    }
+    playlist.Add(song);
+  }
+
+  if (options.probe) {
+    auto tracks = BatchResults<ProbeResult>(playlist);
+    RunOnPool(&tracks, ProbeFile, &pool);
+    for (auto& track : tracks)
+      std::cout << ProbeResult_To_Json(track) << "\n";
+    index.Save();
+    double seconds =
+        std::chrono::duration<double>(Clock::now() - scan_start).count();
+    std::cerr << string_format("Probed %zu files in %.2f s on %u threads\n",
+                               tracks.size(), seconds, pool.Threads());
+    mpg123_exit();
+    return 0;
+  }
+
+  if (options.verify) {
+    auto tracks = BatchResults<VerifyResult>(playlist);
+    double seconds = RunOnPool(&tracks, VerifyFile, &pool);
+    size_t corrupt = 0, unreadable = 0;
+    uint64_t bytes = 0;
+    double audio_seconds = 0.0;
+    for (auto& track : tracks) {
+      std::cout << VerifyResult_To_String(track);
+      unreadable += !track.opened;
+      corrupt += track.error_count > 0;
+      bytes += track.file_bytes;
+      audio_seconds += track.audio_seconds;
+    }
+    std::cerr << string_format(
+        "Verified %zu files, %zu corrupt, %zu unreadable: %.1f MB %s\n",
+        tracks.size(), corrupt, unreadable, bytes / 1e6,
+        BatchSpeed(seconds, pool.Threads(), bytes, audio_seconds).c_str());
+    mpg123_exit();
+    return (corrupt + unreadable > 0) ? static_cast<int>(AudioStatus::kIoError)
+                                      : 0;
+  }
+
+  if (!options.export_dir.empty()) {
+    std::error_code error;
+    fs::create_directories(fs::path(options.export_dir), error);
+    if (error) {
+      std::string message = string_format("Can't create directory %s",
+                                          options.export_dir.c_str());
+      TRACE_ERROR(message.c_str());
+      AudioExitProcess(AudioStatus::kIoError);
+    }
+    auto tracks = BatchResults<ExportResult>(playlist);
+    NameExports(&tracks, options.export_dir);
+    double seconds = RunOnPool(&tracks, ExportFile, &pool);
+    size_t failed = 0;
+    uint64_t file_bytes = 0, pcm_bytes = 0;
+    double audio_seconds = 0.0;
+    for (auto& track : tracks) {
+      if (!track.ok) {
+        failed++;
+        std::string message =
+            string_format("Can't export %s", track.path.c_str());
+        TRACE_ERROR(message.c_str());
+        continue;
+      }
+      std::cout << track.path << " -> " << track.output << "\n";
+      file_bytes += track.file_bytes;
+      pcm_bytes += track.pcm_bytes;
+      audio_seconds += track.audio_seconds;
+    }
+    std::cerr << string_format(
+        "Exported %zu files, %zu failed: %.1f MB in, %.1f MB out %s\n",
+        tracks.size() - failed, failed, file_bytes / 1e6, pcm_bytes / 1e6,
+        BatchSpeed(seconds, pool.Threads(), pcm_bytes, audio_seconds).c_str());
+    mpg123_exit();
+    return failed > 0 ? static_cast<int>(AudioStatus::kIoError) : 0;
+  }
+
+  if (options.analyze_loudness) {
+    if (options.index == "off")
+      TRACE_WARNING("--index=off: loudness is measured but not kept");
+    auto tracks = BatchResults<LoudnessResult>(playlist);
+    double seconds = RunOnPool(&tracks, AnalyzeFile, &pool);
+    MeasureAlbums(&tracks);
+    size_t failed = 0;
+    uint64_t bytes = 0;
+    double audio_seconds = 0.0;
+    for (auto& track : tracks) {
+      if (!track.ok) {
+        failed++;
+        std::string message =
+            string_format("Can't analyze %s", track.path.c_str());
+        TRACE_ERROR(message.c_str());
+        continue;
       }
+      std::cout << LoudnessResult_To_String(track);
+      bytes += track.file_bytes;
+      audio_seconds += track.audio_seconds;
+      if (!IsStreamInput(track.path))
+        index.Update(track.path, track.entry);
+    }
+    index.Save();
+    std::cerr << string_format(
+        "Analyzed %zu files, %zu failed: %.0f s of audio, %.1f MB %s, %.0fx "
+        "per thread\n",
+        tracks.size() - failed, failed, audio_seconds, bytes / 1e6,
+        BatchSpeed(seconds, pool.Threads(), bytes, audio_seconds).c_str(),
+        audio_seconds / seconds / pool.Threads());
+    mpg123_exit();
+    return failed > 0 ? static_cast<int>(AudioStatus::kIoError) : 0;
+  }
+
+  // Looping only makes sense when someone is listening.
+  if (options.output != "device")
+    repeat = false;
+
+  // What the index already knows costs one mapping and a stat per track.
+  if (options.index != "off") {
+    size_t known = 0;
+    double total = 0.0;
+    for (size_t i = 0; i < playlist.Size(); i++) {
+      IndexEntry cached;
+      if (!index.Find(playlist.Path(i), &cached))
+        continue;
+      known++;
+      if (cached.duration >= 0.0)
+        total += cached.duration;
     }
+    int seconds = static_cast<int>(total + 0.5);
+    std::string message = string_format(
+        "%zu tracks, %zu indexed, %d:%02d:%02d known length", playlist.Size(),
+        known, seconds / 3600, seconds / 60 % 60, seconds % 60);
+    TRACE_INFO(message.c_str());
   }
+
+  // Keys only make sense when someone is listening, too.
+  KeyboardControl keyboard;
+  if (options.output == "device")
+    keyboard.Start();
+  PlaylistPlayer player(sink.get());
+  player.play(playlist, repeat);
+  keyboard.Stop();
+  index.Save();
+  if (options.memory_budget > 0) {
+    std::string message = string_format(
+        "Peak buffer memory %zu KiB of %zu KiB budget",
+        GetMemoryBudget().Peak() / 1024, options.memory_budget / 1024);
+    TRACE_INFO(message.c_str());
+  }
+
+  mpg123_exit();
   return 0;
 }